@@ -2,6 +2,7 @@
 // Usage:
 //   Interactive: ./kv-client interactive
 //   Batch:       ./kv-client batch <commands.txt>
+//   Pipelined:   ./kv-client pipeline <commands.txt> <out.txt> <server-ip> <server-port> [window] [connections]
 //
 // Commands (typed by user or in the batch file):
 //   connect <server-ip> <server-port>
@@ -21,9 +22,15 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 
 #define MAXLINE 8192
@@ -31,9 +38,8 @@
 static int conn_fd = -1;
 
 /* ------------- TCP helpers ------------- */
-static int connect_to(const char *host, int port) {
-    if (conn_fd != -1) return -2; // already connected
-
+// Returns a connected socket, or -3 (lookup failed) / -4 (connect failed)
+static int open_socket(const char *host, int port) {
     struct addrinfo hints, *res = NULL, *rp = NULL;
     char portstr[16];
     snprintf(portstr, sizeof(portstr), "%d", port);
@@ -55,7 +61,13 @@ static int connect_to(const char *host, int port) {
     }
     freeaddrinfo(res);
     if (fd == -1) return -4;
+    return fd;
+}
 
+static int connect_to(const char *host, int port) {
+    if (conn_fd != -1) return -2; // already connected
+    int fd = open_socket(host, port);
+    if (fd < 0) return fd;
     conn_fd = fd;
     return 0;
 }
@@ -404,9 +416,330 @@ static void run_batch(const char *filename) {
     if (conn_fd != -1) disconnect_now();
 }
 
+/* ------------- Pipelined batch mode ------------- */
+// ./kv-client pipeline <commands.txt> <out.txt> <server-ip> <server-port> [window] [connections]
+//
+// Batch mode waits for every answer before it sends the next command, so a
+// 1M line file costs 1M round trips. Here the command file is mmap'ed and
+// commands are streamed with up to `window` (default 64) of them waiting
+// for an answer. The server answers a connection's commands in order, so
+// answers are matched to commands first-in first-out and written to
+// <out.txt> in file order, in the same text batch mode prints.
+// connect/disconnect/help/quit lines are skipped: the server comes from
+// the command line.
+//
+// With several connections the file is cut into that many line ranges
+// that run in parallel, and the output is still in file order. Commands in
+// different ranges are not ordered against each other: keep the commands
+// for one key in one range, or use one connection.
+
+enum { P_LOCAL, P_STATUS, P_READ };
+
+typedef struct {
+    int kind;       // P_LOCAL: answered without the server, msg is the answer
+    char msg[128];
+} Pending;
+
+typedef struct {
+    Pending *items;   // ring
+    size_t head, count, cap;
+} PendingQueue;
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} Buf;
+
+typedef struct {
+    const char *begin, *end;   // line range of the mapped file
+    const char *host;
+    int port, window;
+    FILE *out;
+    long commands;             // sent to the server
+    int failed;
+} PipeJob;
+
+static Pending *pq_push(PendingQueue *q) {
+    if (q->count == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 256;
+        Pending *items = (Pending*)malloc(cap * sizeof(Pending));
+        if (!items) return NULL;
+        for (size_t i = 0; i < q->count; ++i) items[i] = q->items[(q->head + i) % q->cap];
+        free(q->items);
+        q->items = items;
+        q->head = 0;
+        q->cap = cap;
+    }
+    return &q->items[(q->head + q->count++) % q->cap];
+}
+
+static void pq_pop(PendingQueue *q) {
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+}
+
+static int buf_reserve(Buf *b, size_t extra) {
+    if (b->len + extra <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap : 65536;
+    while (cap < b->len + extra) cap *= 2;
+    char *d = (char*)realloc(b->data, cap);
+    if (!d) return -1;
+    b->data = d;
+    b->cap = cap;
+    return 0;
+}
+
+static int buf_append(Buf *b, const char *p, size_t n) {
+    if (buf_reserve(b, n) < 0) return -1;
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    return 0;
+}
+
+static void buf_consume(Buf *b, size_t n) {
+    memmove(b->data, b->data + n, b->len - n);
+    b->len -= n;
+}
+
+// Turns one line of the command file into a request in `sb`, or into a
+// local answer (usage errors). Returns 1 if a request was queued, 0 if
+// not, -1 when out of memory.
+static int pipe_encode(const char *p, size_t n, Buf *sb, PendingQueue *q) {
+    char line[MAXLINE];
+    if (n >= sizeof(line)) n = sizeof(line) - 1;
+    memcpy(line, p, n);
+    line[n] = '\0';
+    if (line[0] == '\0' || line[0] == '#') return 0;
+
+    char first[16] = {0};
+    sscanf(line, "%15s", first);
+    to_lower(first);
+    if (first[0] == '\0' || strcmp(first, "connect") == 0 || strcmp(first, "disconnect") == 0 ||
+        strcmp(first, "help") == 0 || strcmp(first, "quit") == 0 || strcmp(first, "exit") == 0)
+        return 0;
+
+    Pending *pd = pq_push(q);
+    if (!pd) return -1;
+    pd->kind = P_LOCAL;
+    char header[256];
+    int hl;
+
+    if (strcmp(first, "create") == 0 || strcmp(first, "update") == 0) {
+        int key; size_t sz; const char *val_start = NULL;
+        if (split_key_size_value(line, &key, &sz, &val_start) != 0) {
+            snprintf(pd->msg, sizeof(pd->msg), "ERR usage: %s <key> <value-size> <value>", first);
+            return 0;
+        }
+        size_t actual_len = strlen(val_start);
+        if (actual_len != sz) {
+            snprintf(pd->msg, sizeof(pd->msg), "ERR value-size (%zu) does not match actual length (%zu)", sz, actual_len);
+            return 0;
+        }
+        hl = snprintf(header, sizeof(header), "%s %d %zu\n",
+                      (strcmp(first, "create") == 0) ? "CREATE" : "UPDATE", key, sz);
+        if (buf_append(sb, header, (size_t)hl) < 0 || buf_append(sb, val_start, sz) < 0) return -1;
+        pd->kind = P_STATUS;
+        return 1;
+    }
+
+    if (strcmp(first, "read") == 0 || strcmp(first, "delete") == 0) {
+        int key;
+        if (sscanf(line, "%*s %d", &key) != 1) {
+            snprintf(pd->msg, sizeof(pd->msg), "ERR usage: %s <key>", first);
+            return 0;
+        }
+        int is_read = strcmp(first, "read") == 0;
+        hl = snprintf(header, sizeof(header), "%s %d\n", is_read ? "READ" : "DELETE", key);
+        if (buf_append(sb, header, (size_t)hl) < 0) return -1;
+        pd->kind = is_read ? P_READ : P_STATUS;
+        return 1;
+    }
+
+    snprintf(pd->msg, sizeof(pd->msg), "ERR unknown command (type 'help')");
+    return 0;
+}
+
+// Writes the answers at the head of `q`: local ones, then complete server
+// answers from `p`. Returns how many bytes of `p` were used.
+static size_t pipe_decode(const char *p, size_t n, PendingQueue *q, FILE *out, long *inflight) {
+    size_t pos = 0;
+    for (;;) {
+        while (q->count && q->items[q->head].kind == P_LOCAL) {
+            fprintf(out, "%s\n", q->items[q->head].msg);
+            pq_pop(q);
+        }
+        if (q->count == 0) break;
+        const char *nl = (const char*)memchr(p + pos, '\n', n - pos);
+        if (!nl) break;
+        size_t ll = (size_t)(nl - (p + pos));
+        size_t next = pos + ll + 1;
+        char line[MAXLINE];
+        if (ll >= sizeof(line)) ll = sizeof(line) - 1;
+        memcpy(line, p + pos, ll);
+        line[ll] = '\0';
+        rtrim_cr(line);
+
+        size_t sz = 0;
+        if (q->items[q->head].kind == P_READ && sscanf(line, "OK %zu", &sz) == 1) {
+            if (n - next < sz) break;   // value not all here yet
+            fwrite(p + next, 1, sz, out);
+            fputc('\n', out);
+            next += sz;
+        } else if (strncmp(line, "OK", 2) == 0 || strncmp(line, "ERR", 3) == 0) {
+            fprintf(out, "%s\n", line);
+        } else {
+            fprintf(out, "ERR unexpected response: %s\n", line);
+        }
+        pq_pop(q);
+        (*inflight)--;
+        pos = next;
+    }
+    return pos;
+}
+
+static void *pipe_worker(void *arg) {
+    PipeJob *job = (PipeJob*)arg;
+    int fd = open_socket(job->host, job->port);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: connect failed\n");
+        job->failed = 1;
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    Buf sb = {0}, rb = {0};
+    PendingQueue q = {0};
+    const char *cur = job->begin;
+    long inflight = 0;
+
+    for (;;) {
+        // keep the window full, but don't buffer more than 1 MB of requests
+        while (cur < job->end && inflight < job->window && sb.len < (1 << 20)) {
+            const char *nl = (const char*)memchr(cur, '\n', (size_t)(job->end - cur));
+            const char *eol = nl ? nl : job->end;
+            int r = pipe_encode(cur, (size_t)(eol - cur), &sb, &q);
+            if (r < 0) { fprintf(stderr, "ERROR: OOM\n"); job->failed = 1; break; }
+            inflight += r;
+            job->commands += r;
+            cur = nl ? nl + 1 : job->end;
+        }
+        if (job->failed) break;
+        buf_consume(&rb, pipe_decode(rb.data, rb.len, &q, job->out, &inflight));
+        if (cur == job->end && q.count == 0) break;
+        if (cur < job->end && inflight < job->window && sb.len < (1 << 20)) continue;  // answers made room
+
+        struct pollfd pfd = { fd, (short)(POLLIN | (sb.len ? POLLOUT : 0)), 0 };
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            job->failed = 1;
+            break;
+        }
+        if (pfd.revents & POLLOUT) {
+            ssize_t w = write(fd, sb.data, sb.len);
+            if (w > 0) buf_consume(&sb, (size_t)w);
+            else if (w < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("write");
+                job->failed = 1;
+                break;
+            }
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (buf_reserve(&rb, 65536) < 0) { fprintf(stderr, "ERROR: OOM\n"); job->failed = 1; break; }
+            ssize_t r = read(fd, rb.data + rb.len, rb.cap - rb.len);
+            if (r > 0) rb.len += (size_t)r;
+            else if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+                fprintf(stderr, "ERROR: server closed or read error\n");
+                job->failed = 1;
+                break;
+            }
+        }
+    }
+
+    close(fd);
+    free(sb.data);
+    free(rb.data);
+    free(q.items);
+    return NULL;
+}
+
+static int run_pipeline(const char *filename, const char *outname, const char *host, int port,
+                        int window, int conns) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) { perror("open"); return 1; }
+    struct stat st;
+    if (fstat(fd, &st) < 0) { perror("fstat"); close(fd); return 1; }
+    size_t size = (size_t)st.st_size;
+    const char *base = NULL;
+    if (size > 0) {
+        void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) { perror("mmap"); close(fd); return 1; }
+        madvise(m, size, MADV_SEQUENTIAL);
+        base = (const char*)m;
+    }
+    close(fd);
+
+    FILE *out = fopen(outname, "w");
+    if (!out) { perror("fopen"); if (base) munmap((void*)base, size); return 1; }
+
+    PipeJob *jobs = (PipeJob*)calloc((size_t)conns, sizeof(PipeJob));
+    pthread_t *tids = (pthread_t*)calloc((size_t)conns, sizeof(pthread_t));
+    if (!jobs || !tids) { fprintf(stderr, "ERROR: OOM\n"); return 1; }
+
+    // cut the file at line ends; range 0 writes to out, the others to temp files
+    const char *start = base, *end = base + size;
+    for (int i = 0; i < conns; ++i) {
+        const char *cut = (i + 1 == conns) ? end : base + size * (size_t)(i + 1) / (size_t)conns;
+        if (cut < start) cut = start;
+        if (cut < end) {
+            const char *nl = (const char*)memchr(cut, '\n', (size_t)(end - cut));
+            cut = nl ? nl + 1 : end;
+        }
+        jobs[i].begin = start;
+        jobs[i].end = cut;
+        jobs[i].host = host;
+        jobs[i].port = port;
+        jobs[i].window = window;
+        jobs[i].out = (i == 0) ? out : tmpfile();
+        if (!jobs[i].out) { perror("tmpfile"); return 1; }
+        start = cut;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < conns; ++i) pthread_create(&tids[i], NULL, pipe_worker, &jobs[i]);
+    for (int i = 0; i < conns; ++i) pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    long commands = 0;
+    int failed = 0;
+    for (int i = 0; i < conns; ++i) {
+        commands += jobs[i].commands;
+        failed |= jobs[i].failed;
+        if (i == 0) continue;
+        char chunk[65536];
+        size_t r;
+        rewind(jobs[i].out);
+        while ((r = fread(chunk, 1, sizeof(chunk), jobs[i].out)) > 0) fwrite(chunk, 1, r, out);
+        fclose(jobs[i].out);
+    }
+    fclose(out);
+    if (base) munmap((void*)base, size);
+
+    double secs = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "%ld commands in %.3f s (%.0f/s), window %d, %d connection(s)%s\n",
+            commands, secs, secs > 0 ? (double)commands / secs : 0.0, window, conns,
+            failed ? ", FAILED" : "");
+    free(jobs);
+    free(tids);
+    return failed ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
-        fprintf(stderr, "Usage:\n  %s interactive\n  %s batch <file>\n", argv[0], argv[0]);
+        fprintf(stderr, "Usage:\n  %s interactive\n  %s batch <file>\n"
+                        "  %s pipeline <file> <out-file> <server-ip> <server-port> [window] [connections]\n",
+                argv[0], argv[0], argv[0]);
         return 1;
     }
     if (strcmp(argv[1], "interactive") == 0) {
@@ -417,6 +750,16 @@ int main(int argc, char **argv) {
             return 1;
         }
         run_batch(argv[2]);
+    } else if (strcmp(argv[1], "pipeline") == 0) {
+        if (argc < 6 || argc > 8) {
+            fprintf(stderr, "Usage: %s pipeline <file> <out-file> <server-ip> <server-port> [window] [connections]\n", argv[0]);
+            return 1;
+        }
+        int window = (argc > 6) ? atoi(argv[6]) : 64;
+        int conns = (argc > 7) ? atoi(argv[7]) : 1;
+        if (window < 1) window = 1;
+        if (conns < 1) conns = 1;
+        return run_pipeline(argv[2], argv[3], argv[4], atoi(argv[5]), window, conns);
     } else {
         fprintf(stderr, "Unknown mode: %s\n", argv[1]);
         return 1;
@@ -1,13 +1,16 @@
 // kv-server.c
 // Usage: ./kv-server <bind-ip> <port>
 // Example: ./kv-server 0.0.0.0 5000
-// Single-client at a time. KV persists in memory across clients.
+// One thread per client, the KV list is shared under a mutex and persists
+// in memory across clients. Commands may be pipelined: the answers come
+// back in order.
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -20,6 +23,7 @@ typedef struct KVNode {
 } KVNode;
 
 static KVNode *kv_head = NULL;
+static pthread_mutex_t kv_lock = PTHREAD_MUTEX_INITIALIZER; // kv_head and every node
 
 /* ---------- KV store helpers ---------- */
 static KVNode* kv_find(int key) {
@@ -74,23 +78,6 @@ static int kv_delete(int key) {
 
 /* ---------- I/O helpers ---------- */
 
-// Read exactly n bytes (or 0 if peer closed)
-static ssize_t read_n(int fd, void *buf, size_t n) {
-    size_t left = n;
-    char *p = (char*)buf;
-    while (left > 0) {
-        ssize_t r = read(fd, p, left);
-        if (r == 0) return (n - left);     // peer closed early
-        if (r < 0) {
-            if (errno == EINTR) continue;
-            return -1;
-        }
-        left -= (size_t)r;
-        p += r;
-    }
-    return (ssize_t)n;
-}
-
 // Write exactly n bytes
 static int write_n(int fd, const void *buf, size_t n) {
     size_t left = n;
@@ -107,22 +94,84 @@ static int write_n(int fd, const void *buf, size_t n) {
     return 0;
 }
 
+/* ---------- Connection buffers ---------- */
+// A pipelining client sends many commands at once: they are read in big
+// chunks, and the answers are collected and written out together when
+// there is no more input to parse.
+typedef struct {
+    int fd;
+    char in[65536];
+    size_t in_pos, in_len;
+    char out[65536];
+    size_t out_len;
+} Conn;
+
+static int conn_flush(Conn *c) {
+    if (c->out_len == 0) return 0;
+    int rc = write_n(c->fd, c->out, c->out_len);
+    c->out_len = 0;
+    return rc;
+}
+
+static int conn_write(Conn *c, const void *buf, size_t n) {
+    if (c->out_len + n > sizeof(c->out)) {
+        if (conn_flush(c) < 0) return -1;
+        if (n > sizeof(c->out)) return write_n(c->fd, buf, n);
+    }
+    memcpy(c->out + c->out_len, buf, n);
+    c->out_len += n;
+    return 0;
+}
+
+// Refill the input buffer; answers go out first since the client may be waiting for them.
+static ssize_t conn_fill(Conn *c) {
+    if (conn_flush(c) < 0) return -1;
+    for (;;) {
+        ssize_t r = read(c->fd, c->in, sizeof(c->in));
+        if (r < 0 && errno == EINTR) continue;
+        if (r > 0) {
+            c->in_pos = 0;
+            c->in_len = (size_t)r;
+        }
+        return r;
+    }
+}
+
+// Read exactly n bytes (or fewer if peer closed)
+static ssize_t read_n(Conn *c, void *buf, size_t n) {
+    size_t left = n;
+    char *p = (char*)buf;
+    while (left > 0) {
+        if (c->in_pos == c->in_len) {
+            ssize_t r = conn_fill(c);
+            if (r == 0) return (ssize_t)(n - left);     // peer closed early
+            if (r < 0) return -1;
+        }
+        size_t k = c->in_len - c->in_pos;
+        if (k > left) k = left;
+        memcpy(p, c->in + c->in_pos, k);
+        c->in_pos += k;
+        left -= k;
+        p += k;
+    }
+    return (ssize_t)n;
+}
+
 // Read a line terminated by '\n' (up to maxlen-1), returns length (excludes '\n') or -1 on error, 0 on EOF.
-static ssize_t read_line(int fd, char *buf, size_t maxlen) {
+static ssize_t read_line(Conn *c, char *buf, size_t maxlen) {
     size_t pos = 0;
     while (pos + 1 < maxlen) {
-        char c;
-        ssize_t r = read(fd, &c, 1);
-        if (r == 0) return (pos == 0) ? 0 : (ssize_t)pos; // EOF
-        if (r < 0) {
-            if (errno == EINTR) continue;
-            return -1;
+        if (c->in_pos == c->in_len) {
+            ssize_t r = conn_fill(c);
+            if (r == 0) return (pos == 0) ? 0 : (ssize_t)pos; // EOF
+            if (r < 0) return -1;
         }
-        if (c == '\n') {
+        char ch = c->in[c->in_pos++];
+        if (ch == '\n') {
             buf[pos] = '\0';
             return (ssize_t)pos;
         }
-        buf[pos++] = c;
+        buf[pos++] = ch;
     }
     // line too long -> truncate
     buf[pos] = '\0';
@@ -137,11 +186,11 @@ static void rtrim_cr(char *s) {
 
 /* ---------- Command handling ---------- */
 
-static int handle_client(int cfd) {
+static int handle_client(Conn *c) {
     char line[4096];
 
     for (;;) {
-        ssize_t ln = read_line(cfd, line, sizeof(line));
+        ssize_t ln = read_line(c, line, sizeof(line));
         if (ln == 0) return 0;         // client closed
         if (ln < 0) return -1;
         rtrim_cr(line);
@@ -160,7 +209,7 @@ static int handle_client(int cfd) {
             if (strcmp(cmd, "CREATE") == 0 || strcmp(cmd, "UPDATE") == 0) {
                 if (size == 0 && strcmp(cmd, "UPDATE") == 0) {
                     const char *em = "ERR size must be > 0\n";
-                    write_n(cfd, em, strlen(em));
+                    conn_write(c, em, strlen(em));
                     continue;
                 }
                 // Read value bytes
@@ -169,78 +218,102 @@ static int handle_client(int cfd) {
                     val = (char*)malloc(size);
                     if (!val) {
                         const char *em = "ERR out of memory\n";
-                        write_n(cfd, em, strlen(em));
+                        conn_write(c, em, strlen(em));
                         continue;
                     }
-                    ssize_t rr = read_n(cfd, val, size);
+                    ssize_t rr = read_n(c, val, size);
                     if (rr != (ssize_t)size) {
                         free(val);
                         const char *em = "ERR premature EOF on value\n";
-                        write_n(cfd, em, strlen(em));
+                        conn_write(c, em, strlen(em));
+                        conn_flush(c);
                         return -1;
                     }
                 }
 
+                pthread_mutex_lock(&kv_lock);
                 int rc = (strcmp(cmd, "CREATE") == 0)
                          ? kv_create(key, val, size)
                          : kv_update(key, val, size);
+                pthread_mutex_unlock(&kv_lock);
 
                 free(val);
 
                 if (rc == 0) {
                     const char *ok = "OK\n";
-                    write_n(cfd, ok, strlen(ok));
+                    conn_write(c, ok, strlen(ok));
                 } else if (rc == -1) {
                     const char *em = (strcmp(cmd, "CREATE") == 0)
                                      ? "ERR key exists\n" : "ERR no such key\n";
-                    write_n(cfd, em, strlen(em));
+                    conn_write(c, em, strlen(em));
                 } else {
                     const char *em = "ERR internal error\n";
-                    write_n(cfd, em, strlen(em));
+                    conn_write(c, em, strlen(em));
                 }
                 continue;
             }
 
             if (strcmp(cmd, "READ") == 0) {
+                // copy under the lock, a slow client must not hold it while writing
+                pthread_mutex_lock(&kv_lock);
                 KVNode *n = kv_find(key);
+                size_t len = n ? n->len : 0;
+                char *val = n ? (char*)malloc(len ? len : 1) : NULL;
+                if (val) memcpy(val, n->val, len);
+                pthread_mutex_unlock(&kv_lock);
                 if (!n) {
                     const char *em = "ERR no such key\n";
-                    write_n(cfd, em, strlen(em));
+                    conn_write(c, em, strlen(em));
+                } else if (!val) {
+                    const char *em = "ERR out of memory\n";
+                    conn_write(c, em, strlen(em));
                 } else {
                     char hdr[64];
-                    int hl = snprintf(hdr, sizeof(hdr), "OK %zu\n", n->len);
-                    if (write_n(cfd, hdr, (size_t)hl) < 0 ||
-                        write_n(cfd, n->val, n->len) < 0) {
-                        return -1;
-                    }
+                    int hl = snprintf(hdr, sizeof(hdr), "OK %zu\n", len);
+                    int rc = (conn_write(c, hdr, (size_t)hl) < 0 ||
+                              conn_write(c, val, len) < 0) ? -1 : 0;
+                    free(val);
+                    if (rc < 0) return -1;
                 }
                 continue;
             }
 
             if (strcmp(cmd, "DELETE") == 0) {
+                pthread_mutex_lock(&kv_lock);
                 int rc = kv_delete(key);
+                pthread_mutex_unlock(&kv_lock);
                 if (rc == 0) {
                     const char *ok = "OK\n";
-                    write_n(cfd, ok, strlen(ok));
+                    conn_write(c, ok, strlen(ok));
                 } else {
                     const char *em = "ERR no such key\n";
-                    write_n(cfd, em, strlen(em));
+                    conn_write(c, em, strlen(em));
                 }
                 continue;
             }
 
             // Unknown command with 2-3 tokens
             const char *em = "ERR unknown command\n";
-            write_n(cfd, em, strlen(em));
+            conn_write(c, em, strlen(em));
         } else {
             // Could be malformed/empty
             if (ln == 0) return 0;
             const char *em = "ERR malformed command\n";
-            write_n(cfd, em, strlen(em));
+            conn_write(c, em, strlen(em));
         }
     }
 }
 
+static void *client_thread(void *arg) {
+    Conn *c = (Conn*)arg;
+    handle_client(c);
+    conn_flush(c);
+    close(c->fd);
+    free(c);
+    fprintf(stdout, "Client disconnected.\n");
+    return NULL;
+}
+
 int main(int argc, char **argv) {
     if (argc != 3) {
         fprintf(stderr, "Usage: %s <bind-ip> <port>\n", argv[0]);
@@ -293,9 +366,20 @@ int main(int argc, char **argv) {
         inet_ntop(AF_INET, &cli.sin_addr, ipstr, sizeof(ipstr));
         fprintf(stdout, "Client connected from %s:%d\n", ipstr, ntohs(cli.sin_port));
 
-        // Handle one client to completion (single-client at a time)
-        handle_client(cfd);
-        close(cfd);
-        fprintf(stdout, "Client disconnected.\n");
+        // Every client gets its own thread
+        Conn *c = (Conn*)calloc(1, sizeof(Conn));
+        pthread_t tid;
+        if (!c) {
+            close(cfd);
+            continue;
+        }
+        c->fd = cfd;
+        if (pthread_create(&tid, NULL, client_thread, c) != 0) {
+            perror("pthread_create");
+            close(cfd);
+            free(c);
+            continue;
+        }
+        pthread_detach(tid);
     }
 }
@@ -0,0 +1,26 @@
+-- Change log for ./server --cdc: every row change in kv_store, including
+-- the ones made without the server (batch jobs, mysql shell), is recorded
+-- here by triggers, and the servers poll it to fix their caches.
+--   mysql -u root -p < Project/cdc.sql
+USE kvdb;
+
+CREATE TABLE IF NOT EXISTS kv_changelog (
+    id         BIGINT UNSIGNED NOT NULL AUTO_INCREMENT PRIMARY KEY,
+    k          VARBINARY(255) NOT NULL,
+    changed_at TIMESTAMP(6) NOT NULL DEFAULT CURRENT_TIMESTAMP(6),
+    KEY (changed_at)
+);
+
+DROP TRIGGER IF EXISTS kv_store_cdc_ins;
+DROP TRIGGER IF EXISTS kv_store_cdc_upd;
+DROP TRIGGER IF EXISTS kv_store_cdc_del;
+
+CREATE TRIGGER kv_store_cdc_ins AFTER INSERT ON kv_store FOR EACH ROW
+    INSERT INTO kv_changelog (k) VALUES (NEW.k);
+
+-- UNION (not UNION ALL): one row, or two if the key itself was changed
+CREATE TRIGGER kv_store_cdc_upd AFTER UPDATE ON kv_store FOR EACH ROW
+    INSERT INTO kv_changelog (k) SELECT NEW.k UNION SELECT OLD.k;
+
+CREATE TRIGGER kv_store_cdc_del AFTER DELETE ON kv_store FOR EACH ROW
+    INSERT INTO kv_changelog (k) VALUES (OLD.k);
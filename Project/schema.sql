@@ -0,0 +1,13 @@
+-- MySQL schema for the --storage mysql mode
+CREATE DATABASE IF NOT EXISTS kvdb;
+USE kvdb;
+
+-- keys are binary so /scan order is plain byte order
+CREATE TABLE IF NOT EXISTS kv_store (
+    k   VARBINARY(255) NOT NULL PRIMARY KEY,
+    v   LONGBLOB,
+    ver BIGINT UNSIGNED NOT NULL DEFAULT 1
+);
+
+-- tables created before versions existed:
+-- ALTER TABLE kv_store ADD COLUMN ver BIGINT UNSIGNED NOT NULL DEFAULT 1;
@@ -0,0 +1,233 @@
+#ifndef KV_CHANGE_FEED_H
+#define KV_CHANGE_FEED_H
+
+#include "kv_engine.h"
+#include <mysql/mysql.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Change data capture for --storage mysql (--cdc refresh|invalidate).
+// Triggers from Project/cdc.sql append every changed key of kv_store to
+// kv_changelog (AUTO_INCREMENT id), whoever wrote it; this polls that table
+// every poll_ms with keyset pagination (id > last ORDER BY id LIMIT batch,
+// repeated while pages are full) on its own connection.
+//
+//   refresh     the row is read back in the same query (LEFT JOIN) and a
+//               cached copy is replaced if the row's ver is newer, else
+//               dropped (an UPDATE or REPLACE from outside may leave ver
+//               alone or reset it); deleted rows are dropped
+//   invalidate  the key is dropped from the cache
+//
+// Watches fire either way. Ids are handed out at insert but become visible
+// at commit, so a slow transaction can show up behind a higher id that was
+// already read. Skipped ids are remembered and looked up again on every
+// poll until they appear or hole_ms passes (rolled back inserts never do).
+//
+// lag_ms is how long the newest row of the last poll waited in the table
+// (MySQL's own clock on both ends). If the feed can't query, everything
+// cached is invalidated every fail_flush_ms (KvEngine::invalidate_all), so
+// it is never more stale than that.
+class ChangeFeed {
+public:
+    struct Options {
+        bool refresh = true;
+        int poll_ms = 50;
+        size_t batch = 1000;
+        int hole_ms = 10000;
+        int fail_flush_ms = 1000;
+        int retain_s = 3600;  // changelog rows older than this are deleted (0 = keep)
+    };
+
+    ChangeFeed(KvEngine& engine, MYSQL* conn, const Options& opts) : engine_(engine), conn_(conn), opts_(opts) {}
+
+    ~ChangeFeed() { stop(); }
+
+    // Starts at the current end of the changelog: the cache is empty now.
+    bool start() {
+        std::vector<Row> rows;
+        if (!query("SELECT IFNULL(MAX(id), 0), NULL, NULL, NULL, 0 FROM kv_changelog", rows) || rows.empty()) {
+            fprintf(stderr, "--cdc: cannot read kv_changelog (run Project/cdc.sql): %s\n", mysql_error(conn_));
+            return false;
+        }
+        last_id_ = rows[0].id;
+        running_ = true;
+        poller_ = std::thread([this] { run(); });
+        return true;
+    }
+
+    void stop() {
+        if (!running_.exchange(false)) return;
+        cv_.notify_all();
+        poller_.join();
+    }
+
+    std::string status() {
+        std::lock_guard<std::mutex> lock(mu_);
+        return std::string("mode=") + (opts_.refresh ? "refresh" : "invalidate") + " state=" + (failing_ ? "failing" : "ok") +
+               " last_id=" + std::to_string(last_id_) + " rows=" + std::to_string(rows_) +
+               " lag_ms=" + std::to_string(lag_us_ / 1000) + " max_lag_ms=" + std::to_string(max_lag_us_ / 1000) +
+               " holes=" + std::to_string(holes_.size()) + " late_rows=" + std::to_string(late_rows_) +
+               " errors=" + std::to_string(errors_) + " flushes=" + std::to_string(flushes_) + "\n";
+    }
+
+private:
+    struct Row {
+        uint64_t id;
+        std::string key;
+        bool exists;
+        std::string value;
+        uint64_t version;
+        int64_t delay_us;  // changed_at -> now, on the MySQL clock
+    };
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Columns: id, k, v, ver, delay_us.
+    bool query(const std::string& sql, std::vector<Row>& out) {
+        if (mysql_query(conn_, sql.c_str()) != 0) return false;
+        MYSQL_RES* result = mysql_store_result(conn_);
+        if (!result) return false;
+        while (MYSQL_ROW row = mysql_fetch_row(result)) {
+            unsigned long* lens = mysql_fetch_lengths(result);
+            Row r;
+            r.id = strtoull(row[0], NULL, 10);
+            if (row[1]) r.key.assign(row[1], lens[1]);
+            r.exists = row[2] != NULL;
+            if (row[2]) r.value.assign(row[2], lens[2]);
+            r.version = row[3] ? strtoull(row[3], NULL, 10) : 0;
+            r.delay_us = row[4] ? strtoll(row[4], NULL, 10) : 0;
+            out.push_back(std::move(r));
+        }
+        mysql_free_result(result);
+        return true;
+    }
+
+    std::string select(const std::string& where) const {
+        std::string cols = opts_.refresh ? "s.v, s.ver" : "NULL, NULL";
+        std::string join = opts_.refresh ? " LEFT JOIN kv_store s ON s.k = c.k" : "";
+        return "SELECT c.id, c.k, " + cols + ", TIMESTAMPDIFF(MICROSECOND, c.changed_at, NOW(6)) FROM kv_changelog c" +
+               join + " WHERE " + where;
+    }
+
+    void apply(const Row& r) {
+        if (opts_.refresh && r.exists) engine_.refreshed(r.key, r.value, r.version);
+        else engine_.replicated(r.key);
+    }
+
+    // One poll: late rows in old holes, then new rows page by page.
+    bool poll() {
+        std::vector<Row> rows;
+        int64_t now = now_ms();
+        std::vector<uint64_t> check;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            for (auto it = holes_.begin(); it != holes_.end();) {
+                if (now - it->second > opts_.hole_ms) it = holes_.erase(it);
+                else check.push_back((it++)->first);
+            }
+        }
+        for (size_t i = 0; i < check.size(); i += opts_.batch) {
+            std::string in;
+            for (size_t j = i; j < std::min(check.size(), i + opts_.batch); ++j)
+                in += (in.empty() ? "" : ",") + std::to_string(check[j]);
+            rows.clear();
+            if (!query(select("c.id IN (" + in + ")"), rows)) return false;
+            std::lock_guard<std::mutex> lock(mu_);
+            for (auto& r : rows) {
+                apply(r);
+                holes_.erase(r.id);
+                late_rows_++;
+            }
+        }
+
+        for (bool first = true;; first = false) {
+            uint64_t last;
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                last = last_id_;
+            }
+            rows.clear();
+            if (!query(select("c.id > " + std::to_string(last) + " ORDER BY c.id LIMIT " + std::to_string(opts_.batch)),
+                       rows))
+                return false;
+            std::lock_guard<std::mutex> lock(mu_);
+            for (auto& r : rows) {
+                for (uint64_t id = last_id_ + 1; id < r.id && holes_.size() < kMaxHoles; ++id) holes_[id] = now;
+                apply(r);
+                last_id_ = r.id;
+            }
+            rows_ += rows.size();
+            if (!rows.empty()) {
+                lag_us_ = std::max<int64_t>(0, rows.back().delay_us);
+                max_lag_us_ = std::max(max_lag_us_, lag_us_);
+            } else if (first) {
+                lag_us_ = 0;  // caught up
+            }
+            if (rows.size() < opts_.batch) return true;
+        }
+    }
+
+    void run() {
+        int64_t last_flush = 0, last_purge = now_ms();
+        std::unique_lock<std::mutex> wait_lock(wait_mu_);
+        while (running_) {
+            cv_.wait_for(wait_lock, std::chrono::milliseconds(opts_.poll_ms));
+            if (!running_) break;
+            int64_t now = now_ms();
+            if (poll()) {
+                std::lock_guard<std::mutex> lock(mu_);
+                failing_ = false;
+            } else {
+                {
+                    std::lock_guard<std::mutex> lock(mu_);
+                    failing_ = true;
+                    errors_++;
+                }
+                mysql_ping(conn_);  // reconnects if the client library is set up to
+                // changes can't be seen: keep the cache from going stale
+                if (now - last_flush >= opts_.fail_flush_ms) {
+                    engine_.invalidate_all();
+                    last_flush = now;
+                    std::lock_guard<std::mutex> lock(mu_);
+                    flushes_++;
+                }
+            }
+            if (opts_.retain_s > 0 && now - last_purge > 60000) {
+                last_purge = now;
+                std::string purge = "DELETE FROM kv_changelog WHERE changed_at < NOW(6) - INTERVAL " +
+                                    std::to_string(opts_.retain_s) + " SECOND LIMIT 100000";
+                mysql_query(conn_, purge.c_str());
+            }
+        }
+    }
+
+    static const size_t kMaxHoles = 100000;
+
+    KvEngine& engine_;
+    MYSQL* conn_;  // poller thread only
+    Options opts_;
+    std::atomic<bool> running_{false};
+    std::thread poller_;
+    std::mutex wait_mu_;
+    std::condition_variable cv_;
+
+    std::mutex mu_;  // everything below (status() reads it)
+    uint64_t last_id_ = 0;
+    std::map<uint64_t, int64_t> holes_;  // skipped id -> first seen (ms)
+    uint64_t rows_ = 0, late_rows_ = 0, errors_ = 0, flushes_ = 0;
+    int64_t lag_us_ = 0, max_lag_us_ = 0;
+    bool failing_ = false;
+};
+
+#endif
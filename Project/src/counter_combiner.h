@@ -0,0 +1,196 @@
+#ifndef KV_COUNTER_COMBINER_H
+#define KV_COUNTER_COMBINER_H
+
+#include "storage.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Relaxed-durability counters. Increments land in one of several shards
+// (picked per thread, so threads rarely share a lock) and a background
+// thread merges the shards every flush_ms and applies one storage.incr()
+// per key. Deltas that are not flushed yet are lost on a crash.
+//
+// A reader adds pending() to the stored value, so both have to come from the
+// same side of a flush: it holds read_lock(key) across the two, and the
+// flusher holds the key's stripe exclusively from storage.incr() until the
+// delta has left inflight_.
+class CounterCombiner {
+public:
+    using ReadLock = std::shared_lock<std::shared_mutex>;
+
+    CounterCombiner(Storage& storage, int flush_ms, size_t shards = 16)
+        : storage_(storage), flush_ms_(flush_ms), shards_(shards) {}
+
+    ~CounterCombiner() { stop(); }
+
+    // Called for every key right after storage took its delta, with readers
+    // of the key held off, so cached copies go before the delta stops
+    // counting as pending. Must not read through read_lock().
+    void on_applied(std::function<void(const std::string&)> fn) { on_applied_ = std::move(fn); }
+
+    // Called for every flushed key after that, with nothing held.
+    void on_flushed(std::function<void(const std::string&)> fn) { on_flushed_ = std::move(fn); }
+
+    void start() {
+        running_ = true;
+        flusher_ = std::thread([this] {
+            std::unique_lock<std::mutex> lock(wake_mu_);
+            while (running_) {
+                wake_.wait_for(lock, std::chrono::milliseconds(flush_ms_));
+                lock.unlock();
+                flush();
+                lock.lock();
+            }
+        });
+    }
+
+    void stop() {
+        if (!running_.exchange(false)) return;
+        wake_.notify_all();
+        if (flusher_.joinable()) flusher_.join();
+        flush();
+    }
+
+    void add(const std::string& key, long long delta) {
+        outstanding_++;
+        Shard& s = shards_[shard_index()];
+        std::lock_guard<std::mutex> lock(s.mu);
+        Delta& d = s.deltas[key];
+        d.sum += delta;
+        d.adds++;
+    }
+
+    // Held by a reader from before it reads the stored value until it has
+    // pending(). Empty when no increment is outstanding at all: the stored
+    // value alone is then a correct answer, and pending() is skipped.
+    ReadLock read_lock(const std::string& key) {
+        if (outstanding_ == 0) return ReadLock();
+        return ReadLock(stripe(key));
+    }
+
+    // Deltas accepted but not yet visible in storage. The caller holds
+    // read_lock(key).
+    long long pending(const std::string& key) {
+        std::lock_guard<std::mutex> lock(inflight_mu_);  // shards move to inflight_ under it
+        long long sum = 0;
+        for (Shard& s : shards_) {
+            std::lock_guard<std::mutex> slock(s.mu);
+            auto it = s.deltas.find(key);
+            if (it != s.deltas.end()) sum += it->second.sum;
+        }
+        auto it = inflight_.find(key);
+        if (it != inflight_.end()) sum += it->second.sum;
+        return sum;
+    }
+
+    // Merge every shard into inflight_ and write one increment per key. A
+    // delta storage refused because of the value (not an integer, the sum
+    // would overflow) is dropped; after any other failure (a database
+    // error) it stays in inflight_, still pending, and is tried again next
+    // time. Both count as failed().
+    void flush() {
+        std::lock_guard<std::mutex> one_flusher(flush_mu_);
+        std::vector<std::string> keys;
+        {
+            std::lock_guard<std::mutex> lock(inflight_mu_);
+            for (Shard& s : shards_) {
+                std::lock_guard<std::mutex> slock(s.mu);
+                for (auto& kv : s.deltas) {
+                    Delta& d = inflight_[kv.first];
+                    d.sum += kv.second.sum;
+                    d.adds += kv.second.adds;
+                }
+                s.deltas.clear();
+            }
+            for (auto& kv : inflight_) keys.push_back(kv.first);
+        }
+        for (auto& key : keys) {
+            bool ok;
+            {
+                std::unique_lock<std::shared_mutex> hold(stripe(key));
+                Delta d;
+                {
+                    std::lock_guard<std::mutex> lock(inflight_mu_);
+                    d = inflight_[key];
+                }
+                long long result;
+                ok = d.sum == 0 || storage_.incr(key, d.sum, result);
+                bool drop = !ok && refused(key, d.sum);
+                if (ok && on_applied_) on_applied_(key);
+                if (ok || drop) {
+                    std::lock_guard<std::mutex> lock(inflight_mu_);
+                    inflight_.erase(key);
+                    outstanding_ -= d.adds;
+                }
+            }
+            if (!ok) {
+                failed_++;
+                continue;
+            }
+            flushed_keys_++;
+            if (on_flushed_) on_flushed_(key);
+        }
+    }
+
+    uint64_t flushed_keys() const { return flushed_keys_; }
+    uint64_t failed() const { return failed_; }
+
+private:
+    static const size_t kStripes = 16;
+
+    struct Delta {
+        long long sum = 0;
+        uint64_t adds = 0;
+    };
+
+    struct Shard {
+        std::mutex mu;
+        std::unordered_map<std::string, Delta> deltas;
+    };
+
+    size_t shard_index() {
+        static std::atomic<size_t> next_thread{0};
+        thread_local size_t id = next_thread++;
+        return id % shards_.size();
+    }
+
+    // After a failed incr: true if the stored value can never take `delta`.
+    // A value that can't be read (database down) is not refused.
+    bool refused(const std::string& key, long long delta) {
+        std::string cur;
+        long long n, sum;
+        if (!storage_.get(key, cur)) return false;
+        return !parse_counter(cur, n) || __builtin_add_overflow(n, delta, &sum);
+    }
+
+    std::shared_mutex& stripe(const std::string& key) { return stripes_[std::hash<std::string>()(key) % kStripes]; }
+
+    Storage& storage_;
+    int flush_ms_;
+    std::vector<Shard> shards_;
+
+    std::mutex inflight_mu_;
+    std::unordered_map<std::string, Delta> inflight_;
+    std::shared_mutex stripes_[kStripes];
+    std::atomic<uint64_t> outstanding_{0};  // add() calls not in storage yet
+
+    std::mutex flush_mu_;
+    std::atomic<uint64_t> flushed_keys_{0}, failed_{0};
+
+    std::function<void(const std::string&)> on_applied_, on_flushed_;
+
+    std::atomic<bool> running_{false};
+    std::thread flusher_;
+    std::mutex wake_mu_;
+    std::condition_variable wake_;
+};
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef KV_DICT_TRAINER_H
+#define KV_DICT_TRAINER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Builds a zlib preset dictionary (deflateSetDictionary, at most 32 KB is
+// used) from sample values, in the spirit of zstd's cover trainer: the
+// dictionary is made of segments of the samples that contain the most
+// 8-byte strings which also occur in many other samples.
+//
+//   1. count, for every 8-byte string, how many samples contain it
+//   2. score every kSegment-byte window (step kStep) by the counts of the
+//      strings in it (only those in >= 2 samples)
+//   3. take the best window, zero the counts of its strings so the next
+//      pick covers something new, repeat until the dictionary is full
+//
+// Picks are lazily re-scored from a priority queue. The best segment goes
+// last: deflate codes near matches with fewer bits.
+class DictTrainer {
+public:
+    static std::string train(const std::vector<std::string>& samples, size_t dict_bytes) {
+        std::unordered_map<uint64_t, uint32_t> df;
+        for (const std::string& s : samples) {
+            std::unordered_set<uint64_t> seen;
+            for (size_t i = 0; i + kK <= s.size(); ++i)
+                if (seen.insert(kmer(s, i)).second) df[kmer(s, i)]++;
+        }
+
+        struct Cand {
+            uint64_t score;
+            uint32_t sample, offset;
+            bool operator<(const Cand& o) const { return score < o.score; }
+        };
+        std::priority_queue<Cand> queue;
+        for (uint32_t n = 0; n < samples.size(); ++n) {
+            const std::string& s = samples[n];
+            if (s.size() < kK) continue;
+            for (size_t off = 0;; off += kStep) {
+                size_t at = std::min(off, s.size() > kSegment ? s.size() - kSegment : 0);
+                uint64_t sc = score(s, at, df);
+                if (sc) queue.push(Cand{sc, n, (uint32_t)at});
+                if (at + kSegment >= s.size()) break;
+            }
+        }
+
+        std::vector<std::string> picked;
+        size_t total = 0;
+        while (!queue.empty() && total < dict_bytes) {
+            Cand c = queue.top();
+            queue.pop();
+            const std::string& s = samples[c.sample];
+            uint64_t now = score(s, c.offset, df);
+            if (now == 0) continue;
+            if (now < c.score && !queue.empty() && now < queue.top().score) {
+                c.score = now;  // others got better than this one meanwhile
+                queue.push(c);
+                continue;
+            }
+            size_t len = std::min(kSegment, s.size() - c.offset);
+            for (size_t i = c.offset; i + kK <= c.offset + len; ++i) df[kmer(s, i)] = 0;
+            picked.push_back(s.substr(c.offset, len));
+            total += len;
+        }
+
+        std::string dict;
+        for (auto it = picked.rbegin(); it != picked.rend(); ++it) dict += *it;
+        if (dict.size() > dict_bytes) dict.erase(0, dict.size() - dict_bytes);  // keep the best end
+        return dict;
+    }
+
+private:
+    static const size_t kK = 8, kSegment = 64, kStep = 16;
+
+    static uint64_t kmer(const std::string& s, size_t i) {
+        uint64_t h = 1469598103934665603ULL;
+        for (size_t j = i; j < i + kK; ++j) { h ^= (unsigned char)s[j]; h *= 1099511628211ULL; }
+        return h;
+    }
+
+    static uint64_t score(const std::string& s, size_t at, const std::unordered_map<uint64_t, uint32_t>& df) {
+        uint64_t sc = 0;
+        std::unordered_set<uint64_t> counted;
+        size_t end = std::min(s.size(), at + kSegment);
+        for (size_t i = at; i + kK <= end; ++i) {
+            uint64_t h = kmer(s, i);
+            auto it = df.find(h);
+            if (it != df.end() && it->second >= 2 && counted.insert(h).second) sc += it->second;
+        }
+        return sc;
+    }
+};
+
+#endif
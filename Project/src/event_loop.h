@@ -0,0 +1,371 @@
+#ifndef KV_EVENT_LOOP_H
+#define KV_EVENT_LOOP_H
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// One-thread epoll loop (same idea as Practice/epoll-server.c) for the
+// listeners httplib is a poor fit for: parked long-polls and pipelined
+// binary/text protocols. The protocol code only sees Conn::in / Conn::out;
+// the loop does the non-blocking reads and writes. Writes use MSG_NOSIGNAL,
+// so a peer that went away is a closed Conn, not SIGPIPE, whether or not
+// the process ignores the signal yet. Conn::in holds at most kInMax bytes
+// the handler has not consumed; a request bigger than that closes the Conn.
+//
+// Besides Conn::out, a handler can queue shared immutable buffers (e.g. a
+// response prepared once for many clients): they are written with writev()
+// straight from the shared copy and released once sent.
+class EventLoop {
+public:
+    using Buffer = std::shared_ptr<const std::string>;
+
+    struct Conn {
+        uint64_t id = 0;
+        int fd = -1;
+        std::string in;    // received, not yet consumed by the handler
+        std::string out;   // queued for the socket
+        bool close_after_write = false;
+        bool polling_out = false;
+        std::shared_ptr<void> state;  // protocol specific
+        std::deque<Buffer> queued;    // goes out before `out`
+        size_t queued_sent = 0;       // of queued.front()
+    };
+
+    using Handler = std::function<void(Conn&)>;
+
+    EventLoop() {
+        epfd_ = epoll_create1(0);
+        wakefd_ = eventfd(0, EFD_NONBLOCK);
+        add_fd(wakefd_, EPOLLIN);
+    }
+
+    ~EventLoop() {
+        for (auto& kv : conns_) ::close(kv.second->fd);
+        for (int fd : listeners_) ::close(fd);
+        ::close(wakefd_);
+        ::close(epfd_);
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    void on_data(Handler h) { on_data_ = std::move(h); }
+    void on_close(Handler h) { on_close_ = std::move(h); }
+
+    // reuse_port lets several loops bind the same port; the kernel then
+    // spreads new connections across them.
+    bool listen_tcp(const std::string& host, int port, bool reuse_port = false) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) { perror("socket"); return false; }
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (reuse_port) setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ||
+            bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 512) < 0) {
+            perror("bind/listen");
+            ::close(fd);
+            return false;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        listeners_.push_back(fd);
+        add_fd(fd, EPOLLIN);
+        return true;
+    }
+
+    // Runs `fn` on the loop thread every `ms` milliseconds.
+    void every(int ms, std::function<void()> fn) {
+        timers_.push_back(Timer{ms, now_ms() + ms, std::move(fn)});
+    }
+
+    // Thread-safe: run `fn` on the loop thread.
+    void post(std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> lock(post_mu_);
+            posted_.push_back(std::move(fn));
+        }
+        uint64_t one = 1;
+        ssize_t n = write(wakefd_, &one, sizeof(one));
+        (void)n;
+    }
+
+    void stop() { post([this] { running_ = false; }); }
+
+    // Loop thread only. Returns NULL if the connection is gone.
+    Conn* find(uint64_t id) {
+        auto it = by_id_.find(id);
+        return it == by_id_.end() ? NULL : it->second;
+    }
+
+    // Loop thread only: queue bytes on a connection and try to write them now.
+    void send(Conn& c, const std::string& data) {
+        c.out += data;
+        flush(c);
+    }
+
+    // Loop thread only: queue a shared buffer after what is already queued,
+    // without copying it. Call flush() (or return from the handler) to send.
+    static void queue(Conn& c, Buffer buf) {
+        keep_order(c);
+        c.queued.push_back(std::move(buf));
+    }
+
+    // Small buffers are cheaper to copy into `out` than to queue.
+    static void append(Conn& c, const Buffer& buf) {
+        if (buf->size() < kQueueMin) c.out += *buf;
+        else queue(c, buf);
+    }
+
+    // Loop thread only: takes over a socket this side opened (an outgoing
+    // connection, possibly still connecting) as a Conn. Bytes sent before
+    // the connect finishes go out once the socket is writable.
+    Conn& adopt(int fd) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        std::unique_ptr<Conn> c(new Conn());
+        c->id = ++next_id_;
+        c->fd = fd;
+        Conn& ref = *c;
+        by_id_[c->id] = c.get();
+        conns_[fd] = std::move(c);
+        add_fd(fd, EPOLLIN);
+        return ref;
+    }
+
+    void close_conn(Conn& c) {
+        if (on_close_) on_close_(c);
+        epoll_ctl(epfd_, EPOLL_CTL_DEL, c.fd, NULL);
+        ::close(c.fd);
+        by_id_.erase(c.id);
+        conns_.erase(c.fd);  // destroys c
+    }
+
+    size_t connections() const { return conns_.size(); }
+
+    void run() {
+        running_ = true;
+        std::vector<struct epoll_event> events(256);
+        while (running_) {
+            int n = epoll_wait(epfd_, events.data(), (int)events.size(), next_timeout());
+            if (n < 0 && errno != EINTR) { perror("epoll_wait"); break; }
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == wakefd_) { run_posted(); continue; }
+                if (is_listener(fd)) { accept_all(fd); continue; }
+
+                auto it = conns_.find(fd);
+                if (it == conns_.end()) continue;
+                Conn& c = *it->second;
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) { close_conn(c); continue; }
+                if ((events[i].events & EPOLLOUT) && !flush(c)) continue;
+                if (events[i].events & EPOLLIN) read_ready(c);
+            }
+            run_timers();
+        }
+    }
+
+private:
+    static const size_t kQueueMin = 4096;
+    static const size_t kInMax = 64 << 20;
+
+    struct Timer {
+        int interval;
+        int64_t due;
+        std::function<void()> fn;
+    };
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void add_fd(int fd, uint32_t events) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = fd;
+        epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void want_write(Conn& c, bool on) {
+        if (c.polling_out == on) return;
+        c.polling_out = on;
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        uint32_t events = EPOLLIN;
+        if (on) events |= EPOLLOUT;
+        ev.events = events;
+        ev.data.fd = c.fd;
+        epoll_ctl(epfd_, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+
+    bool is_listener(int fd) const {
+        for (int l : listeners_) if (l == fd) return true;
+        return false;
+    }
+
+    void accept_all(int lfd) {
+        for (;;) {
+            int fd = accept(lfd, NULL, NULL);
+            if (fd < 0) return;  // EAGAIN: drained
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::unique_ptr<Conn> c(new Conn());
+            c->id = ++next_id_;
+            c->fd = fd;
+            by_id_[c->id] = c.get();
+            conns_[fd] = std::move(c);
+            add_fd(fd, EPOLLIN);
+        }
+    }
+
+    void read_ready(Conn& c) {
+        char buf[16384];
+        bool eof = false;
+        while (c.in.size() < kInMax) {  // the rest waits for the next round
+            ssize_t r = read(c.fd, buf, sizeof(buf));
+            if (r > 0) { c.in.append(buf, (size_t)r); continue; }
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            eof = true;  // EOF or hard error: answer what we have, then close
+            break;
+        }
+        uint64_t id = c.id;
+        if (!c.in.empty() && on_data_) on_data_(c);
+        if (!find(id)) return;
+        if (c.in.size() >= kInMax) {  // one request larger than we buffer
+            close_conn(c);
+            return;
+        }
+        if (eof) c.close_after_write = true;
+        flush(c);
+    }
+
+    // Bytes in `out` were queued before anything added to `queued` now.
+    static void keep_order(Conn& c) {
+        if (c.out.empty()) return;
+        c.queued.push_back(std::make_shared<const std::string>(std::move(c.out)));
+        c.out.clear();
+    }
+
+    // Gathered write (sendmsg, writev with flags) of the shared buffers;
+    // false if the connection was closed.
+    bool flush_queued(Conn& c) {
+        keep_order(c);
+        while (!c.queued.empty()) {
+            struct iovec iov[64];
+            int n = 0;
+            for (auto it = c.queued.begin(); it != c.queued.end() && n < 64; ++it, ++n) {
+                size_t skip = n == 0 ? c.queued_sent : 0;
+                iov[n].iov_base = (void*)((*it)->data() + skip);
+                iov[n].iov_len = (*it)->size() - skip;
+            }
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = (size_t)n;
+            ssize_t w = sendmsg(c.fd, &msg, MSG_NOSIGNAL);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (w <= 0) {
+                close_conn(c);
+                return false;
+            }
+            size_t left = (size_t)w;
+            while (left) {
+                size_t rest = c.queued.front()->size() - c.queued_sent;
+                if (left < rest) {
+                    c.queued_sent += left;
+                    break;
+                }
+                left -= rest;
+                c.queued.pop_front();
+                c.queued_sent = 0;
+            }
+        }
+        if (c.queued.empty() && c.close_after_write) { close_conn(c); return false; }
+        want_write(c, !c.queued.empty());
+        return true;
+    }
+
+    // False if the connection was closed.
+    bool flush(Conn& c) {
+        if (!c.queued.empty()) return flush_queued(c);
+        size_t done = 0;
+        while (done < c.out.size()) {
+            ssize_t w = ::send(c.fd, c.out.data() + done, c.out.size() - done, MSG_NOSIGNAL);
+            if (w > 0) { done += (size_t)w; continue; }
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            close_conn(c);
+            return false;
+        }
+        c.out.erase(0, done);
+        if (c.out.empty() && c.close_after_write) { close_conn(c); return false; }
+        want_write(c, !c.out.empty());
+        return true;
+    }
+
+    void run_posted() {
+        uint64_t n;
+        while (read(wakefd_, &n, sizeof(n)) > 0) {}
+        std::vector<std::function<void()>> fns;
+        {
+            std::lock_guard<std::mutex> lock(post_mu_);
+            fns.swap(posted_);
+        }
+        for (auto& fn : fns) fn();
+    }
+
+    int next_timeout() const {
+        if (timers_.empty()) return -1;
+        int64_t now = now_ms(), wait = 1000;
+        for (const Timer& t : timers_) wait = std::min(wait, t.due - now);
+        return wait < 0 ? 0 : (int)wait;
+    }
+
+    void run_timers() {
+        int64_t now = now_ms();
+        for (Timer& t : timers_) {
+            if (t.due > now) continue;
+            t.due = now + t.interval;
+            t.fn();
+        }
+    }
+
+    int epfd_ = -1, wakefd_ = -1;
+    bool running_ = false;
+    uint64_t next_id_ = 0;
+    std::vector<int> listeners_;
+    std::unordered_map<int, std::unique_ptr<Conn>> conns_;
+    std::unordered_map<uint64_t, Conn*> by_id_;
+    std::vector<Timer> timers_;
+    Handler on_data_, on_close_;
+    std::mutex post_mu_;
+    std::vector<std::function<void()>> posted_;
+};
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef KV_FLASH_CACHE_H
+#define KV_FLASH_CACHE_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Second cache tier on local disk (--flash-file), under the LruCache: what
+// the DRAM cache evicts is appended here, and a hit is moved back up
+// (LruCache::get_flash), so a key lives in one tier at a time.
+//
+// The file is split into regions of region_bytes. New entries are appended
+// to the open region, which is a buffer in memory; a full region is written
+// with one pwrite by the writer thread (large sequential writes) and the
+// next region to fill is taken from the sealed ones: the oldest sealed
+// (fifo) or the one hit least recently (lru). All its entries are dropped
+// at once, nothing is moved.
+//
+// Index: key_hash -> region, offset, length in memory (one hash map entry
+// per key, no key or value). Records carry the key, which a read checks, so
+// a hash collision is a miss. Reads are one pread() without the lock; the
+// region's generation is checked afterwards in case it was reused during
+// the read. Written regions are dropped from the page cache, so the tier
+// doesn't take the RAM it is meant to save. Contents don't survive a
+// restart.
+//
+// Record: u32 key length | u32 value length | u64 version | key | value
+class FlashCache {
+public:
+    struct Options {
+        std::string path;
+        size_t bytes = 1ull << 30;
+        size_t region_bytes = 4 << 20;
+        bool lru = false;  // region eviction: false = fifo
+    };
+
+    explicit FlashCache(const Options& opts) : opts_(opts) {}
+
+    ~FlashCache() { close(); }
+
+    bool open() {
+        size_t n = opts_.bytes / opts_.region_bytes;
+        if (n < 3) {
+            fprintf(stderr, "--flash-mb must hold at least 3 regions of --flash-region-mb\n");
+            return false;
+        }
+        fd_ = ::open(opts_.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0 || ftruncate(fd_, (off_t)(n * opts_.region_bytes)) != 0) {
+            perror(opts_.path.c_str());
+            return false;
+        }
+        regions_.resize(n);
+        active_ = 0;
+        buf_.reserve(opts_.region_bytes);
+        running_ = true;
+        writer_ = std::thread([this] { run_writer(); });
+        return true;
+    }
+
+    void close() {
+        if (!running_.exchange(false)) return;
+        cv_.notify_all();
+        writer_.join();
+        ::close(fd_);
+    }
+
+    // An entry the DRAM cache evicted. Called under the cache shard's lock,
+    // so it only copies into the open region.
+    void admit(const std::string& key, const std::string& value, uint64_t version, uint64_t hash) {
+        size_t len = 16 + key.size() + value.size();
+        if (len > opts_.region_bytes) return;
+        std::lock_guard<std::mutex> lock(mu_);
+        if (buf_.size() + len > opts_.region_bytes && !seal()) {
+            dropped_++;  // writer behind, every region busy
+            return;
+        }
+        uint32_t klen = (uint32_t)key.size(), vlen = (uint32_t)value.size();
+        Loc loc{(uint32_t)active_, (uint32_t)buf_.size(), (uint32_t)len};
+        buf_.append((const char*)&klen, 4);
+        buf_.append((const char*)&vlen, 4);
+        buf_.append((const char*)&version, 8);
+        buf_ += key;
+        buf_ += value;
+        index_[hash] = loc;
+        regions_[active_].hashes.push_back(hash);
+        admitted_++;
+    }
+
+    // Reads the entry; true only if it is here and really this key.
+    bool get(const std::string& key, uint64_t hash, std::string& value, uint64_t& version) {
+        Loc loc;
+        uint64_t gen;
+        std::shared_ptr<const std::string> pending;
+        std::string rec;
+        bool open_region = false;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            auto it = index_.find(hash);
+            if (it == index_.end()) return miss();
+            loc = it->second;
+            Region& r = regions_[loc.region];
+            r.last_hit = ++clock_;
+            gen = r.gen;
+            open_region = loc.region == active_;
+            if (open_region) rec.assign(buf_, loc.offset, loc.len);
+            else pending = r.pending;
+        }
+        if (pending) {
+            rec.assign(*pending, loc.offset, loc.len);
+        } else if (!open_region) {
+            rec.resize(loc.len);
+            off_t at = (off_t)loc.region * opts_.region_bytes + loc.offset;
+            if (pread(fd_, &rec[0], loc.len, at) != (ssize_t)loc.len) return miss();
+            std::lock_guard<std::mutex> lock(mu_);
+            if (regions_[loc.region].gen != gen) return miss();  // reused while we read
+            reads_++;
+        }
+        uint32_t klen, vlen;
+        memcpy(&klen, rec.data(), 4);
+        memcpy(&vlen, rec.data() + 4, 4);
+        if (16 + (size_t)klen + vlen != rec.size() || rec.compare(16, klen, key) != 0) return miss();
+        memcpy(&version, rec.data() + 8, 8);
+        value.assign(rec, 16 + klen, vlen);
+        hits_++;
+        return true;
+    }
+
+    // The key was written or moved up to DRAM: this copy is dead.
+    void forget(uint64_t hash) {
+        std::lock_guard<std::mutex> lock(mu_);
+        index_.erase(hash);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mu_);
+        index_.clear();
+    }
+
+    std::string status() {
+        std::lock_guard<std::mutex> lock(mu_);
+        return "flash regions=" + std::to_string(regions_.size()) + " keys=" + std::to_string(index_.size()) +
+               " hits=" + std::to_string(hits_) + " misses=" + std::to_string(misses_) +
+               " preads=" + std::to_string(reads_) + " admitted=" + std::to_string(admitted_) +
+               " dropped=" + std::to_string(dropped_) + " regions_written=" + std::to_string(written_) +
+               " evictions=" + std::to_string(evicted_) + " policy=" + (opts_.lru ? "lru" : "fifo") + "\n";
+    }
+
+private:
+    struct Loc {
+        uint32_t region, offset, len;
+    };
+
+    struct Region {
+        uint64_t gen = 0;          // bumped on reuse
+        uint64_t sealed_at = 0;    // fifo order
+        uint64_t last_hit = 0;     // lru order
+        bool sealed = false;
+        std::shared_ptr<const std::string> pending;  // sealed, not written yet
+        std::vector<uint64_t> hashes;                // entries admitted here
+    };
+
+    bool miss() {
+        misses_++;
+        return false;
+    }
+
+    // mu_ held. Queues the open region for writing and opens the victim.
+    bool seal() {
+        size_t victim = regions_.size();
+        for (size_t i = 0; i < regions_.size(); ++i) {
+            Region& r = regions_[i];
+            if (i == active_ || r.pending) continue;
+            if (!r.sealed) {
+                victim = i;  // never used yet
+                break;
+            }
+            if (victim == regions_.size()) {
+                victim = i;
+                continue;
+            }
+            Region& v = regions_[victim];
+            if (opts_.lru ? r.last_hit < v.last_hit : r.sealed_at < v.sealed_at) victim = i;
+        }
+        if (victim == regions_.size()) return false;
+
+        Region& a = regions_[active_];
+        a.sealed = true;
+        a.sealed_at = ++clock_;
+        a.last_hit = a.sealed_at;
+        auto full = std::make_shared<std::string>();
+        full->swap(buf_);
+        a.pending = full;
+        queue_.push_back(active_);
+        cv_.notify_one();
+
+        Region& v = regions_[victim];
+        if (v.sealed) evicted_++;
+        for (uint64_t h : v.hashes) {
+            auto it = index_.find(h);
+            if (it != index_.end() && it->second.region == victim) index_.erase(it);
+        }
+        v.hashes.clear();
+        v.sealed = false;
+        v.gen++;
+        active_ = victim;
+        buf_.clear();
+        buf_.reserve(opts_.region_bytes);
+        return true;
+    }
+
+    void run_writer() {
+        std::unique_lock<std::mutex> lock(mu_);
+        while (running_ || !queue_.empty()) {
+            cv_.wait(lock, [this] { return !running_ || !queue_.empty(); });
+            if (queue_.empty()) continue;
+            size_t r = queue_.front();
+            queue_.pop_front();
+            std::shared_ptr<const std::string> data = regions_[r].pending;
+            lock.unlock();
+            off_t at = (off_t)r * opts_.region_bytes;
+            if (pwrite(fd_, data->data(), data->size(), at) != (ssize_t)data->size()) perror("flash write");
+            // out of the page cache: the point is not to use RAM for these
+            sync_file_range(fd_, at, (off_t)data->size(),
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fd_, at, (off_t)data->size(), POSIX_FADV_DONTNEED);
+            lock.lock();
+            regions_[r].pending.reset();
+            written_++;
+        }
+    }
+
+    Options opts_;
+    int fd_ = -1;
+    std::atomic<bool> running_{false};
+    std::thread writer_;
+    std::condition_variable cv_;
+
+    std::mutex mu_;  // everything below
+    std::vector<Region> regions_;
+    size_t active_ = 0;
+    std::string buf_;  // the open region
+    std::deque<size_t> queue_;
+    std::unordered_map<uint64_t, Loc> index_;
+    uint64_t clock_ = 0;
+    std::atomic<uint64_t> hits_{0}, misses_{0}, reads_{0}, admitted_{0}, dropped_{0}, written_{0}, evicted_{0};
+};
+
+#endif
@@ -0,0 +1,240 @@
+#ifndef KV_HOT_GET_SERVER_H
+#define KV_HOT_GET_SERVER_H
+
+#include "httplib.h"
+#include "event_loop.h"
+#include "kv_engine.h"
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Finished /get responses (status line, headers and body) for hot keys,
+// shared by every connection that asks: a hit is one hash lookup and a
+// refcount bump, and the bytes go out with writev() from this one copy
+// (EventLoop::queue).
+//
+// A key is hot once it missed min_reads times (the counts are forgotten
+// every kCountMax distinct keys). A response is kept only if no write hit
+// its shard between the lookup and publish() (the token, like
+// LruCache::begin_fill), and any change to the key drops it (on_change and
+// on_dirty); everything goes when the engine drops its whole cache
+// (on_flush: lost invalidations, change feed down). Keys with an expiry
+// are never kept. Oldest out first past max_bytes.
+class HotResponses {
+public:
+    using Buffer = EventLoop::Buffer;
+
+    HotResponses(size_t max_bytes, uint32_t min_reads, size_t shards = 16)
+        : max_bytes_(max_bytes / shards), min_reads_(min_reads), shards_(shards) {}
+
+    // The prepared response, or null. Then token != 0 means the key is hot:
+    // build the response and publish() it with this token.
+    Buffer find(const std::string& key, uint64_t& token) {
+        Shard& s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mu);
+        token = 0;
+        auto it = s.map.find(key);
+        if (it != s.map.end()) {
+            hits_++;
+            return it->second.buf;
+        }
+        misses_++;
+        if (s.counts.size() >= kCountMax) s.counts.clear();
+        if (++s.counts[key] >= min_reads_) token = s.seq;
+        return nullptr;
+    }
+
+    void publish(const std::string& key, uint64_t token, Buffer buf) {
+        size_t cost = buf->size() + key.size() + 64;
+        if (!token || cost > max_bytes_) return;
+        Shard& s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mu);
+        if (s.seq != token || s.map.count(key)) return;  // written meanwhile
+        s.counts.erase(key);
+        s.order.push_back(key);
+        s.map[key] = Entry{std::move(buf), std::prev(s.order.end()), cost};
+        s.bytes += cost;
+        published_++;
+        while (s.bytes > max_bytes_) erase(s, s.map.find(s.order.front()));
+    }
+
+    // `key` changed: drop its response and any publish() still under way.
+    void invalidate(const std::string& key) {
+        Shard& s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mu);
+        s.seq++;
+        auto it = s.map.find(key);
+        if (it == s.map.end()) return;
+        erase(s, it);
+        invalidated_++;
+    }
+
+    // Any key may have changed: drop every response and publish() under way.
+    void clear() {
+        for (Shard& s : shards_) {
+            std::lock_guard<std::mutex> lock(s.mu);
+            s.seq++;
+            invalidated_ += s.map.size();
+            s.map.clear();
+            s.order.clear();
+            s.bytes = 0;
+        }
+    }
+
+    std::string status() {
+        size_t keys = 0, bytes = 0;
+        for (Shard& s : shards_) {
+            std::lock_guard<std::mutex> lock(s.mu);
+            keys += s.map.size();
+            bytes += s.bytes;
+        }
+        return "hot keys=" + std::to_string(keys) + " bytes=" + std::to_string(bytes) + " hits=" +
+               std::to_string(hits_) + " misses=" + std::to_string(misses_) + " published=" +
+               std::to_string(published_) + " invalidated=" + std::to_string(invalidated_) + "\n";
+    }
+
+private:
+    static const size_t kCountMax = 65536;  // per shard
+
+    struct Entry {
+        Buffer buf;
+        std::list<std::string>::iterator pos;
+        size_t cost;
+    };
+
+    struct Shard {
+        std::mutex mu;
+        std::unordered_map<std::string, Entry> map;
+        std::list<std::string> order;  // front = oldest
+        std::unordered_map<std::string, uint32_t> counts;  // misses of keys not kept
+        uint64_t seq = 1;  // bumped by every invalidate(); 0 = no token
+        size_t bytes = 0;
+    };
+
+    Shard& shard(const std::string& key) { return shards_[LruCache::key_hash(key) % shards_.size()]; }
+
+    void erase(Shard& s, std::unordered_map<std::string, Entry>::iterator it) {
+        s.bytes -= it->second.cost;
+        s.order.erase(it->second.pos);
+        s.map.erase(it);
+    }
+
+    size_t max_bytes_;
+    uint32_t min_reads_;
+    std::vector<Shard> shards_;
+    std::atomic<uint64_t> hits_{0}, misses_{0}, published_{0}, invalidated_{0};
+};
+
+// HTTP/1.1 listener for GET /get?key=K only (--fast-get-port), for the
+// hottest read path: the answer is the same as the main port's /get, but
+// hot keys are served from HotResponses without building anything, and
+// pipelined requests are answered in one writev(). Values go out decoded
+// (no Content-Encoding), and hits don't reach KvEngine::on_read listeners.
+class HotGetServer {
+public:
+    HotGetServer(KvEngine& engine, HotResponses& hot) : engine_(engine), hot_(hot) {}
+    ~HotGetServer() { stop(); }
+
+    // `threads` loops share the port through SO_REUSEPORT.
+    bool start(const std::string& host, int port, int threads) {
+        for (int i = 0; i < threads; ++i) {
+            std::unique_ptr<EventLoop> loop(new EventLoop());
+            loop->on_data([this](EventLoop::Conn& c) { on_data(c); });
+            if (!loop->listen_tcp(host, port, true)) return false;
+            loops_.push_back(std::move(loop));
+        }
+        for (auto& loop : loops_) {
+            EventLoop* l = loop.get();
+            threads_.emplace_back([l] { l->run(); });
+        }
+        return true;
+    }
+
+    void stop() {
+        for (auto& loop : loops_) loop->stop();
+        for (auto& t : threads_) t.join();
+        threads_.clear();
+        loops_.clear();
+    }
+
+private:
+    void on_data(EventLoop::Conn& c) {
+        size_t pos = 0;
+        while (!c.close_after_write) {
+            size_t end = c.in.find("\r\n\r\n", pos);
+            if (end == std::string::npos) {
+                if (c.in.size() - pos > 16384) error(c, 431, "header too large");
+                break;
+            }
+            request(c, c.in.substr(pos, end - pos));
+            pos = end + 4;
+        }
+        c.in.erase(0, pos);
+    }
+
+    void request(EventLoop::Conn& c, const std::string& head) {
+        bool keep_alive = head.find("HTTP/1.1") != std::string::npos &&
+                          head.find("Connection: close") == std::string::npos &&
+                          head.find("connection: close") == std::string::npos;
+        size_t sp = head.find(' ', 4);
+        if (head.compare(0, 9, "GET /get?") != 0 || sp == std::string::npos) {
+            error(c, head.compare(0, 4, "GET ") == 0 ? 404 : 405, "only GET /get?key= here");
+            return;
+        }
+        httplib::Params params;
+        httplib::detail::parse_query_text(head.substr(9, sp - 9), params);
+        auto it = params.find("key");
+        std::string key = it == params.end() ? std::string() : it->second;
+
+        uint64_t token = 0;
+        HotResponses::Buffer buf = keep_alive ? hot_.find(key, token) : nullptr;
+        if (!buf) {
+            ValueRef value;
+            uint64_t ver = 0;
+            bool found = engine_.get_ref(key, value, &ver);
+            if (!found) value = not_found_;
+            std::string top = headers(found, ver, value->size(), keep_alive);
+            if (!token || engine_.ttl(key) >= 0) {
+                // not kept: headers, then the value from its shared buffer
+                c.out += top;
+                EventLoop::append(c, value);
+                c.close_after_write = !keep_alive;
+                return;
+            }
+            buf = std::make_shared<const std::string>(top + *value);
+            hot_.publish(key, token, buf);
+        }
+        EventLoop::queue(c, std::move(buf));
+    }
+
+    static std::string headers(bool found, uint64_t ver, size_t length, bool keep_alive) {
+        std::string out = "HTTP/1.1 200 OK\r\n";
+        if (found) out += "X-Version: " + std::to_string(ver) + "\r\n";
+        out += "Content-Type: text/plain\r\nContent-Length: " + std::to_string(length) + "\r\n";
+        if (!keep_alive) out += "Connection: close\r\n";
+        out += "\r\n";
+        return out;
+    }
+
+    static void error(EventLoop::Conn& c, int status, const std::string& body) {
+        c.out += "HTTP/1.1 " + std::to_string(status) + " " + httplib::detail::status_message(status) +
+                 "\r\nContent-Type: text/plain\r\nContent-Length: " + std::to_string(body.size()) +
+                 "\r\nConnection: close\r\n\r\n" + body;
+        c.close_after_write = true;
+    }
+
+    KvEngine& engine_;
+    HotResponses& hot_;
+    const ValueRef not_found_ = std::make_shared<const std::string>("NOT_FOUND");
+    std::vector<std::unique_ptr<EventLoop>> loops_;
+    std::vector<std::thread> threads_;
+};
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef KV_INVAL_BUS_H
+#define KV_INVAL_BUS_H
+
+#include "kv_engine.h"
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Cache invalidation between instances that share one storage (several
+// servers on the same MySQL kv_store). Every local write is announced to
+// the others, which pass the key to KvEngine::invalidated(): it leaves the
+// LruCache and every change listener hears of it (watches, /invalidations
+// for client near caches, shared memory, hot responses), so each instance
+// can keep its caches on without serving another instance's overwritten
+// values.
+//
+// Transport is UDP: one multicast group (--inval-group 239.255.0.1:7400,
+// every instance joins it) or a list of unicast peers (--inval-peers, for
+// networks without multicast). A datagram carries a batch of keys (about
+// kMaxBytes of them; a longer key goes alone), collected for batch_ms
+// after the first write:
+//
+//   "KVI2" | u64 sender | u64 seq | u16 count | u16 flags | count x (u16 len | key)
+//
+// (host byte order, all instances must have the same endianness). sender is
+// random per process start; seq counts datagrams from 1. Anything a
+// receiver can't account for makes it call KvEngine::invalidate_all(): a
+// seq jump (lost datagram), a sender first heard after its seq 1, a key
+// too long for a datagram. Senders also send an empty batch every
+// heartbeat_ms, so a lost datagram is noticed within one heartbeat even
+// when writes stop, and a sender that has been silent for silence_ms
+// (partition, crash) gets everything invalidated again every silence_ms
+// until it is heard from; values are then at most silence_ms old. After
+// kForgetAfter silent periods it is forgotten, as after a clean stop
+// (BYE); if it comes back it counts as first heard after seq 1.
+class InvalidationBus {
+public:
+    struct Options {
+        std::string group;               // multicast host:port, or
+        std::vector<std::string> peers;  // unicast host:port of the other instances
+        int port = 7400;                 // listen port for peers mode
+        int batch_ms = 1;
+        int heartbeat_ms = 100;
+        int silence_ms = 1000;
+    };
+
+    InvalidationBus(KvEngine& engine, const Options& opts) : engine_(engine), opts_(opts) {
+        std::random_device rd;
+        id_ = ((uint64_t)rd() << 32) ^ rd() ^ (uint64_t)getpid();
+    }
+
+    ~InvalidationBus() { stop(); }
+
+    bool start() {
+        fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd_ < 0) { perror("socket"); return false; }
+        int one = 1;
+        setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        // several instances on one host share the group port (multicast goes to all of them)
+        if (!opts_.group.empty()) setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+        struct sockaddr_in local;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (!opts_.group.empty()) {
+            struct sockaddr_in g;
+            if (!resolve(opts_.group, g)) return false;
+            local.sin_port = g.sin_port;
+            targets_.push_back(g);
+            struct ip_mreq mreq;
+            mreq.imr_multiaddr = g.sin_addr;
+            mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+            unsigned char loop = 1;
+            setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+            if (bind(fd_, (struct sockaddr*)&local, sizeof(local)) < 0 ||
+                setsockopt(fd_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+                perror("invalidation group");
+                return false;
+            }
+        } else {
+            for (auto& p : opts_.peers) {
+                struct sockaddr_in a;
+                if (!resolve(p, a)) return false;
+                targets_.push_back(a);
+            }
+            local.sin_port = htons((uint16_t)opts_.port);
+            if (bind(fd_, (struct sockaddr*)&local, sizeof(local)) < 0) {
+                perror("invalidation port");
+                return false;
+            }
+        }
+
+        running_ = true;
+        sender_ = std::thread([this] { run_sender(); });
+        receiver_ = std::thread([this] { run_receiver(); });
+        return true;
+    }
+
+    void stop() {
+        if (!running_.exchange(false)) return;
+        cv_.notify_all();
+        sender_.join();
+        receiver_.join();
+        send_batch(std::vector<std::string>(), kBye);
+        ::close(fd_);
+    }
+
+    // Change listener: queue the key for the next datagram. Keys the
+    // receiver thread applies come back through here and are not sent on.
+    void publish(const std::string& key) {
+        if (std::this_thread::get_id() == receiver_.get_id()) return;
+        std::lock_guard<std::mutex> lock(mu_);
+        pending_.push_back(key);
+        if (pending_.size() == 1) cv_.notify_one();
+    }
+
+    std::string status() {
+        std::lock_guard<std::mutex> lock(peers_mu_);
+        std::string out = "sent=" + std::to_string(sent_) + " keys_sent=" + std::to_string(keys_sent_) +
+                          " received=" + std::to_string(received_) + " keys_received=" + std::to_string(keys_received_) +
+                          " gaps=" + std::to_string(gaps_) + " flushes=" + std::to_string(flushes_) +
+                          " forgotten=" + std::to_string(forgotten_) + "\n";
+        int64_t now = now_ms();
+        for (auto& kv : senders_) {
+            char line[128];
+            snprintf(line, sizeof(line), "peer %016llx seq=%llu idle_ms=%lld\n", (unsigned long long)kv.first,
+                     (unsigned long long)kv.second.seq, (long long)(now - kv.second.heard_ms));
+            out += line;
+        }
+        return out;
+    }
+
+private:
+    static const size_t kMaxBytes = 1400;      // of keys per datagram: fits a 1500 byte MTU
+    static const size_t kMaxDatagram = 65507;  // UDP over IPv4
+    static const size_t kHeader = 24;
+    static const int kForgetAfter = 10;        // silence_ms periods
+    static const uint16_t kBye = 1;
+    static const uint16_t kFlush = 2;          // invalidate everything
+
+    struct Sender {
+        uint64_t seq = 0;
+        int64_t heard_ms = 0;
+        int64_t flushed_ms = 0;  // last silence flush
+    };
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool resolve(const std::string& addr, struct sockaddr_in& out) {
+        size_t colon = addr.rfind(':');
+        struct addrinfo hints, *res = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        if (colon == std::string::npos ||
+            getaddrinfo(addr.substr(0, colon).c_str(), addr.substr(colon + 1).c_str(), &hints, &res) != 0) {
+            fprintf(stderr, "bad invalidation address %s\n", addr.c_str());
+            return false;
+        }
+        memcpy(&out, res->ai_addr, sizeof(out));
+        freeaddrinfo(res);
+        return true;
+    }
+
+    void send_batch(const std::vector<std::string>& keys, uint16_t flags = 0) {
+        std::string d = "KVI2";
+        uint64_t seq = ++seq_;
+        uint16_t count = (uint16_t)keys.size();
+        d.append((const char*)&id_, 8);
+        d.append((const char*)&seq, 8);
+        d.append((const char*)&count, 2);
+        d.append((const char*)&flags, 2);
+        for (auto& k : keys) {
+            uint16_t len = (uint16_t)k.size();
+            d.append((const char*)&len, 2);
+            d.append(k);
+        }
+        for (auto& t : targets_) sendto(fd_, d.data(), d.size(), 0, (struct sockaddr*)&t, sizeof(t));
+        sent_++;
+        keys_sent_ += keys.size();
+    }
+
+    // Splits `keys` into datagrams of about kMaxBytes.
+    void send_keys(const std::vector<std::string>& keys) {
+        std::vector<std::string> batch;
+        size_t bytes = 0;
+        for (auto& k : keys) {
+            if (kHeader + 2 + k.size() > kMaxDatagram) {
+                send_batch(std::vector<std::string>(), kFlush);
+                continue;
+            }
+            if (!batch.empty() && bytes + 2 + k.size() > kMaxBytes) {
+                send_batch(batch);
+                batch.clear();
+                bytes = 0;
+            }
+            batch.push_back(k);
+            bytes += 2 + k.size();
+        }
+        if (!batch.empty()) send_batch(batch);
+    }
+
+    void run_sender() {
+        std::unique_lock<std::mutex> lock(mu_);
+        while (running_) {
+            cv_.wait_for(lock, std::chrono::milliseconds(opts_.heartbeat_ms), [&] { return !running_ || !pending_.empty(); });
+            if (!pending_.empty() && opts_.batch_ms > 0) {
+                // let the writes of the next batch_ms join this datagram
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::milliseconds(opts_.batch_ms));
+                lock.lock();
+            }
+            std::vector<std::string> batch;
+            batch.swap(pending_);
+            lock.unlock();
+            if (batch.empty()) send_batch(batch);  // heartbeat
+            else send_keys(batch);
+            lock.lock();
+        }
+    }
+
+    void run_receiver() {
+        std::vector<char> buf(kMaxDatagram);
+        while (running_) {
+            struct pollfd p = {fd_, POLLIN, 0};
+            if (poll(&p, 1, opts_.heartbeat_ms) > 0) {
+                ssize_t n = recv(fd_, buf.data(), buf.size(), 0);
+                if (n >= (ssize_t)kHeader && memcmp(buf.data(), "KVI2", 4) == 0) on_datagram(buf.data(), (size_t)n);
+            }
+            check_silence();
+        }
+    }
+
+    void on_datagram(const char* d, size_t n) {
+        uint64_t sender, seq;
+        uint16_t count, flags;
+        memcpy(&sender, d + 4, 8);
+        memcpy(&seq, d + 12, 8);
+        memcpy(&count, d + 20, 2);
+        memcpy(&flags, d + 22, 2);
+        if (sender == id_) return;  // our own (multicast loop)
+        std::vector<std::string> keys;
+        size_t pos = kHeader;
+        for (uint16_t i = 0; i < count; ++i) {
+            uint16_t len;
+            if (pos + 2 > n) return;  // cut short
+            memcpy(&len, d + pos, 2);
+            if (pos + 2 + len > n) return;
+            keys.emplace_back(d + pos + 2, len);
+            pos += 2 + len;
+        }
+
+        bool flush = flags & kFlush;
+        {
+            std::lock_guard<std::mutex> lock(peers_mu_);
+            received_++;
+            if (flags & kBye) {
+                senders_.erase(sender);
+                return;
+            }
+            auto it = senders_.find(sender);
+            if (it == senders_.end()) {
+                it = senders_.emplace(sender, Sender()).first;
+                if (seq != 1) flush = true;  // started (or forgotten) before we heard it
+            } else if (seq <= it->second.seq) {
+                return;  // duplicate or late; a gap flush already covered it
+            } else if (seq != it->second.seq + 1) {
+                gaps_++;
+                flush = true;
+            }
+            it->second.seq = seq;
+            it->second.heard_ms = now_ms();
+        }
+        if (flush) {
+            engine_.invalidate_all();
+            flushes_++;
+            return;
+        }
+        for (auto& k : keys) engine_.invalidated(k);
+        keys_received_ += keys.size();
+    }
+
+    void check_silence() {
+        int64_t now = now_ms();
+        bool flush = false;
+        {
+            std::lock_guard<std::mutex> lock(peers_mu_);
+            for (auto it = senders_.begin(); it != senders_.end();) {
+                Sender& s = it->second;
+                if (now - s.heard_ms >= (int64_t)opts_.silence_ms * kForgetAfter) {
+                    it = senders_.erase(it);
+                    forgotten_++;
+                    continue;
+                }
+                if (now - s.heard_ms >= opts_.silence_ms && now - s.flushed_ms >= opts_.silence_ms) {
+                    s.flushed_ms = now;
+                    flush = true;
+                }
+                ++it;
+            }
+        }
+        if (flush) {
+            engine_.invalidate_all();
+            flushes_++;
+        }
+    }
+
+    KvEngine& engine_;
+    Options opts_;
+    uint64_t id_;
+    int fd_ = -1;
+    std::vector<struct sockaddr_in> targets_;
+    std::atomic<bool> running_{false};
+    std::thread sender_, receiver_;
+
+    std::mutex mu_;  // pending_
+    std::condition_variable cv_;
+    std::vector<std::string> pending_;
+    uint64_t seq_ = 0;  // sender thread (and stop() after it)
+
+    std::mutex peers_mu_;  // senders_
+    std::map<uint64_t, Sender> senders_;
+    std::atomic<uint64_t> sent_{0}, keys_sent_{0}, received_{0}, keys_received_{0}, gaps_{0},
+        flushes_{0}, forgotten_{0};
+};
+
+#endif
@@ -0,0 +1,638 @@
+#ifndef KV_CLIENT_H
+#define KV_CLIENT_H
+
+#include "httplib.h"
+#include "lru_cache.h"
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Client for the HTTP API of server.cpp.
+//
+//   KvClient kv(KvClient::Options{});          // 127.0.0.1:8080
+//   kv.set("name", "harshay");
+//   KvResult r = kv.get("name");                // r.ok, r.found, r.value, r.version
+//   kv.get_async("name", [](const KvResult& r) { ... });
+//   std::future<KvResult> f = kv.get_async("name");
+//
+// Every call is queued and run by one of `connections` worker threads, each
+// holding one keep-alive connection. A worker that picks up a get also takes
+// every other get waiting in the queue (up to max_batch) and sends them as
+// one POST /mget, so concurrent callers share round trips. This stands in
+// for HTTP pipelining, which httplib's server does not support.
+//
+// With near_cache_bytes > 0, get results are kept in a local LRU and a
+// background thread long-polls /invalidations on the watch port (server
+// --watch-port, off by default; invalidation_port here); every key
+// written on the server is dropped from it within one round trip. If that
+// stream breaks, the near cache is cleared and bypassed until it is back,
+// so a cached value is never older than invalidation_timeout_s + 1 seconds
+// even when invalidations get lost on the way.
+//
+// Several `endpoints` (instances serving the same keys) spread the gets:
+// each get goes to the better of two random endpoints, scored by latency
+// EWMA times requests in flight (power of two choices). Writes always go
+// to the first endpoint. With hedge = true a get that has not answered
+// after the endpoint's p95 latency is sent again to another endpoint; the
+// first answer wins and the other one is ignored when it arrives. At most
+// hedge_max_ratio of the gets are hedged, so a stalled instance costs a
+// little extra load instead of a timeout.
+//
+// Calls are not ordered against each other: wait for a write's result
+// before reading the key back. unix_socket, when set, names the socket of
+// the server at host:port (its --unix-socket) and is used instead of TCP
+// as long as it exists; it is never guessed, since another instance on the
+// same host may own it. Callbacks run on a worker thread and must not block.
+struct KvResult {
+    bool ok = false;     // the server answered
+    bool found = false;  // get: key exists; incr: value was a number; cas: stored
+    std::string value;   // get: value; incr: new value
+    uint64_t version = 0;
+    std::string error;
+};
+
+class KvClient {
+public:
+    using Callback = std::function<void(const KvResult&)>;
+
+    struct Options {
+        std::string host = "127.0.0.1";
+        int port = 8080;
+        std::string unix_socket;  // server --unix-socket of host:port; "" = TCP
+        int connections = 4;
+        int connect_timeout_ms = 1000;
+        int timeout_ms = 2000;  // read and write
+        size_t max_batch = 64;  // gets per /mget
+        size_t near_cache_bytes = 0;  // 0 = no near cache
+        int invalidation_port = 8081;  // server --watch-port
+        int invalidation_timeout_s = 5;
+        std::vector<std::string> endpoints;  // "host:port"; empty = host:port
+        bool hedge = false;
+        int hedge_min_us = 500;         // never hedge sooner than this
+        double hedge_max_ratio = 0.1;   // share of gets that may be hedged
+    };
+
+    explicit KvClient(const Options& opts) : opts_(opts), near_(opts.near_cache_bytes) {
+        std::vector<std::string> list = opts.endpoints;
+        if (list.empty()) list.push_back(opts.host + ":" + std::to_string(opts.port));
+        for (auto& hp : list) {
+            std::unique_ptr<Endpoint> e(new Endpoint());
+            size_t colon = hp.rfind(':');
+            e->host = hp.substr(0, colon);
+            e->port = colon == std::string::npos ? 8080 : atoi(hp.c_str() + colon + 1);
+            e->unix_socket = list.size() == 1 && !opts.unix_socket.empty() && is_local(e->host) &&
+                             socket_exists(opts.unix_socket);
+            endpoints_.push_back(std::move(e));
+        }
+        hedging_ = opts.hedge && endpoints_.size() > 1;
+        if (hedging_) hedger_ = std::thread([this] { run_hedger(); });
+        int n = opts.connections > 0 ? opts.connections : 1;
+        for (int i = 0; i < n; ++i) workers_.emplace_back([this] { work(); });
+        if (near_.enabled()) poller_ = std::thread([this] { poll_invalidations(); });
+    }
+
+    ~KvClient() {
+        {
+            std::lock_guard<std::mutex> lock(hedge_mu_);
+            hedge_stop_ = true;
+        }
+        hedge_wake_.notify_all();
+        if (hedger_.joinable()) hedger_.join();
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            stopping_ = true;
+            if (poll_cli_) poll_cli_->stop();
+        }
+        ready_.notify_all();
+        for (auto& t : workers_) t.join();
+        if (poller_.joinable()) poller_.join();
+    }
+
+    uint64_t near_hits() const { return near_.hits(); }
+    uint64_t hedged() const { return hedges_; }
+
+    std::string transport() const {
+        std::string out;
+        for (auto& e : endpoints_)
+            out += (out.empty() ? "" : ",") + (e->unix_socket ? opts_.unix_socket : e->host + ":" + std::to_string(e->port));
+        return out;
+    }
+
+    /* ---------- async ---------- */
+
+    // A near cache hit calls `done` right away on the calling thread.
+    void get_async(const std::string& key, Callback done) {
+        if (!near_usable()) {
+            submit(Op{Op::GET, key, "", 0, 0, std::move(done)});
+            return;
+        }
+        KvResult hit;
+        if (near_.get(key, hit.value, &hit.version)) {
+            hit.ok = hit.found = true;
+            done(hit);
+            return;
+        }
+        uint64_t token = near_.begin_fill(key);
+        submit(Op{Op::GET, key, "", 0, 0, [this, key, token, done](const KvResult& r) {
+            if (r.found) near_.fill(key, r.value, r.version, token);
+            done(r);
+        }});
+    }
+    void set_async(const std::string& key, const std::string& value, Callback done) {
+        submit(write_op(Op{Op::SET, key, value, 0, 0, std::move(done)}));
+    }
+    void del_async(const std::string& key, Callback done) {
+        submit(write_op(Op{Op::DEL, key, "", 0, 0, std::move(done)}));
+    }
+    void incr_async(const std::string& key, long long delta, Callback done) {
+        submit(write_op(Op{Op::INCR, key, "", delta, 0, std::move(done)}));
+    }
+    void cas_async(const std::string& key, uint64_t expected_version, const std::string& value, Callback done) {
+        submit(write_op(Op{Op::CAS, key, value, 0, expected_version, std::move(done)}));
+    }
+
+    std::future<KvResult> get_async(const std::string& key) {
+        return promised([&](Callback cb) { get_async(key, std::move(cb)); });
+    }
+    std::future<KvResult> set_async(const std::string& key, const std::string& value) {
+        return promised([&](Callback cb) { set_async(key, value, std::move(cb)); });
+    }
+
+    /* ---------- blocking ---------- */
+
+    KvResult get(const std::string& key) { return get_async(key).get(); }
+    KvResult set(const std::string& key, const std::string& value) { return set_async(key, value).get(); }
+    KvResult del(const std::string& key) {
+        return promised([&](Callback cb) { del_async(key, std::move(cb)); }).get();
+    }
+    KvResult incr(const std::string& key, long long delta = 1) {
+        return promised([&](Callback cb) { incr_async(key, delta, std::move(cb)); }).get();
+    }
+    KvResult cas(const std::string& key, uint64_t expected_version, const std::string& value) {
+        return promised([&](Callback cb) { cas_async(key, expected_version, value, std::move(cb)); }).get();
+    }
+
+    // All gets are queued first, so they leave in as few /mget calls as possible.
+    std::vector<KvResult> mget(const std::vector<std::string>& keys) {
+        std::vector<std::future<KvResult>> futures;
+        for (auto& k : keys) futures.push_back(get_async(k));
+        std::vector<KvResult> out;
+        for (auto& f : futures) out.push_back(f.get());
+        return out;
+    }
+
+private:
+    struct GetBatch;
+
+    struct Op {
+        enum Kind { GET, SET, DEL, INCR, CAS, HEDGE } kind;
+        std::string key;
+        std::string value;
+        long long delta;
+        uint64_t expected;
+        Callback done;
+        std::shared_ptr<GetBatch> hedge = nullptr;  // HEDGE: the batch to send again
+    };
+
+    struct Endpoint {
+        std::string host;
+        int port;
+        bool unix_socket;
+        std::atomic<int> outstanding{0};
+        std::mutex mu;
+        double ewma_us = 0;
+        int64_t last_ms = 0;
+        std::vector<uint32_t> samples;  // last kSamples latencies, for p95
+        size_t next = 0;
+        uint64_t p95_us = 0;
+    };
+
+    struct Request {
+        bool post;
+        std::string path;
+        std::string body;
+    };
+
+    // One /get or /mget that may be sent twice (primary + hedge).
+    struct GetBatch {
+        std::vector<Op> ops;
+        std::unordered_map<std::string, size_t> slot;  // key -> position in the reply
+        std::string single;                            // the key if there is only one
+        Request req;
+        size_t primary = 0;
+        std::mutex mu;
+        bool done = false;
+        bool inflight[2] = {false, false};  // primary, hedge
+        bool armed = false;                  // in hedge_timers_ (hedge_mu_)
+        std::multimap<int64_t, std::shared_ptr<GetBatch>>::iterator timer;
+    };
+
+    struct Worker {
+        std::vector<std::unique_ptr<httplib::Client>> clients;  // one per endpoint
+    };
+
+    static const size_t kSamples = 128;
+
+    static bool is_local(const std::string& host) {
+        return host == "127.0.0.1" || host == "localhost" || host == "::1";
+    }
+
+    static bool socket_exists(const std::string& path) {
+        struct stat st;
+        return !path.empty() && stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode);
+    }
+
+    template <typename Start>
+    static std::future<KvResult> promised(Start start) {
+        auto p = std::make_shared<std::promise<KvResult>>();
+        std::future<KvResult> f = p->get_future();
+        start([p](const KvResult& r) { p->set_value(r); });
+        return f;
+    }
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    bool near_usable() const { return near_.enabled() && now_ms() < healthy_until_ms_; }
+
+    // Our own writes leave the near cache before they are sent and again
+    // when they are done, without waiting for the invalidation stream.
+    Op write_op(Op op) {
+        if (!near_.enabled()) return op;
+        near_.erase(op.key);
+        Callback done = std::move(op.done);
+        std::string key = op.key;
+        op.done = [this, key, done](const KvResult& r) {
+            near_.erase(key);
+            done(r);
+        };
+        return op;
+    }
+
+    // Background thread: GET /invalidations on the watch port in a loop.
+    void poll_invalidations() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (stopping_) return;
+            poll_cli_.reset(new httplib::Client(endpoints_[0]->host, opts_.invalidation_port));
+            poll_cli_->set_keep_alive(true);
+            poll_cli_->set_connection_timeout(0, opts_.connect_timeout_ms * 1000);
+            poll_cli_->set_read_timeout(opts_.invalidation_timeout_s + 1, 0);
+        }
+        bool synced = false;
+        uint64_t since = 0;
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                if (stopping_) return;
+            }
+            std::string path = "/invalidations";
+            if (synced) path += "?since=" + std::to_string(since) + "&timeout=" + std::to_string(opts_.invalidation_timeout_s);
+            auto res = poll_cli_->Get(path.c_str());
+            if (!res || res->status != 200) {
+                healthy_until_ms_ = 0;
+                near_.clear();
+                synced = false;
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                continue;
+            }
+            since = strtoull(res->get_header_value("X-Seq").c_str(), NULL, 10);
+            if (!synced || res->body.compare(0, 5, "FLUSH") == 0) {
+                near_.clear();
+                synced = true;
+            } else {
+                size_t pos = 0, eol;
+                while ((eol = res->body.find('\n', pos)) != std::string::npos) {
+                    near_.erase(httplib::detail::decode_url(res->body.substr(pos, eol - pos), false));
+                    pos = eol + 1;
+                }
+            }
+            healthy_until_ms_ = now_ms() + (opts_.invalidation_timeout_s + 1) * 1000;
+        }
+    }
+
+    void submit(Op op) {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            queue_.push_back(std::move(op));
+        }
+        ready_.notify_one();
+    }
+
+    httplib::Client& client(Worker& w, size_t ep) {
+        std::unique_ptr<httplib::Client>& cli = w.clients[ep];
+        if (cli) return *cli;
+        const Endpoint& e = *endpoints_[ep];
+        cli.reset(new httplib::Client(e.unix_socket ? opts_.unix_socket : e.host, e.port));
+        if (e.unix_socket) cli->set_address_family(AF_UNIX);
+        cli->set_keep_alive(true);
+        cli->set_tcp_nodelay(true);
+        cli->set_connection_timeout(0, opts_.connect_timeout_ms * 1000);
+        cli->set_read_timeout(0, opts_.timeout_ms * 1000);
+        cli->set_write_timeout(0, opts_.timeout_ms * 1000);
+        return *cli;
+    }
+
+    void work() {
+        Worker w;
+        w.clients.resize(endpoints_.size());
+        std::vector<Op> batch;
+        while (true) {
+            batch.clear();
+            {
+                std::unique_lock<std::mutex> lock(mu_);
+                ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+                if (queue_.empty()) return;  // stopping and drained
+                batch.push_back(std::move(queue_.front()));
+                queue_.pop_front();
+                if (batch[0].kind == Op::GET) {
+                    for (auto it = queue_.begin(); it != queue_.end() && batch.size() < opts_.max_batch;) {
+                        if (it->kind != Op::GET) { ++it; continue; }
+                        batch.push_back(std::move(*it));
+                        it = queue_.erase(it);
+                    }
+                }
+            }
+            if (batch[0].kind == Op::GET) run_gets(w, batch);
+            else if (batch[0].kind == Op::HEDGE) run_hedge(w, batch[0].hedge);
+            else run_one(w, batch[0]);
+        }
+    }
+
+    static std::string param(const std::string& s) { return httplib::detail::encode_query_param(s); }
+
+    static KvResult failed(const httplib::Result& res) {
+        KvResult r;
+        r.error = res ? "HTTP " + std::to_string(res->status) : httplib::to_string(res.error());
+        return r;
+    }
+
+    /* ---------- endpoint choice ---------- */
+
+    static int64_t now_us() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // EWMA halves for every idle second, so an endpoint that was slow once
+    // gets tried again; times one plus the requests it is working on.
+    double score(Endpoint& e) {
+        double ewma;
+        int64_t idle_s;
+        {
+            std::lock_guard<std::mutex> lock(e.mu);
+            ewma = e.ewma_us;
+            idle_s = (now_ms() - e.last_ms) / 1000;
+        }
+        if (idle_s > 0) ewma /= (double)(1LL << std::min<int64_t>(idle_s, 30));
+        return (ewma + 1) * (e.outstanding + 1);
+    }
+
+    // Better of two random endpoints, never `exclude`.
+    size_t pick(size_t exclude) {
+        size_t n = endpoints_.size();
+        if (n == 1) return 0;
+        if (n == 2 && exclude < n) return 1 - exclude;
+        thread_local std::mt19937 rng(std::random_device{}());
+        size_t a, b;
+        do a = rng() % n; while (a == exclude);
+        do b = rng() % n; while (b == exclude || b == a);
+        return score(*endpoints_[a]) <= score(*endpoints_[b]) ? a : b;
+    }
+
+    void record(size_t ep, uint64_t us) {
+        Endpoint& e = *endpoints_[ep];
+        std::lock_guard<std::mutex> lock(e.mu);
+        e.ewma_us = e.last_ms == 0 ? (double)us : 0.8 * e.ewma_us + 0.2 * (double)us;
+        e.last_ms = now_ms();
+        if (e.samples.size() < kSamples) e.samples.push_back((uint32_t)us);
+        else e.samples[e.next] = (uint32_t)us;
+        e.next = (e.next + 1) % kSamples;
+        if (e.next % 16 == 0) {
+            std::vector<uint32_t> sorted = e.samples;
+            size_t k = sorted.size() * 95 / 100;
+            std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+            e.p95_us = sorted[k];
+        }
+    }
+
+    uint64_t hedge_delay(size_t ep) {
+        Endpoint& e = *endpoints_[ep];
+        std::lock_guard<std::mutex> lock(e.mu);
+        return std::max<uint64_t>(e.p95_us, (uint64_t)opts_.hedge_min_us);
+    }
+
+    // Sends on this worker's connection to `ep`. When part of a hedged pair
+    // the side is marked in flight in `g`, so a failure on the other side
+    // waits for this one instead of failing the batch.
+    httplib::Result send(Worker& w, size_t ep, const Request& req, GetBatch* g, int side) {
+        httplib::Client& cli = client(w, ep);
+        if (g) {
+            std::lock_guard<std::mutex> lock(g->mu);
+            if (g->done) return httplib::Result(nullptr, httplib::Error::Canceled);
+            g->inflight[side] = true;
+        }
+        Endpoint& e = *endpoints_[ep];
+        e.outstanding++;
+        int64_t t0 = now_us();
+        auto res = req.post ? cli.Post(req.path.c_str(), req.body, "application/x-www-form-urlencoded")
+                            : cli.Get(req.path.c_str());
+        uint64_t us = (uint64_t)(now_us() - t0);
+        e.outstanding--;
+        bool lost = false;
+        if (g) {
+            std::lock_guard<std::mutex> lock(g->mu);
+            g->inflight[side] = false;
+            lost = g->done;
+        }
+        // a loser was at least this slow; a hard error counts as a timeout
+        record(ep, res || lost ? us : (uint64_t)opts_.timeout_ms * 1000);
+        return res;
+    }
+
+    /* ---------- gets ---------- */
+
+    void run_gets(Worker& w, std::vector<Op>& batch) {
+        // httplib drops repeated identical params, so every key goes out once
+        auto g = std::make_shared<GetBatch>();
+        g->ops.swap(batch);
+        std::string form;
+        for (auto& op : g->ops) {
+            if (!g->slot.emplace(op.key, g->slot.size()).second) continue;
+            form += (form.empty() ? "key=" : "&key=") + param(op.key);
+        }
+        if (g->slot.size() == 1) g->req = Request{false, "/get?key=" + param(g->ops[0].key), ""};
+        else g->req = Request{true, "/mget", form};
+
+        g->primary = pick(SIZE_MAX);
+        gets_++;
+        if (hedging_ && hedges_ < gets_ * opts_.hedge_max_ratio) {
+            std::lock_guard<std::mutex> lock(hedge_mu_);
+            g->timer = hedge_timers_.emplace(now_us() + (int64_t)hedge_delay(g->primary), g);
+            g->armed = true;
+            if (g->timer == hedge_timers_.begin()) hedge_wake_.notify_one();  // new earliest deadline
+        }
+        finish(*g, 0, send(w, g->primary, g->req, g.get(), 0));
+    }
+
+    void run_hedge(Worker& w, const std::shared_ptr<GetBatch>& g) {
+        finish(*g, 1, send(w, pick(g->primary), g->req, g.get(), 1));
+    }
+
+    // First good answer wins; a failure only counts if the other side is
+    // not still running. The loser is left to finish on its keep-alive
+    // connection: closing it would mean reconnecting to the slow instance,
+    // whose accept backlog is full while it stalls.
+    void finish(GetBatch& g, int side, const httplib::Result& res) {
+        {
+            std::lock_guard<std::mutex> lock(g.mu);
+            if (g.done) return;
+            bool good = res && res->status == 200;
+            if (!good && g.inflight[1 - side]) return;
+            g.done = true;
+        }
+        if (hedging_) {
+            // drop the timer so the hedger does not wake up for it
+            std::lock_guard<std::mutex> lock(hedge_mu_);
+            if (g.armed) hedge_timers_.erase(g.timer);
+            g.armed = false;
+        }
+        if (!res || res->status != 200) {
+            KvResult r = failed(res);
+            for (auto& op : g.ops) op.done(r);
+        } else if (g.slot.size() == 1) {
+            KvResult r = parse_get(*res);
+            for (auto& op : g.ops) op.done(r);
+        } else {
+            std::vector<KvResult> results = parse_mget(res->body, g.slot.size());
+            for (auto& op : g.ops) op.done(results[g.slot[op.key]]);
+        }
+    }
+
+    // Plain /get: missing keys answer NOT_FOUND without an X-Version header.
+    static KvResult parse_get(const httplib::Response& res) {
+        KvResult r;
+        r.ok = true;
+        r.found = res.has_header("X-Version");
+        if (r.found) {
+            r.version = strtoull(res.get_header_value("X-Version").c_str(), NULL, 10);
+            r.value = res.body;
+        }
+        return r;
+    }
+
+    // "<len> <version>\n<value>\n" or "-1 0\n" per key
+    static std::vector<KvResult> parse_mget(const std::string& body, size_t n) {
+        std::vector<KvResult> results(n);
+        size_t pos = 0;
+        for (KvResult& r : results) {
+            size_t eol = body.find('\n', pos);
+            if (eol == std::string::npos) {
+                r.error = "short /mget reply";
+                continue;
+            }
+            char* end = NULL;
+            long long len = strtoll(body.c_str() + pos, &end, 10);
+            r.version = strtoull(end, NULL, 10);
+            r.ok = true;
+            pos = eol + 1;
+            if (len >= 0 && pos + (size_t)len <= body.size()) {
+                r.found = true;
+                r.value = body.substr(pos, (size_t)len);
+                pos += (size_t)len + 1;
+            }
+        }
+        return results;
+    }
+
+    // Timer thread: queues the hedge of every batch still open at its deadline.
+    void run_hedger() {
+        std::unique_lock<std::mutex> lock(hedge_mu_);
+        while (!hedge_stop_) {
+            if (hedge_timers_.empty()) hedge_wake_.wait(lock);
+            else hedge_wake_.wait_for(lock, std::chrono::microseconds(hedge_timers_.begin()->first - now_us()));
+            int64_t now = now_us();
+            while (!hedge_timers_.empty() && hedge_timers_.begin()->first <= now) {
+                std::shared_ptr<GetBatch> g = hedge_timers_.begin()->second;
+                hedge_timers_.erase(hedge_timers_.begin());
+                g->armed = false;
+                {
+                    std::lock_guard<std::mutex> glock(g->mu);
+                    if (g->done) continue;
+                }
+                hedges_++;
+                std::lock_guard<std::mutex> qlock(mu_);
+                queue_.push_front(Op{Op::HEDGE, "", "", 0, 0, Callback(), g});
+                ready_.notify_one();
+            }
+        }
+    }
+
+    /* ---------- writes (first endpoint) ---------- */
+
+    void run_one(Worker& w, Op& op) {
+        std::string path;
+        switch (op.kind) {
+        case Op::SET: path = "/set?key=" + param(op.key) + "&value=" + param(op.value); break;
+        case Op::DEL: path = "/delete?key=" + param(op.key); break;
+        case Op::INCR: path = "/incr?key=" + param(op.key) + "&delta=" + std::to_string(op.delta); break;
+        case Op::CAS:
+            path = "/cas?key=" + param(op.key) + "&expected_version=" + std::to_string(op.expected) +
+                   "&value=" + param(op.value);
+            break;
+        default: break;
+        }
+        auto res = send(w, 0, Request{false, path, ""}, NULL, 0);
+        if (!res || (res->status != 200 && res->status != 409)) {
+            op.done(failed(res));
+            return;
+        }
+        KvResult r;
+        r.ok = true;
+        r.found = res->status == 200;
+        r.version = strtoull(res->get_header_value("X-Version").c_str(), NULL, 10);
+        if (op.kind == Op::INCR && r.found) r.value = res->body;
+        op.done(r);
+    }
+
+    Options opts_;
+    std::vector<std::unique_ptr<Endpoint>> endpoints_;
+
+    std::mutex mu_;
+    std::condition_variable ready_;
+    std::deque<Op> queue_;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+
+    LruCache near_;
+    std::atomic<int64_t> healthy_until_ms_{0};
+    std::unique_ptr<httplib::Client> poll_cli_;  // guarded by mu_ for stop()
+    std::thread poller_;
+
+    bool hedging_ = false;
+    std::atomic<uint64_t> gets_{0}, hedges_{0};
+    std::mutex hedge_mu_;
+    std::condition_variable hedge_wake_;
+    std::multimap<int64_t, std::shared_ptr<GetBatch>> hedge_timers_;  // deadline (us) -> batch
+    bool hedge_stop_ = false;
+    std::thread hedger_;
+};
+
+#endif
@@ -0,0 +1,577 @@
+#ifndef KV_ENGINE_H
+#define KV_ENGINE_H
+
+#include "storage.h"
+#include "lru_cache.h"
+#include "counter_combiner.h"
+#include "write_coalescer.h"
+#include "value_codec.h"
+#include "dict_trainer.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Latency of the reads answered by one tier (DRAM cache, flash, storage):
+// a power-of-two histogram in nanoseconds, percentiles are bucket bounds.
+struct TierLatency {
+    std::atomic<uint64_t> count{0}, total_ns{0};
+    std::atomic<uint64_t> buckets[48] = {};
+
+    void record(std::chrono::steady_clock::time_point start) {
+        uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start).count();
+        count++;
+        total_ns += ns;
+        int b = 0;
+        while (b < 47 && (2ull << b) <= ns) b++;
+        buckets[b]++;
+    }
+
+    std::string line(const char* name) const {
+        uint64_t n = count;
+        char out[160];
+        auto pct = [&](double p) {
+            uint64_t want = (uint64_t)(n * p), seen = 0;
+            for (int b = 0; b < 48; ++b)
+                if ((seen += buckets[b]) > want) return (double)(2ull << b) / 1000;
+            return 0.0;
+        };
+        snprintf(out, sizeof(out), "%s reads=%llu avg_us=%.1f p50_us<=%.1f p99_us<=%.1f\n", name, (unsigned long long)n,
+                 n ? (double)total_ns / n / 1000 : 0.0, n ? pct(0.5) : 0.0, n ? pct(0.99) : 0.0);
+        return out;
+    }
+};
+
+// What every front end (HTTP, memcached, RESP) talks to: the LRU cache in
+// front of Storage, relaxed counters and sets, key expiry and change listeners
+// (watches etc.). Writes go to storage first, then the cache, then the
+// listeners.
+//
+// Expiry times live in memory only: they are checked on every read and a
+// janitor thread deletes due keys once a second. They do not survive a
+// restart.
+//
+// Values are kept in their ValueCodec form (maybe compressed) everywhere
+// below the engine: cache, flash, coalescer, storage. get() decodes.
+// Compression dictionaries are rows of their own ("\0kvdict:<id>", and
+// "\0kvdict:current" naming the one in use), so they are as durable as the
+// values and reach followers the same way; scan() hides them.
+//
+// Replication: a follower is read only (writes fail) and reports the keys
+// it applied through replicated(). On a primary the commit hook runs after
+// every write and may block until followers have it; committed() tells the
+// writing thread whether it succeeded.
+class KvEngine {
+public:
+    using Listener = std::function<void(const std::string& key)>;
+    using ReadListener = std::function<void(const std::string& key, const std::string& value, uint64_t version)>;
+    using CommitHook = std::function<bool()>;
+    using FlushListener = std::function<void()>;
+
+    KvEngine(Storage& storage, size_t cache_bytes, int counter_flush_ms, int coalesce_flush_ms = 100)
+        : storage_(storage), cache_(cache_bytes), counters_(storage, counter_flush_ms),
+          coalescer_(storage, coalesce_flush_ms) {
+        counters_.on_applied([this](const std::string& key) { cache_.erase(key); });
+        counters_.on_flushed([this](const std::string& key) { changed(key); });
+        // listeners (watches, invalidation bus, replication) hear about a
+        // coalesced set once storage has it, with its real version
+        coalescer_.on_flushed([this](const std::string& key, const std::string& value, uint64_t ver) {
+            if (ver) cache_.put(key, value, ver);
+            else cache_.erase(key);
+            changed(key);
+        });
+    }
+
+    void start() {
+        counters_.start();
+        coalescer_.start();
+        janitor_running_ = true;
+        janitor_ = std::thread([this] {
+            std::unique_lock<std::mutex> lock(janitor_mu_);
+            while (janitor_running_) {
+                janitor_wake_.wait_for(lock, std::chrono::seconds(1));
+                lock.unlock();
+                expire_due();
+                lock.lock();
+            }
+        });
+    }
+
+    void stop() {
+        counters_.stop();
+        coalescer_.stop();
+        if (!janitor_running_.exchange(false)) return;
+        janitor_wake_.notify_all();
+        janitor_.join();
+    }
+
+    // Called after every write, from the writing thread.
+    void on_change(Listener fn) { listeners_.push_back(std::move(fn)); }
+
+    // Called, from the writing thread, when what get() returns for a key
+    // changes before on_change hears of it: a coalesced set or relaxed
+    // increment not in storage yet, or a new expiry time. For copies of
+    // read results (hot responses). Register before any traffic.
+    void on_dirty(Listener fn) { dirty_listeners_.push_back(std::move(fn)); }
+
+    // Called after every successful get (the shared-memory cache uses it to
+    // see which keys are hot). Register before any traffic.
+    void on_read(ReadListener fn) { read_listeners_.push_back(std::move(fn)); }
+
+    // Called when any key may have changed without being named (the cache
+    // was cleared by invalidate_all()). Register before any traffic.
+    void on_flush(FlushListener fn) { flush_listeners_.push_back(std::move(fn)); }
+
+    // Runs after every write, from the writing thread. Register before any traffic.
+    void on_commit(CommitHook fn) { commit_ = std::move(fn); }
+
+    // False if the commit hook failed for this thread's last write.
+    static bool committed() { return commit_ok(); }
+
+    void set_read_only(bool on) { read_only_ = on; }
+    bool read_only() const { return read_only_; }
+
+    // Follower: `key` was changed by a replicated record.
+    void replicated(const std::string& key) {
+        cache_.erase(key);
+        changed(key);
+    }
+
+    // Invalidation bus: another instance wrote `key` to the shared storage.
+    void invalidated(const std::string& key) {
+        cache_.erase(key);
+        changed(key);
+    }
+
+    // Changes to storage may have been missed (lost invalidations, change
+    // feed down): drop the whole cache and tell everyone holding copies.
+    void invalidate_all() {
+        cache_.clear();
+        for (auto& fn : flush_listeners_) fn();
+    }
+
+    // Change feed: storage was written behind our back (value read back
+    // from storage); a cached copy is updated, nothing new is cached.
+    void refreshed(const std::string& key, const std::string& value, uint64_t version) {
+        cache_.refresh(key, value, version);
+        changed(key);
+    }
+
+    bool get(const std::string& key, std::string& value, uint64_t* version = nullptr) {
+        uint64_t ver = 0;
+        ValueRef stored;
+        CounterCombiner::ReadLock counted = counters_.read_lock(key);
+        bool found = lookup(key, stored, ver);
+        long long pending = pending_counts(key, counted);
+        if (found && !codec_.decode(*stored, value)) value.clear();
+        found = add_pending_counts(value, found, pending);
+        if (version) *version = ver;
+        if (found) for (auto& fn : read_listeners_) fn(key, value, ver);
+        return found;
+    }
+
+    // Like get(), but the value as an immutable shared buffer. A plain
+    // (uncompressed) value comes straight from the tier that had it, the
+    // DRAM cache's buffer included: no copy, and it stays valid while a
+    // response is written from it even if the key is evicted or rewritten.
+    bool get_ref(const std::string& key, ValueRef& value, uint64_t* version = nullptr) {
+        uint64_t ver = 0;
+        CounterCombiner::ReadLock counted = counters_.read_lock(key);
+        bool found = lookup(key, value, ver);
+        long long pending = pending_counts(key, counted);
+        if ((found && !ValueCodec::is_plain(*value)) || pending) {
+            std::string plain;
+            if (found && !codec_.decode(*value, plain)) plain.clear();
+            found = add_pending_counts(plain, found, pending);
+            value = std::make_shared<const std::string>(std::move(plain));
+        }
+        if (version) *version = ver;
+        if (found) for (auto& fn : read_listeners_) fn(key, *value, ver);
+        return found;
+    }
+
+    // Like get(), but a compressed value comes back as its gzip member
+    // (gzipped = true), for clients that take Content-Encoding: gzip.
+    bool get_stored(const std::string& key, std::string& value, uint64_t* version, bool& gzipped) {
+        uint64_t ver = 0;
+        ValueRef stored;
+        CounterCombiner::ReadLock counted = counters_.read_lock(key);
+        bool found = lookup(key, stored, ver);
+        long long pending = pending_counts(key, counted);
+        gzipped = found && ValueCodec::is_gzip(*stored) && pending == 0;
+        if (gzipped) {
+            value = ValueCodec::gzip_body(*stored);
+            if (!read_listeners_.empty()) {
+                std::string plain;
+                codec_.decode(std::string("\0KVZ", 4) + value, plain);
+                for (auto& fn : read_listeners_) fn(key, plain, ver);
+            }
+        } else {
+            if (found && !codec_.decode(*stored, value)) value.clear();
+            found = add_pending_counts(value, found, pending);
+            if (found) for (auto& fn : read_listeners_) fn(key, value, ver);
+        }
+        if (version) *version = ver;
+        return found;
+    }
+
+    // --compress-min-bytes; before any traffic.
+    void set_compression(size_t min_bytes, int level) { codec_.configure(min_bytes, level); }
+    ValueCodec& codec() { return codec_; }
+
+    // --dict-min-bytes; before any traffic. Values from dict_min_bytes up
+    // are compressed with the current dictionary once one is trained.
+    // Dictionaries are read from storage when first needed, so values
+    // written with an older one still decode.
+    void set_dict_compression(size_t dict_min_bytes) {
+        codec_.configure_dict(dict_min_bytes, [this](uint32_t id, std::string& dict) {
+            return storage_.get(dict_key(std::to_string(id)), dict);
+        });
+        std::string current, dict;
+        if (dict_min_bytes && storage_.get(dict_key("current"), current) &&
+            storage_.get(dict_key(current), dict))
+            codec_.use_dict((uint32_t)strtoul(current.c_str(), NULL, 10), dict);
+    }
+
+    // Trains a dictionary of up to dict_bytes on a random sample of the
+    // stored values (reservoir over one pass of the table), stores it under
+    // the next id and uses it for new values. Existing rows keep theirs
+    // until rewritten. Returns the new id, 0 if there was nothing to learn.
+    uint32_t train_dict(size_t samples, size_t dict_bytes, std::string& report) {
+        if (read_only_) {
+            report = "read only\n";
+            return 0;
+        }
+        std::lock_guard<std::mutex> lock(train_mu_);
+        std::vector<std::string> sample;
+        std::mt19937_64 rng(std::random_device{}());
+        uint64_t seen = 0;
+        std::string from;
+        std::vector<std::pair<std::string, std::string>> page;
+        do {
+            page.clear();
+            storage_.scan(from, "", 1000, page);
+            for (auto& kv : page) {
+                if (is_dict_key(kv.first)) continue;
+                std::string value;
+                if (!codec_.decode(kv.second, value) || value.size() < 16 || value.size() >= 65536) continue;
+                if (sample.size() < samples) sample.push_back(std::move(value));
+                else if (uint64_t at = rng() % (seen + 1); at < samples) sample[at] = std::move(value);
+                seen++;
+            }
+            if (!page.empty()) from = page.back().first + '\0';
+        } while (page.size() == 1000);
+
+        std::string dict = DictTrainer::train(sample, dict_bytes);
+        if (dict.empty()) {
+            report = "no dictionary: " + std::to_string(seen) + " values, too few repeats\n";
+            return 0;
+        }
+        uint32_t id = codec_.dict_id() + 1;
+        std::string current;
+        if (storage_.get(dict_key("current"), current) && strtoul(current.c_str(), NULL, 10) >= id)
+            id = (uint32_t)strtoul(current.c_str(), NULL, 10) + 1;
+        if (!storage_.put(dict_key(std::to_string(id)), dict) ||
+            !storage_.put(dict_key("current"), std::to_string(id))) {
+            report = "storage write failed\n";
+            return 0;
+        }
+        codec_.use_dict(id, dict);
+        report = "dict id=" + std::to_string(id) + " bytes=" + std::to_string(dict.size()) + " samples=" +
+                 std::to_string(sample.size()) + " of " + std::to_string(seen) + " values\n";
+        return id;
+    }
+
+    // A plain set clears any expiry (like Redis SET). In write-back mode it
+    // is a coalesced set and the version is not known yet (0).
+    uint64_t set(const std::string& key, const std::string& value) {
+        if (read_only_) return 0;
+        clear_ttl(key);
+        std::string stored = codec_.encode(value);
+        if (write_back_ && coalescer_.set(key, stored)) {
+            dirty(key);
+            return 0;
+        }
+        return write_through(key, stored);
+    }
+
+    bool del(const std::string& key) {
+        if (read_only_) return false;
+        clear_ttl(key);
+        coalescer_.settle(key);
+        bool existed = storage_.remove(key);
+        cache_.erase(key);
+        if (existed) {
+            changed(key);
+            commit();
+        }
+        return existed;
+    }
+
+    bool incr(const std::string& key, long long delta, long long& result) {
+        if (read_only_) return false;
+        coalescer_.settle(key);
+        CounterCombiner::ReadLock counted = counters_.read_lock(key);
+        bool ok = storage_.incr(key, delta, result);
+        cache_.erase(key);
+        if (!ok) return false;
+        result += pending_counts(key, counted);
+        changed(key);
+        commit();
+        return true;
+    }
+
+    void incr_relaxed(const std::string& key, long long delta) {
+        if (read_only_) return;
+        counters_.add(key, delta);
+        dirty(key);
+    }
+
+    // Last writer wins within the coalescer's flush window: readers see the
+    // value now, storage gets it (or a later one) at the next flush. Lost if
+    // the process dies first.
+    // If the write-back journal can't be written the set goes to storage
+    // directly instead.
+    bool set_coalesced(const std::string& key, const std::string& value) {
+        if (read_only_) return false;
+        clear_ttl(key);
+        std::string stored = codec_.encode(value);
+        if (!coalescer_.set(key, stored)) return write_through(key, stored) != 0;
+        dirty(key);
+        return true;
+    }
+
+    // --write-back: every set() is a coalesced set, acknowledged once it is
+    // in the coalescer's journal. Set before any traffic.
+    void set_write_back(bool on) { write_back_ = on; }
+    bool write_back() const { return write_back_; }
+
+    bool cas(const std::string& key, uint64_t expected_version, const std::string& value, uint64_t& version) {
+        if (read_only_) {
+            version = 0;
+            return false;
+        }
+        coalescer_.settle(key);  // compare against the version the last set got
+        std::string stored = codec_.encode(value);
+        bool ok = storage_.cas(key, expected_version, stored, version);
+        if (!ok) return false;
+        cache_.put(key, stored, version);
+        changed(key);
+        commit();
+        return true;
+    }
+
+    // Delete `key` after `seconds` (<= 0 deletes now). False if missing.
+    bool expire(const std::string& key, long long seconds) {
+        if (read_only_) return false;
+        std::string v;
+        if (!get(key, v)) return false;
+        if (seconds <= 0) return del(key);
+        {
+            std::lock_guard<std::mutex> lock(ttl_mu_);
+            ttl_[key] = now_ms() + seconds * 1000;
+            has_ttl_ = true;
+        }
+        dirty(key);
+        return true;
+    }
+
+    // Seconds left, -1 if no expiry (Redis TTL without the -2 case).
+    long long ttl(const std::string& key) {
+        std::lock_guard<std::mutex> lock(ttl_mu_);
+        auto it = ttl_.find(key);
+        if (it == ttl_.end()) return -1;
+        long long left = it->second - now_ms();
+        return left <= 0 ? 0 : (left + 999) / 1000;
+    }
+
+    void scan(const std::string& start, const std::string& end, size_t limit,
+              std::vector<std::pair<std::string, std::string>>& out) {
+        size_t base = out.size();
+        std::string from_key = start;
+        while (true) {
+            // dictionary rows are skipped; fetch more to make up for them
+            size_t from = out.size(), want = limit - (from - base);
+            storage_.scan(from_key, end, want, out);
+            size_t got = out.size() - from, kept = from;
+            if (got) from_key = out.back().first + '\0';
+            for (size_t i = from; i < out.size(); ++i) {
+                if (is_dict_key(out[i].first)) continue;
+                codec_.decode_in_place(out[i].second);
+                if (kept != i) out[kept] = std::move(out[i]);
+                kept++;
+            }
+            out.resize(kept);
+            if (got < want || kept - from == got) break;
+        }
+    }
+
+    Storage& storage() { return storage_; }
+    LruCache& cache() { return cache_; }
+    CounterCombiner& counters() { return counters_; }
+    WriteCoalescer& coalescer() { return coalescer_; }
+
+    // Read latency by the tier that answered, flash and compression counters (/tiers).
+    std::string tier_status() {
+        std::string out = dram_latency_.line("dram") + flash_latency_.line("flash") + storage_latency_.line("storage");
+        if (cache_.flash()) out += cache_.flash()->status();
+        if (codec_.enabled())
+            out += "compress values=" + std::to_string(codec_.values()) + " gzip=" + std::to_string(codec_.gzipped()) +
+                   " dict=" + std::to_string(codec_.dict_coded()) + " dict_id=" + std::to_string(codec_.dict_id()) +
+                   " raw_bytes=" + std::to_string(codec_.raw_bytes()) +
+                   " stored_bytes=" + std::to_string(codec_.stored_bytes()) + "\n";
+        out += "cache bytes=" + std::to_string(cache_.bytes()) + "\n";
+        return out;
+    }
+
+private:
+    // The stored (encoded) value from the first tier that has it, or the
+    // pending coalesced set.
+    bool lookup(const std::string& key, ValueRef& value, uint64_t& ver) {
+        if (has_ttl_ && expired(key)) return false;
+        // before the cache: a flush updates the cache before the value stops
+        // being pending, so one of the two has it
+        std::string coalesced;
+        bool pending = coalescer_.pending(key, coalesced);
+        auto start = std::chrono::steady_clock::now();
+        bool found = cache_.get_ref(key, value, &ver);
+        if (found) {
+            dram_latency_.record(start);
+        } else {
+            uint64_t token = cache_.begin_fill(key);
+            found = cache_.get_flash(key, value, &ver, token);
+            if (found) {
+                flash_latency_.record(start);
+            } else {
+                std::string read;
+                found = storage_.get(key, read, &ver);
+                if (found) {
+                    value = std::make_shared<const std::string>(std::move(read));
+                    cache_.fill(key, value, ver, token);
+                }
+                storage_latency_.record(start);
+            }
+        }
+        // coalesced set not written yet: its value, with the version it replaces
+        if (pending) {
+            value = std::make_shared<const std::string>(std::move(coalesced));
+            found = true;
+        }
+        return found;
+    }
+
+    // Relaxed increments not flushed yet, as of the value read under
+    // `counted` (from counters_.read_lock(), taken before that read), which
+    // is released here.
+    long long pending_counts(const std::string& key, CounterCombiner::ReadLock& counted) {
+        if (!counted) return 0;
+        long long pending = counters_.pending(key);
+        counted.unlock();
+        return pending;
+    }
+
+    // `pending` added to the decoded value, if that is a counter (a missing
+    // key counts as 0). Deltas on anything else are refused at flush.
+    static bool add_pending_counts(std::string& value, bool found, long long pending) {
+        long long n = 0;
+        if (!pending || (found && !parse_counter(value, n)) || __builtin_add_overflow(n, pending, &n)) return found;
+        value = std::to_string(n);
+        return true;
+    }
+
+    static std::string dict_key(const std::string& name) { return std::string("\0kvdict:", 8) + name; }
+    static bool is_dict_key(const std::string& key) { return key.compare(0, 8, std::string("\0kvdict:", 8)) == 0; }
+
+    // `value` is already encoded.
+    uint64_t write_through(const std::string& key, const std::string& value) {
+        coalescer_.settle(key);
+        uint64_t ver = storage_.put(key, value);
+        if (ver) cache_.put(key, value, ver);
+        else cache_.erase(key);
+        changed(key);
+        commit();
+        return ver;
+    }
+
+    void changed(const std::string& key) {
+        for (auto& fn : listeners_) fn(key);
+    }
+
+    void dirty(const std::string& key) {
+        for (auto& fn : dirty_listeners_) fn(key);
+    }
+
+    static bool& commit_ok() {
+        thread_local bool ok = true;
+        return ok;
+    }
+
+    void commit() { commit_ok() = commit_ ? commit_() : true; }
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Deletes the key if its time is up.
+    bool expired(const std::string& key) {
+        {
+            std::lock_guard<std::mutex> lock(ttl_mu_);
+            auto it = ttl_.find(key);
+            if (it == ttl_.end() || it->second > now_ms()) return false;
+        }
+        del(key);
+        return true;
+    }
+
+    void clear_ttl(const std::string& key) {
+        if (!has_ttl_) return;
+        std::lock_guard<std::mutex> lock(ttl_mu_);
+        ttl_.erase(key);
+    }
+
+    void expire_due() {
+        std::vector<std::string> due;
+        {
+            std::lock_guard<std::mutex> lock(ttl_mu_);
+            int64_t now = now_ms();
+            for (auto& kv : ttl_) if (kv.second <= now) due.push_back(kv.first);
+        }
+        for (auto& key : due) expired(key);
+    }
+
+    Storage& storage_;
+    LruCache cache_;
+    CounterCombiner counters_;
+    WriteCoalescer coalescer_;
+    TierLatency dram_latency_, flash_latency_, storage_latency_;
+    ValueCodec codec_;
+    std::mutex train_mu_;
+    std::vector<Listener> listeners_, dirty_listeners_;
+    std::vector<ReadListener> read_listeners_;
+    std::vector<FlushListener> flush_listeners_;
+    CommitHook commit_;
+    std::atomic<bool> read_only_{false};
+    bool write_back_ = false;
+
+    std::mutex ttl_mu_;
+    std::unordered_map<std::string, int64_t> ttl_;  // key -> steady clock ms
+    std::atomic<bool> has_ttl_{false};
+
+    std::atomic<bool> janitor_running_{false};
+    std::thread janitor_;
+    std::mutex janitor_mu_;
+    std::condition_variable janitor_wake_;
+};
+
+#endif
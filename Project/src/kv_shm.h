@@ -0,0 +1,143 @@
+#ifndef KV_SHM_H
+#define KV_SHM_H
+
+/*
+ * Shared-memory hot cache published by the server (--shm-name) and read by
+ * local processes without any syscall. Plain C so C clients can include it:
+ *
+ *   kv_shm_reader r;
+ *   if (kv_shm_open(&r, "/kvcache") == 0) {
+ *       char buf[1024]; size_t len; uint64_t ver;
+ *       if (kv_shm_get(&r, "name", 4, buf, sizeof(buf), &len, &ver) == KV_SHM_FOUND) ...
+ *       kv_shm_close(&r);
+ *   }
+ *
+ * Layout: a header, then `slots` fixed-size slots (open addressing, a key
+ * lives in one of `probes` slots after hash & (slots - 1)). Every slot has
+ * its own seqlock: the writer makes seq odd, writes, then makes it even
+ * again; a reader retries when seq was odd or changed while it copied, so
+ * it never returns a torn value. The server is the only writer.
+ *
+ * A miss only means "not published": ask the server. When the server
+ * exits it sets `closed`; readers then get KV_SHM_CLOSED and should reopen.
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define KV_SHM_MAGIC "KVSHM001"
+
+#define KV_SHM_FOUND 1
+#define KV_SHM_MISS 0
+#define KV_SHM_TOO_SMALL -1 /* value bigger than the buffer, *len says how big */
+#define KV_SHM_CLOSED -2    /* the server is gone, reopen */
+
+typedef struct {
+    char magic[8];
+    uint32_t slots;     /* power of two */
+    uint32_t slot_size; /* bytes per slot, header included */
+    uint32_t key_max;
+    uint32_t value_max;
+    uint32_t probes;
+    uint32_t closed;
+    uint64_t writer_pid;
+    uint64_t reserved[3];
+} kv_shm_header;
+
+typedef struct {
+    uint64_t seq;     /* odd while the writer is inside */
+    uint64_t hash;    /* 0 = empty */
+    uint64_t version;
+    uint32_t klen;
+    uint32_t vlen;
+    /* key_max bytes of key, then value_max bytes of value */
+} kv_shm_slot;
+
+static inline uint64_t kv_shm_hash(const char* key, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+static inline size_t kv_shm_slot_size(uint32_t key_max, uint32_t value_max) {
+    return (sizeof(kv_shm_slot) + key_max + value_max + 7) & ~(size_t)7;
+}
+
+static inline kv_shm_slot* kv_shm_slot_at(kv_shm_header* h, uint32_t i) {
+    return (kv_shm_slot*)((char*)h + sizeof(kv_shm_header) + (size_t)i * h->slot_size);
+}
+
+/* ---------- reader ---------- */
+
+typedef struct {
+    kv_shm_header* base;
+    size_t size;
+} kv_shm_reader;
+
+static inline int kv_shm_open(kv_shm_reader* r, const char* name) {
+    r->base = NULL;
+    r->size = 0;
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return -1;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(kv_shm_header))
+        p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return -1;
+    kv_shm_header* h = (kv_shm_header*)p;
+    if (memcmp(h->magic, KV_SHM_MAGIC, 8) != 0 ||
+        sizeof(kv_shm_header) + (size_t)h->slots * h->slot_size > (size_t)st.st_size) {
+        munmap(p, (size_t)st.st_size);
+        return -1;
+    }
+    r->base = h;
+    r->size = (size_t)st.st_size;
+    return 0;
+}
+
+static inline void kv_shm_close(kv_shm_reader* r) {
+    if (r->base) munmap(r->base, r->size);
+    r->base = NULL;
+}
+
+/* Copies the value into buf. Returns KV_SHM_FOUND / MISS / TOO_SMALL / CLOSED. */
+static inline int kv_shm_get(const kv_shm_reader* r, const char* key, size_t klen,
+                             char* buf, size_t cap, size_t* len, uint64_t* version) {
+    kv_shm_header* h = r->base;
+    if (__atomic_load_n(&h->closed, __ATOMIC_ACQUIRE)) return KV_SHM_CLOSED;
+    if (klen > h->key_max) return KV_SHM_MISS;
+    uint64_t hash = kv_shm_hash(key, klen);
+    for (uint32_t p = 0; p < h->probes; ++p) {
+        kv_shm_slot* s = kv_shm_slot_at(h, (uint32_t)(hash + p) & (h->slots - 1));
+        const char* data = (const char*)(s + 1);
+        for (int tries = 0; tries < 1000; ++tries) {
+            uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1) continue;
+            int match = __atomic_load_n(&s->hash, __ATOMIC_RELAXED) == hash &&
+                        __atomic_load_n(&s->klen, __ATOMIC_RELAXED) == klen &&
+                        memcmp(data, key, klen) == 0;
+            uint32_t vlen = __atomic_load_n(&s->vlen, __ATOMIC_RELAXED);
+            uint64_t ver = __atomic_load_n(&s->version, __ATOMIC_RELAXED);
+            if (vlen > h->value_max) vlen = h->value_max; /* torn, retried below */
+            if (match && vlen <= cap) memcpy(buf, data + h->key_max, vlen);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq) continue;
+            if (!match) break;
+            *len = vlen;
+            if (version) *version = ver;
+            return vlen <= cap ? KV_SHM_FOUND : KV_SHM_TOO_SMALL;
+        }
+    }
+    return KV_SHM_MISS;
+}
+
+#endif
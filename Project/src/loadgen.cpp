@@ -0,0 +1,295 @@
+#include "kv_client.h"
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// LOAD GENERATOR
+//   ./loadgen --mode http --port 8080 --threads 8 --seconds 10
+//   ./loadgen --mode resp --port 6379 --threads 8 --seconds 10 --pipeline 32
+// Every thread keeps one connection and runs get/set on random keys.
+// http: all threads share one KvClient (kv_client.h) with --connections
+//       keep-alive connections; concurrent gets are batched into /mget.
+//       --unix-socket PATH (the server's socket) replaces TCP to a local
+//       host while PATH exists; by default it is TCP. --near-cache-mb N
+//       turns on the client near cache. --endpoints h:p,h:p spreads gets over
+//       several instances, --hedge 1 re-sends slow gets to a second one.
+// resp: writes --pipeline commands at once, then reads as many replies.
+// fastget: same, with raw "GET /get?key=" requests to the server's
+//       --fast-get-port (gets only).
+// --values json sets small JSON records (~150-350 bytes, same fields, varying
+// contents) instead of 32 x 'v', e.g. to measure --dict-min-bytes.
+
+struct Stats {
+    atomic<uint64_t> ops{0};
+    atomic<uint64_t> errors{0};
+    atomic<uint64_t> batch_us{0};  // sum of round trip times
+    atomic<uint64_t> batches{0};
+    mutex mu;
+    vector<uint32_t> samples_us;  // every round trip, for percentiles
+};
+
+// A user-profile-like record: what a dictionary learns is the field names
+// and the shape, the values differ from record to record.
+static string json_value(mt19937& rng) {
+    static const char* cities[] = {"Mumbai", "Pune", "Bengaluru", "Chennai", "Delhi", "Hyderabad", "Kolkata"};
+    static const char* plans[] = {"free", "basic", "premium", "enterprise"};
+    auto num = [&](int n) { return to_string(rng() % n); };
+    string id = num(100000000);
+    string v = "{\"id\":" + id + ",\"username\":\"user_" + id + "\",\"email\":\"user_" + id +
+               "@example.com\",\"city\":\"" + cities[rng() % 7] + "\",\"plan\":\"" + plans[rng() % 4] +
+               "\",\"created_at\":\"2024-" + num(12) + "-" + num(28) + "T" + num(24) + ":" + num(60) +
+               ":00Z\",\"verified\":" + (rng() % 2 ? "true" : "false") + ",\"score\":" + num(10000) +
+               ",\"tags\":[";
+    for (int i = 0, n = (int)(rng() % 5); i < n; ++i) v += (i ? ",\"tag" : "\"tag") + num(50) + "\"";
+    v += "],\"last_login_ip\":\"10." + num(256) + "." + num(256) + "." + num(256) + "\"}";
+    return v;
+}
+
+static int64_t now_us() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// user + system CPU in microseconds: our own, or another process' via /proc
+static int64_t cpu_us(int pid) {
+    if (pid <= 0) {
+        rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+    }
+    FILE* f = fopen(("/proc/" + to_string(pid) + "/stat").c_str(), "r");
+    if (!f) return 0;
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = 0;
+    // fields after the ")" that ends the command name: state is 3rd, utime 14th, stime 15th
+    const char* p = strrchr(buf, ')');
+    unsigned long long utime = 0, stime = 0;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) return 0;
+    return (int64_t)(utime + stime) * 1000000LL / sysconf(_SC_CLK_TCK);
+}
+
+static string resp_cmd(const vector<string>& args) {
+    string out = "*" + to_string(args.size()) + "\r\n";
+    for (auto& a : args) out += "$" + to_string(a.size()) + "\r\n" + a + "\r\n";
+    return out;
+}
+
+// Length of one complete HTTP response at pos (Content-Length body), 0 if
+// more bytes are needed.
+static size_t http_reply_len(const string& in, size_t pos) {
+    size_t end = in.find("\r\n\r\n", pos);
+    if (end == string::npos) return 0;
+    size_t cl = in.find("Content-Length: ", pos);
+    size_t body = cl < end ? strtoul(in.c_str() + cl + 16, NULL, 10) : 0;
+    return in.size() < end + 4 + body ? 0 : end + 4 + body - pos;
+}
+
+// Length of one complete RESP reply at pos, 0 if more bytes are needed.
+static size_t resp_reply_len(const string& in, size_t pos) {
+    size_t eol = in.find("\r\n", pos);
+    if (eol == string::npos) return 0;
+    char type = in[pos];
+    if (type == '$') {
+        long len = strtol(in.c_str() + pos + 1, NULL, 10);
+        if (len < 0) return eol + 2 - pos;
+        size_t end = eol + 2 + (size_t)len + 2;
+        return in.size() < end ? 0 : end - pos;
+    }
+    if (type == '*') {
+        long n = strtol(in.c_str() + pos + 1, NULL, 10);
+        size_t p = eol + 2;
+        for (long i = 0; i < n; ++i) {
+            size_t r = resp_reply_len(in, p);
+            if (r == 0) return 0;
+            p += r;
+        }
+        return p - pos;
+    }
+    return eol + 2 - pos;
+}
+
+static int connect_tcp(const string& host, int port) {
+    addrinfo hints{}, *res = NULL;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &res) != 0) return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+int main(int argc, char** argv) {
+    map<string, string> opts;
+    for (int i = 1; i + 1 < argc; i += 2) opts[argv[i]] = argv[i + 1];
+    auto opt = [&](const string& name, const string& def) {
+        auto it = opts.find(name);
+        return it == opts.end() ? def : it->second;
+    };
+
+    string mode = opt("--mode", "http");
+    string host = opt("--host", "127.0.0.1");
+    int port = stoi(opt("--port", mode == "resp" ? "6379" : mode == "fastget" ? "8082" : "8080"));
+    int threads = stoi(opt("--threads", "4"));
+    int seconds = stoi(opt("--seconds", "10"));
+    int pipeline = max(1, stoi(opt("--pipeline", "1")));
+    int keys = stoi(opt("--keys", "1000"));
+    double get_ratio = stod(opt("--get-ratio", "0.9"));
+    string unix_path = opt("--unix-socket", "");
+    int server_pid = stoi(opt("--server-pid", "0"));  // to report server CPU too
+    bool json = opt("--values", "fixed") == "json";
+
+    KvClient::Options copts;
+    copts.host = host;
+    copts.port = port;
+    copts.unix_socket = unix_path;
+    copts.connections = stoi(opt("--connections", "4"));
+    copts.near_cache_bytes = (size_t)stoul(opt("--near-cache-mb", "0")) << 20;
+    copts.hedge = opt("--hedge", "0") == "1";
+    string endpoints = opt("--endpoints", "");  // host:port,host:port
+    for (size_t pos = 0; pos < endpoints.size();) {
+        size_t comma = endpoints.find(',', pos);
+        if (comma == string::npos) comma = endpoints.size();
+        copts.endpoints.push_back(endpoints.substr(pos, comma - pos));
+        pos = comma + 1;
+    }
+    unique_ptr<KvClient> client;
+    if (mode == "http") client.reset(new KvClient(copts));
+
+    Stats stats;
+    atomic<bool> running(true);
+    vector<thread> workers;
+
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            mt19937 rng(t * 7919 + 1);
+            uniform_int_distribution<int> key_dist(0, keys - 1);
+            uniform_real_distribution<double> coin(0, 1);
+            string value(32, 'v');
+            vector<uint32_t> samples;
+            struct Merge {
+                Stats& stats;
+                vector<uint32_t>& samples;
+                ~Merge() {
+                    lock_guard<mutex> lock(stats.mu);
+                    stats.samples_us.insert(stats.samples_us.end(), samples.begin(), samples.end());
+                }
+            } merge{stats, samples};
+
+            if (mode == "http") {
+                while (running) {
+                    string key = "key" + to_string(key_dist(rng));
+                    if (json) value = json_value(rng);
+                    int64_t t0 = now_us();
+                    KvResult r = coin(rng) < get_ratio ? client->get(key) : client->set(key, value);
+                    samples.push_back((uint32_t)(now_us() - t0));
+                    stats.batch_us += now_us() - t0;
+                    stats.batches++;
+                    if (r.ok) stats.ops++;
+                    else stats.errors++;
+                }
+                return;
+            }
+
+            int fd = connect_tcp(host, port);
+            if (fd < 0) {
+                fprintf(stderr, "connect %s:%d failed\n", host.c_str(), port);
+                running = false;
+                return;
+            }
+            string in, out;
+            char buf[65536];
+            while (running) {
+                out.clear();
+                for (int i = 0; i < pipeline; ++i) {
+                    string key = "key" + to_string(key_dist(rng));
+                    if (mode == "fastget") {
+                        out += "GET /get?key=" + key + " HTTP/1.1\r\nHost: kv\r\n\r\n";
+                        continue;
+                    }
+                    if (json) value = json_value(rng);
+                    out += coin(rng) < get_ratio ? resp_cmd({"GET", key}) : resp_cmd({"SET", key, value});
+                }
+                int64_t t0 = now_us();
+                if (send(fd, out.data(), out.size(), MSG_NOSIGNAL) != (ssize_t)out.size()) break;
+                int replies = 0;
+                size_t pos = 0;
+                while (replies < pipeline) {
+                    size_t r = pos >= in.size() ? 0
+                               : mode == "fastget" ? http_reply_len(in, pos) : resp_reply_len(in, pos);
+                    if (r) {
+                        bool bad = mode == "fastget" ? in.compare(pos, 12, "HTTP/1.1 200") != 0 : in[pos] == '-';
+                        if (bad) stats.errors++;
+                        else stats.ops++;
+                        pos += r;
+                        replies++;
+                        continue;
+                    }
+                    in.erase(0, pos);
+                    pos = 0;
+                    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+                    if (n <= 0) { running = false; break; }
+                    in.append(buf, (size_t)n);
+                }
+                in.erase(0, pos);
+                samples.push_back((uint32_t)(now_us() - t0));
+                stats.batch_us += now_us() - t0;
+                stats.batches++;
+            }
+            close(fd);
+        });
+    }
+
+    int64_t start = now_us();
+    int64_t cpu0 = cpu_us(0), server_cpu0 = server_pid ? cpu_us(server_pid) : 0;
+    for (int s = 0; s < seconds && running; ++s) this_thread::sleep_for(chrono::seconds(1));
+    running = false;
+    for (auto& w : workers) w.join();
+    double elapsed = (now_us() - start) / 1e6;
+    int64_t cpu = cpu_us(0) - cpu0, server_cpu = server_pid ? cpu_us(server_pid) - server_cpu0 : 0;
+
+    uint64_t batches = stats.batches;
+    uint64_t ops = max<uint64_t>(1, stats.ops);
+    printf("mode=%s transport=%s threads=%d pipeline=%d seconds=%.1f\n", mode.c_str(),
+           client ? client->transport().c_str() : "tcp", threads, mode == "resp" ? pipeline : 1, elapsed);
+    printf("ops=%llu errors=%llu throughput=%.0f ops/sec avg_round_trip=%.1f us\n",
+           (unsigned long long)stats.ops, (unsigned long long)stats.errors, stats.ops / elapsed,
+           batches ? (double)stats.batch_us / batches : 0.0);
+    if (client && copts.near_cache_bytes) printf("near_cache_hits=%llu\n", (unsigned long long)client->near_hits());
+    vector<uint32_t>& lat = stats.samples_us;
+    if (!lat.empty()) {
+        sort(lat.begin(), lat.end());
+        auto pct = [&](double p) { return lat[min(lat.size() - 1, (size_t)(lat.size() * p))]; };
+        printf("round trip us: p50=%u p95=%u p99=%u p99.9=%u max=%u\n", pct(0.5), pct(0.95), pct(0.99), pct(0.999), lat.back());
+    }
+    if (client && copts.hedge) printf("hedged=%llu\n", (unsigned long long)client->hedged());
+    printf("client_cpu=%.2f us/op", (double)cpu / ops);
+    if (server_pid) printf(" server_cpu=%.2f us/op", (double)server_cpu / ops);
+    printf("\n");
+}
@@ -0,0 +1,216 @@
+#ifndef KV_LRU_CACHE_H
+#define KV_LRU_CACHE_H
+
+#include "flash_cache.h"
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Byte-bounded LRU cache of value + version, split into shards that each
+// have their own lock and an equal part of the capacity.
+//
+// Fills from storage race with writes (read old row, write lands, old row
+// gets cached). begin_fill() returns the shard's write sequence and fill()
+// drops the entry if any write hit the shard in between.
+//
+// Keys are placed by key_hash() (64-bit FNV-1a, the same in every process).
+//
+// With a FlashCache attached (attach_flash), evicted entries go down to it
+// and get_flash() moves a hit back up. Every write or invalidation here
+// also drops the flash copy, under the same shard lock as evictions, so
+// the two tiers never disagree about a key.
+//
+// Values are immutable refcounted buffers (ValueRef). get_ref() hands out
+// the cached buffer itself: no copy under the lock, and a response can keep
+// writing from it after the entry was evicted or overwritten.
+using ValueRef = std::shared_ptr<const std::string>;
+
+class LruCache {
+public:
+    explicit LruCache(size_t capacity_bytes, size_t shards = 16)
+        : shards_(shards), shard_capacity_(capacity_bytes / shards) {}
+
+    bool enabled() const { return shard_capacity_ > 0; }
+
+    // Before any traffic.
+    void attach_flash(FlashCache* flash) { flash_ = flash; }
+    FlashCache* flash() const { return flash_; }
+
+    bool get(const std::string& key, std::string& value, uint64_t* version = nullptr) {
+        ValueRef ref;
+        if (!get_ref(key, ref, version)) return false;
+        value = *ref;
+        return true;
+    }
+
+    bool get_ref(const std::string& key, ValueRef& value, uint64_t* version = nullptr) {
+        if (!enabled()) return false;
+        Shard& s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mu);
+        auto it = s.map.find(key);
+        if (it == s.map.end()) { misses_++; return false; }
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        value = it->second->value;
+        if (version) *version = it->second->version;
+        hits_++;
+        return true;
+    }
+
+    // Write path. Two writers can reach the cache in the opposite order to
+    // storage, so an older version never replaces a newer one.
+    void put(const std::string& key, const std::string& value, uint64_t version) {
+        if (!enabled()) return;
+        Shard& s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mu);
+        s.write_seq++;
+        auto it = s.map.find(key);
+        if (it != s.map.end() && it->second->version > version) return;
+        if (flash_) flash_->forget(key_hash(key));
+        insert(s, key, std::make_shared<const std::string>(value), version);
+    }
+
+    void erase(const std::string& key) {
+        if (!enabled()) return;
+        Shard& s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mu);
+        s.write_seq++;
+        auto it = s.map.find(key);
+        if (it != s.map.end()) remove(s, it->second);
+        if (flash_) flash_->forget(key_hash(key));
+    }
+
+    // Updates the entry only if the key is cached; for changes made outside
+    // this process. Writers behind our back may leave ver alone or reset it,
+    // so an entry that is not older is dropped, unless it is this very row
+    // (same version and bytes, e.g. our own write coming back).
+    void refresh(const std::string& key, const std::string& value, uint64_t version) {
+        if (!enabled()) return;
+        Shard& s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mu);
+        s.write_seq++;
+        if (flash_) flash_->forget(key_hash(key));
+        auto it = s.map.find(key);
+        if (it == s.map.end()) return;
+        if (it->second->version < version) insert(s, key, std::make_shared<const std::string>(value), version);
+        else if (it->second->version != version || *it->second->value != value) remove(s, it->second);
+    }
+
+    void clear() {
+        for (Shard& s : shards_) {
+            std::lock_guard<std::mutex> lock(s.mu);
+            s.write_seq++;
+            s.map.clear();
+            s.lru.clear();
+            s.bytes = 0;
+        }
+        if (flash_) flash_->clear();
+    }
+
+    uint64_t begin_fill(const std::string& key) {
+        if (!enabled()) return 0;
+        Shard& s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mu);
+        return s.write_seq;
+    }
+
+    // Read path: only caches if nothing was written to the shard since begin_fill().
+    void fill(const std::string& key, const std::string& value, uint64_t version, uint64_t token) {
+        fill(key, std::make_shared<const std::string>(value), version, token);
+    }
+
+    void fill(const std::string& key, ValueRef value, uint64_t version, uint64_t token) {
+        if (!enabled()) return;
+        Shard& s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mu);
+        if (s.write_seq != token) return;
+        insert(s, key, std::move(value), version);
+    }
+
+    // After a miss here: reads the flash tier and, if nothing was written to
+    // the shard since begin_fill(), moves the entry up (out of flash).
+    bool get_flash(const std::string& key, ValueRef& value, uint64_t* version, uint64_t token) {
+        if (!flash_ || !enabled()) return false;
+        uint64_t h = key_hash(key), ver = 0;
+        std::string read;
+        if (!flash_->get(key, h, read, ver)) return false;
+        value = std::make_shared<const std::string>(std::move(read));
+        if (version) *version = ver;
+        Shard& s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mu);
+        if (s.write_seq != token) return true;
+        flash_->forget(h);
+        insert(s, key, value, ver);
+        return true;
+    }
+
+    static uint64_t key_hash(const std::string& key) {
+        uint64_t h = 1469598103934665603ULL;
+        for (unsigned char c : key) { h ^= c; h *= 1099511628211ULL; }
+        return h;
+    }
+
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+
+    size_t bytes() {
+        size_t total = 0;
+        for (Shard& s : shards_) {
+            std::lock_guard<std::mutex> lock(s.mu);
+            total += s.bytes;
+        }
+        return total;
+    }
+
+private:
+    struct Node {
+        std::string key;
+        ValueRef value;
+        uint64_t version;
+        uint64_t hash;
+    };
+
+    struct Shard {
+        std::mutex mu;
+        std::list<Node> lru;  // front = most recent
+        std::unordered_map<std::string, std::list<Node>::iterator> map;
+        size_t bytes = 0;
+        uint64_t write_seq = 0;
+    };
+
+    static size_t cost(const Node& n) { return n.key.size() + n.value->size() + 64; }
+
+    Shard& shard(const std::string& key) { return shards_[key_hash(key) % shards_.size()]; }
+
+    void insert(Shard& s, const std::string& key, ValueRef value, uint64_t version) {
+        auto it = s.map.find(key);
+        if (it != s.map.end()) remove(s, it->second);
+        Node n{key, std::move(value), version, key_hash(key)};
+        if (cost(n) > shard_capacity_) return;
+        s.bytes += cost(n);
+        s.lru.push_front(std::move(n));
+        s.map[key] = s.lru.begin();
+        while (s.bytes > shard_capacity_) {
+            auto last = std::prev(s.lru.end());
+            if (flash_) flash_->admit(last->key, *last->value, last->version, last->hash);
+            remove(s, last);
+        }
+    }
+
+    void remove(Shard& s, std::list<Node>::iterator it) {
+        s.bytes -= cost(*it);
+        s.map.erase(it->key);
+        s.lru.erase(it);
+    }
+
+    std::vector<Shard> shards_;
+    size_t shard_capacity_;
+    FlashCache* flash_ = nullptr;
+    std::atomic<uint64_t> hits_{0}, misses_{0};
+};
+
+#endif
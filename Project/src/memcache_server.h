@@ -0,0 +1,330 @@
+#ifndef KV_MEMCACHE_SERVER_H
+#define KV_MEMCACHE_SERVER_H
+
+#include "event_loop.h"
+#include "kv_engine.h"
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// memcached protocol listener on top of KvEngine. Both the text protocol
+// (get/gets/set/add/replace/cas/delete/incr/decr/version/stats/quit) and the
+// binary protocol (first byte 0x80) are understood on the same port, and
+// every complete command already in the receive buffer is answered in one
+// go, so pipelined and multi-get clients need one round trip.
+//
+// Item flags and exptime are accepted but not stored (always 0 on reads).
+// On a read-only node (replica, raft follower) writes are refused with
+// SERVER_ERROR (binary: item not stored).
+class MemcacheServer {
+public:
+    explicit MemcacheServer(KvEngine& engine) : engine_(engine) {}
+    ~MemcacheServer() { stop(); }
+
+    // `threads` loops share the port through SO_REUSEPORT.
+    bool start(const std::string& host, int port, int threads) {
+        for (int i = 0; i < threads; ++i) {
+            std::unique_ptr<EventLoop> loop(new EventLoop());
+            loop->on_data([this](EventLoop::Conn& c) { on_data(c); });
+            if (!loop->listen_tcp(host, port, true)) return false;
+            loops_.push_back(std::move(loop));
+        }
+        for (auto& loop : loops_) {
+            EventLoop* l = loop.get();
+            threads_.emplace_back([l] { l->run(); });
+        }
+        return true;
+    }
+
+    void stop() {
+        for (auto& loop : loops_) loop->stop();
+        for (auto& t : threads_) t.join();
+        threads_.clear();
+        loops_.clear();
+    }
+
+private:
+    static const size_t kMaxKey = 250;
+    static const size_t kMaxLine = 8192;
+    static const int kReplaceTries = 8;
+
+    void on_data(EventLoop::Conn& c) {
+        size_t pos = 0;
+        while (pos < c.in.size() && !c.close_after_write) {
+            size_t used = (unsigned char)c.in[pos] == 0x80 ? binary_command(c, pos) : text_command(c, pos);
+            if (used == 0) break;  // incomplete command, wait for more bytes
+            pos += used;
+        }
+        c.in.erase(0, pos);
+    }
+
+    /* ---------- text protocol ---------- */
+
+    static std::vector<std::string> split(const std::string& line) {
+        std::vector<std::string> out;
+        size_t i = 0;
+        while (i < line.size()) {
+            while (i < line.size() && line[i] == ' ') i++;
+            size_t j = i;
+            while (j < line.size() && line[j] != ' ') j++;
+            if (j > i) out.push_back(line.substr(i, j - i));
+            i = j;
+        }
+        return out;
+    }
+
+    // Bytes consumed, 0 if the command is not complete yet.
+    size_t text_command(EventLoop::Conn& c, size_t pos) {
+        size_t eol = c.in.find("\r\n", pos);
+        if (eol == std::string::npos) {
+            if (c.in.size() - pos > kMaxLine) {
+                c.out += "CLIENT_ERROR line too long\r\n";
+                c.close_after_write = true;
+            }
+            return 0;
+        }
+        std::vector<std::string> t = split(c.in.substr(pos, eol - pos));
+        size_t used = eol + 2 - pos;
+        if (t.empty()) { c.out += "ERROR\r\n"; return used; }
+        const std::string& cmd = t[0];
+
+        if (cmd == "get" || cmd == "gets") {
+            for (size_t i = 1; i < t.size(); ++i) {
+                std::string value;
+                uint64_t ver = 0;
+                if (!engine_.get(t[i], value, &ver)) continue;
+                c.out += "VALUE " + t[i] + " 0 " + std::to_string(value.size());
+                if (cmd == "gets") c.out += " " + std::to_string(ver);
+                c.out += "\r\n";
+                c.out += value;
+                c.out += "\r\n";
+            }
+            c.out += "END\r\n";
+            return used;
+        }
+
+        if (cmd == "set" || cmd == "add" || cmd == "replace" || cmd == "cas") {
+            size_t need = cmd == "cas" ? 6 : 5;
+            if (t.size() < need || t[1].size() > kMaxKey) {
+                c.out += "CLIENT_ERROR bad command line format\r\n";
+                c.close_after_write = true;  // cannot tell where the data block ends
+                return used;
+            }
+            size_t bytes = strtoull(t[4].c_str(), NULL, 10);
+            if (c.in.size() < eol + 2 + bytes + 2) return 0;
+            std::string data = c.in.substr(eol + 2, bytes);
+            used += bytes + 2;
+            if (c.in.compare(eol + 2 + bytes, 2, "\r\n") != 0) {
+                c.out += "CLIENT_ERROR bad data chunk\r\n";
+                return used;
+            }
+            bool noreply = t.size() > need && t[need] == "noreply";
+            std::string reply = store(cmd, t[1], data, cmd == "cas" ? strtoull(t[5].c_str(), NULL, 10) : 0);
+            if (!noreply) c.out += reply;
+            return used;
+        }
+
+        if (cmd == "delete" && t.size() >= 2) {
+            std::string reply = engine_.read_only() ? "SERVER_ERROR read only\r\n"
+                              : engine_.del(t[1])   ? "DELETED\r\n"
+                                                    : "NOT_FOUND\r\n";
+            if (t.back() != "noreply") c.out += reply;
+            return used;
+        }
+
+        if ((cmd == "incr" || cmd == "decr") && t.size() >= 3) {
+            long long delta = (long long)strtoull(t[2].c_str(), NULL, 10);
+            long long result = 0;
+            int rc = incr(t[1], cmd == "incr" ? delta : -delta, false, 0, result);
+            std::string reply = rc == 0 ? std::to_string(result) + "\r\n"
+                              : rc == 1 ? "NOT_FOUND\r\n"
+                              : rc == 3 ? "SERVER_ERROR read only\r\n"
+                                        : "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n";
+            if (t.back() != "noreply") c.out += reply;
+            return used;
+        }
+
+        if (cmd == "version") { c.out += "VERSION 1.6.0-kv\r\n"; return used; }
+        if (cmd == "quit") { c.close_after_write = true; return used; }
+
+        if (cmd == "stats") {
+            c.out += "STAT get_hits " + std::to_string(engine_.cache().hits()) + "\r\n";
+            c.out += "STAT get_misses " + std::to_string(engine_.cache().misses()) + "\r\n";
+            c.out += "STAT bytes " + std::to_string(engine_.cache().bytes()) + "\r\n";
+            c.out += "END\r\n";
+            return used;
+        }
+
+        c.out += "ERROR\r\n";
+        return used;
+    }
+
+    std::string store(const std::string& cmd, const std::string& key, const std::string& data, uint64_t cas_unique) {
+        if (engine_.read_only()) return "SERVER_ERROR read only\r\n";
+        uint64_t ver = 0;
+        if (cmd == "set") {
+            // version 0 is also a write-back set, whose version comes later
+            if (engine_.set(key, data) || engine_.write_back()) return "STORED\r\n";
+            return "SERVER_ERROR write failed\r\n";
+        }
+        if (cmd == "add") return engine_.cas(key, 0, data, ver) ? "STORED\r\n" : "NOT_STORED\r\n";
+        if (cmd == "cas") {
+            if (engine_.cas(key, cas_unique, data, ver)) return "STORED\r\n";
+            return ver == 0 ? "NOT_FOUND\r\n" : "EXISTS\r\n";
+        }
+        // replace: only if present, retried a few times if someone else
+        // writes in between
+        for (int i = 0; i < kReplaceTries; ++i) {
+            std::string cur;
+            if (!engine_.get(key, cur, &ver) || ver == 0) return "NOT_STORED\r\n";
+            if (engine_.cas(key, ver, data, ver)) return "STORED\r\n";
+            if (ver == 0) return "NOT_STORED\r\n";  // deleted meanwhile, or the write failed
+        }
+        return "SERVER_ERROR too many concurrent writes\r\n";
+    }
+
+    // 0 ok, 1 not found, 2 not a number, 3 read only. Missing keys are
+    // created with `initial` when create is set (binary protocol), else
+    // NOT_FOUND.
+    int incr(const std::string& key, long long delta, bool create, long long initial, long long& result) {
+        if (engine_.read_only()) return 3;
+        std::string cur;
+        uint64_t ver = 0;
+        if (!engine_.get(key, cur, &ver)) {
+            if (!create) return 1;
+            if (engine_.cas(key, 0, std::to_string(initial), ver)) {
+                result = initial;
+                return 0;
+            }
+        }
+        return engine_.incr(key, delta, result) ? 0 : 2;
+    }
+
+    /* ---------- binary protocol ---------- */
+
+    enum Opcode {
+        GET = 0x00, SET = 0x01, ADD = 0x02, REPLACE = 0x03, DELETE = 0x04, INCREMENT = 0x05,
+        DECREMENT = 0x06, QUIT = 0x07, GETQ = 0x09, NOOP = 0x0a, VERSION = 0x0b, GETK = 0x0c,
+        GETKQ = 0x0d, SETQ = 0x11, ADDQ = 0x12, REPLACEQ = 0x13, DELETEQ = 0x14, INCREMENTQ = 0x15,
+        DECREMENTQ = 0x16, QUITQ = 0x17
+    };
+    enum Status { OK = 0, NOT_FOUND = 1, EXISTS = 2, NOT_STORED = 5, NON_NUMERIC = 6, UNKNOWN = 0x81 };
+
+    static uint64_t be(const std::string& s, size_t pos, int n) {
+        uint64_t v = 0;
+        for (int i = 0; i < n; ++i) v = (v << 8) | (unsigned char)s[pos + i];
+        return v;
+    }
+
+    static void put_be(std::string& out, uint64_t v, int n) {
+        for (int i = n - 1; i >= 0; --i) out += (char)((v >> (8 * i)) & 0xff);
+    }
+
+    static void bin_reply(EventLoop::Conn& c, uint8_t op, uint16_t status, uint32_t opaque, uint64_t cas,
+                          const std::string& extras, const std::string& key, const std::string& value) {
+        std::string& o = c.out;
+        o += (char)0x81;
+        o += (char)op;
+        put_be(o, key.size(), 2);
+        o += (char)extras.size();
+        o += (char)0;
+        put_be(o, status, 2);
+        put_be(o, extras.size() + key.size() + value.size(), 4);
+        put_be(o, opaque, 4);
+        put_be(o, cas, 8);
+        o += extras;
+        o += key;
+        o += value;
+    }
+
+    size_t binary_command(EventLoop::Conn& c, size_t pos) {
+        const std::string& in = c.in;
+        if (in.size() - pos < 24) return 0;
+        uint8_t op = (uint8_t)in[pos + 1];
+        size_t keylen = be(in, pos + 2, 2);
+        size_t extlen = (unsigned char)in[pos + 4];
+        size_t bodylen = be(in, pos + 8, 4);
+        uint32_t opaque = (uint32_t)be(in, pos + 12, 4);
+        uint64_t req_cas = be(in, pos + 16, 8);
+        if (in.size() - pos < 24 + bodylen) return 0;
+        size_t used = 24 + bodylen;
+        if (extlen + keylen > bodylen) {
+            bin_reply(c, op, UNKNOWN, opaque, 0, "", "", "Invalid arguments");
+            c.close_after_write = true;
+            return used;
+        }
+
+        std::string extras = in.substr(pos + 24, extlen);
+        std::string key = in.substr(pos + 24 + extlen, keylen);
+        std::string value = in.substr(pos + 24 + extlen + keylen, bodylen - extlen - keylen);
+        bool quiet = op == GETQ || op == GETKQ || (op >= SETQ && op <= QUITQ);
+        uint8_t base = op >= SETQ && op <= QUITQ ? (uint8_t)(op - 0x10) : op;
+
+        switch (base) {
+        case GET: case GETQ: case GETK: case GETKQ: {
+            std::string v;
+            uint64_t ver = 0;
+            bool with_key = base == GETK || base == GETKQ;
+            if (engine_.get(key, v, &ver)) bin_reply(c, op, OK, opaque, ver, std::string(4, '\0'), with_key ? key : "", v);
+            else if (!quiet) bin_reply(c, op, NOT_FOUND, opaque, 0, "", with_key ? key : "", "Not found");
+            break;
+        }
+        case SET: case ADD: case REPLACE: {
+            uint64_t ver = 0;
+            uint16_t st = OK;
+            if (engine_.read_only()) st = NOT_STORED;
+            else if (base == SET && req_cas == 0) {
+                ver = engine_.set(key, value);
+                if (!ver && !engine_.write_back()) st = NOT_STORED;
+            } else if (base == ADD) st = engine_.cas(key, 0, value, ver) ? OK : EXISTS;
+            else if (req_cas != 0) st = engine_.cas(key, req_cas, value, ver) ? OK : (ver == 0 ? NOT_FOUND : EXISTS);
+            else {
+                std::string r = store("replace", key, value, 0);
+                st = r == "STORED\r\n" ? OK : r == "NOT_STORED\r\n" ? NOT_FOUND : NOT_STORED;
+            }
+            if (st != OK || !quiet) bin_reply(c, op, st, opaque, st == OK ? ver : 0, "", "", "");
+            break;
+        }
+        case DELETE: {
+            uint16_t st = engine_.read_only() ? NOT_STORED : engine_.del(key) ? OK : NOT_FOUND;
+            if (st != OK || !quiet) bin_reply(c, op, st, opaque, 0, "", "", "");
+            break;
+        }
+        case INCREMENT: case DECREMENT: {
+            if (extras.size() < 20) { bin_reply(c, op, UNKNOWN, opaque, 0, "", "", "Invalid arguments"); break; }
+            long long delta = (long long)be(extras, 0, 8);
+            long long initial = (long long)be(extras, 8, 8);
+            bool create = be(extras, 16, 4) != 0xffffffffu;
+            long long result = 0;
+            int rc = incr(key, base == INCREMENT ? delta : -delta, create, initial, result);
+            if (rc != 0) bin_reply(c, op, rc == 1 ? NOT_FOUND : rc == 3 ? NOT_STORED : NON_NUMERIC, opaque, 0, "", "", "");
+            else if (!quiet) {
+                std::string body;
+                put_be(body, (uint64_t)result, 8);
+                bin_reply(c, op, OK, opaque, 0, "", "", body);
+            }
+            break;
+        }
+        case QUIT:
+            if (!quiet) bin_reply(c, op, OK, opaque, 0, "", "", "");
+            c.close_after_write = true;
+            break;
+        case NOOP:
+            bin_reply(c, op, OK, opaque, 0, "", "", "");
+            break;
+        case VERSION:
+            bin_reply(c, op, OK, opaque, 0, "", "", "1.6.0-kv");
+            break;
+        default:
+            bin_reply(c, op, UNKNOWN, opaque, 0, "", "", "Unknown command");
+        }
+        return used;
+    }
+
+    KvEngine& engine_;
+    std::vector<std::unique_ptr<EventLoop>> loops_;
+    std::vector<std::thread> threads_;
+};
+
+#endif
@@ -0,0 +1,549 @@
+#ifndef KV_MMAP_STORE_H
+#define KV_MMAP_STORE_H
+
+#include "storage.h"
+#include "ordered_index.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+
+// Persistent hash table living in two memory-mapped files:
+//   <path>      value heap: one header page, then append-only records
+//   <path>.idx  index: one header page, then open-addressing slots
+// Slots hold heap offsets, never pointers, so the files can be mapped at any
+// address. Opening a store is just open() + mmap(); nothing is read until a
+// lookup touches it, so restart time does not depend on the data size.
+//
+// Every put/delete appends a record first, then moves the heap tail, then
+// publishes the index slot. A slot is only trusted if it points below the
+// tail and the record checksum matches, so a torn write after a crash reads
+// as "missing" instead of garbage. checkpoint() syncs the heap before the
+// index. The heap is a complete log, so a lost index is rebuilt from it.
+// Dirty pages reach the disk in any order, though, so an index page can
+// outlive the record it points to; each slot therefore also keeps the key's
+// last record that a checkpoint had synced, and a lookup falls back to it
+// rather than losing the key.
+//
+// Range scans use an in-memory OrderedIndex of the keys, built on the first
+// scan so that plain get/set restarts stay instant.
+//
+// Replication (replication.h) ships the heap itself: a heap offset is a log
+// position, read_log() hands out whole records from one, and apply_log()
+// appends them on a follower at the same offset, so both heaps stay
+// byte-identical and a restarted follower resumes from its own tail.
+
+class MmapStore : public Storage {
+public:
+    MmapStore() {}
+    ~MmapStore() override { close(); }
+
+    bool open(const std::string& path, uint64_t buckets = 1 << 16, uint64_t heap_bytes = 64ull << 20) {
+        path_ = path;
+        idx_path_ = path + ".idx";
+
+        heap_fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+        if (heap_fd_ < 0) { perror("open heap"); return false; }
+        struct stat st;
+        fstat(heap_fd_, &st);
+        bool fresh = st.st_size == 0;
+        if (fresh) {
+            heap_bytes = round_up(heap_bytes < 2 * kPage ? 2 * kPage : heap_bytes, kPage);
+            if (ftruncate(heap_fd_, (off_t)heap_bytes) != 0) { perror("ftruncate heap"); return false; }
+            st.st_size = (off_t)heap_bytes;
+        }
+        heap_size_ = (uint64_t)st.st_size;
+        heap_ = (char*)mmap(NULL, heap_size_, PROT_READ | PROT_WRITE, MAP_SHARED, heap_fd_, 0);
+        if (heap_ == MAP_FAILED) { perror("mmap heap"); heap_ = NULL; return false; }
+
+        if (fresh) {
+            memcpy(hdr()->magic, kHeapMagic, 8);
+            hdr()->tail = kPage;
+            hdr()->checkpoints = 0;
+        } else if (memcmp(hdr()->magic, kHeapMagic, 8) != 0) {
+            fprintf(stderr, "%s is not a kv heap file\n", path_.c_str());
+            return false;
+        }
+        synced_tail_ = load(hdr()->tail);
+
+        if (!map_index(idx_path_)) {
+            if (!fresh) fprintf(stderr, "index missing or damaged, rebuilding from %s\n", path_.c_str());
+            if (!rebuild_index(buckets)) return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (heap_) { checkpoint(); munmap(heap_, heap_size_); heap_ = NULL; }
+        if (idx_) { munmap(idx_, idx_size_); idx_ = NULL; }
+        if (heap_fd_ >= 0) { ::close(heap_fd_); heap_fd_ = -1; }
+        if (idx_fd_ >= 0) { ::close(idx_fd_); idx_fd_ = -1; }
+    }
+
+    bool get(const std::string& key, std::string& value, uint64_t* version = nullptr) override {
+        std::shared_lock<std::shared_mutex> lock(mu_);
+        return lookup(key, value, version);
+    }
+
+    uint64_t put(const std::string& key, const std::string& value) override {
+        std::unique_lock<std::shared_mutex> lock(mu_);
+        return write(key, value);
+    }
+
+    bool remove(const std::string& key) override {
+        std::unique_lock<std::shared_mutex> lock(mu_);
+        uint64_t h = hash(key);
+        if (probe(key, h, NULL) < 0 || !append_and_publish(key, NULL, kDeleted, 0)) return false;
+        if (ordered_ready_) ordered_->erase(key);
+        return true;
+    }
+
+    // Read-modify-write under the exclusive lock.
+    bool incr(const std::string& key, long long delta, long long& result) override {
+        std::unique_lock<std::shared_mutex> lock(mu_);
+        std::string cur;
+        long long n = 0;
+        if (lookup(key, cur, NULL) && !parse_counter(cur, n)) return false;
+        if (__builtin_add_overflow(n, delta, &result)) return false;
+        return write(key, std::to_string(result)) != 0;
+    }
+
+    bool cas(const std::string& key, uint64_t expected_version, const std::string& value,
+             uint64_t& version) override {
+        std::unique_lock<std::shared_mutex> lock(mu_);
+        std::string cur;
+        version = 0;
+        lookup(key, cur, &version);
+        if (version != expected_version) return false;
+        version = write(key, value);
+        return version != 0;
+    }
+
+    void scan(const std::string& start, const std::string& end, size_t limit,
+              std::vector<std::pair<std::string, std::string>>& out) override {
+        build_ordered();
+        std::string from = start;
+        while (out.size() < limit) {
+            std::vector<std::string> keys;
+            ordered_->range(from, end, limit - out.size(), keys);
+            if (keys.empty()) break;
+            for (auto& k : keys) {
+                std::string v;
+                if (get(k, v)) out.emplace_back(k, std::move(v));  // skip keys deleted meanwhile
+            }
+            from = keys.back() + '\0';
+        }
+    }
+
+    // Flush dirty pages: heap (with its header) first, then the index, so a
+    // synced index never references unsynced heap bytes. Only the tail and
+    // the file descriptors are taken under the lock; the syncs run on dups
+    // of them, so writers (and remaps) go on while the disk catches up.
+    void checkpoint() {
+        uint64_t tail;
+        int heap_fd, idx_fd;
+        {
+            std::shared_lock<std::shared_mutex> lock(mu_);
+            if (!heap_ || !idx_) return;
+            tail = load(hdr()->tail);
+            heap_fd = dup(heap_fd_);
+            idx_fd = dup(idx_fd_);
+        }
+        bool ok = heap_fd >= 0 && idx_fd >= 0 && fdatasync(heap_fd) == 0;
+        if (ok) synced_tail_ = std::max(synced_tail_.load(), tail);
+        ok = ok && fdatasync(idx_fd) == 0;
+        if (heap_fd >= 0) ::close(heap_fd);
+        if (idx_fd >= 0) ::close(idx_fd);
+        if (!ok) { perror("checkpoint"); return; }
+
+        std::shared_lock<std::shared_mutex> lock(mu_);
+        if (!heap_) return;
+        __atomic_add_fetch(&hdr()->checkpoints, 1, __ATOMIC_RELEASE);
+        msync(heap_, kPage, MS_ASYNC);
+    }
+
+    uint64_t live_keys() {
+        std::shared_lock<std::shared_mutex> lock(mu_);
+        return idx_ ? ihdr()->live : 0;
+    }
+
+    uint64_t heap_used() {
+        std::shared_lock<std::shared_mutex> lock(mu_);
+        return heap_ ? load(hdr()->tail) : 0;
+    }
+
+    // Log position after the last record (the heap tail).
+    uint64_t log_end() { return heap_used(); }
+
+    // Copies whole records from `from` up to the tail, at most about
+    // max_bytes (but at least one record). False if `from` is past the tail.
+    bool read_log(uint64_t from, size_t max_bytes, std::string& out) {
+        std::shared_lock<std::shared_mutex> lock(mu_);
+        out.clear();
+        uint64_t tail = heap_ ? load(hdr()->tail) : 0;
+        if (from < kPage || from > tail) return false;
+        uint64_t end = from;
+        while (end + sizeof(Record) <= tail && (end == from || end - from < max_bytes))
+            end += rec_size(rec(end)->klen, rec(end)->vlen);
+        if (end > tail) end = tail;
+        out.assign(heap_ + from, end - from);
+        return true;
+    }
+
+    // Follower side: appends records read from the primary's log at `at`,
+    // which must be our tail. Keys touched go to `keys`. False if `at` does
+    // not match or a record is damaged; records before it stay applied.
+    bool apply_log(uint64_t at, const std::string& data, std::vector<std::string>& keys) {
+        std::unique_lock<std::shared_mutex> lock(mu_);
+        if (!heap_ || at != load(hdr()->tail)) return false;
+        size_t pos = 0;
+        while (pos + sizeof(Record) <= data.size()) {
+            Record r;
+            memcpy(&r, data.data() + pos, sizeof(r));
+            uint64_t size = rec_size(r.klen, r.vlen);
+            const char* k = data.data() + pos + sizeof(Record);
+            if (pos + size > data.size() || r.sum != rec_sum(k, r.klen, k + r.klen, r.vlen, r.ver)) return false;
+
+            uint64_t off = load(hdr()->tail);
+            if (off + size > heap_size_ && !grow_heap(off + size)) return false;
+            memcpy(heap_ + off, data.data() + pos, size);
+            store(hdr()->tail, off + size);
+            std::string key(k, r.klen);
+            index_record(key, off, r.vlen == kDeleted);
+            if (ordered_ready_) {
+                if (r.vlen == kDeleted) ordered_->erase(key);
+                else ordered_->insert(key);
+            }
+            keys.push_back(std::move(key));
+            pos += size;
+        }
+        return pos == data.size();
+    }
+
+private:
+    static constexpr uint64_t kPage = 4096;
+    static constexpr uint64_t kEmpty = 0;
+    static constexpr uint64_t kTombstone = 1;
+    static constexpr uint32_t kDeleted = 0xFFFFFFFFu;  // vlen of a delete record
+    static constexpr const char* kHeapMagic = "KVHEAP02";
+    static constexpr const char* kIdxMagic = "KVIDX002";
+
+    struct HeapHeader {
+        char magic[8];
+        uint64_t tail;         // first unused heap byte
+        uint64_t checkpoints;  // bumped after every completed msync
+    };
+    struct IndexHeader {
+        char magic[8];
+        uint64_t buckets;  // power of two
+        uint64_t used;     // live + tombstone slots
+        uint64_t live;
+    };
+    struct Slot {
+        uint64_t hash;
+        uint64_t off;     // heap offset of newest record, or kEmpty / kTombstone
+        uint64_t synced;  // an older record of the key already on disk, or kEmpty
+    };
+    struct Record {
+        uint32_t klen;
+        uint32_t vlen;  // kDeleted for a delete record
+        uint64_t ver;
+        uint64_t sum;   // checksum over the fields above, key and value
+    };
+
+    static uint64_t round_up(uint64_t n, uint64_t a) { return (n + a - 1) / a * a; }
+    static uint64_t load(const uint64_t& v) { return __atomic_load_n(&v, __ATOMIC_ACQUIRE); }
+    static void store(uint64_t& v, uint64_t x) { __atomic_store_n(&v, x, __ATOMIC_RELEASE); }
+
+    static uint64_t fnv(uint64_t h, const void* data, size_t n) {
+        const unsigned char* p = (const unsigned char*)data;
+        for (size_t i = 0; i < n; ++i) { h ^= p[i]; h *= 1099511628211ull; }
+        return h;
+    }
+    static uint64_t hash(const std::string& key) { return fnv(14695981039346656037ull, key.data(), key.size()); }
+
+    HeapHeader* hdr() const { return (HeapHeader*)heap_; }
+    IndexHeader* ihdr() const { return (IndexHeader*)idx_; }
+    Slot* slots() const { return (Slot*)(idx_ + kPage); }
+    const Record* rec(uint64_t off) const { return (const Record*)(heap_ + off); }
+    const char* rec_key(uint64_t off) const { return heap_ + off + sizeof(Record); }
+
+    static uint64_t rec_size(uint32_t klen, uint32_t vlen) {
+        return round_up(sizeof(Record) + klen + (vlen == kDeleted ? 0 : vlen), 8);
+    }
+    static uint64_t rec_sum(const char* key, uint32_t klen, const char* val, uint32_t vlen, uint64_t ver) {
+        uint64_t h = fnv(14695981039346656037ull, &klen, sizeof(klen));
+        h = fnv(h, &vlen, sizeof(vlen));
+        h = fnv(h, &ver, sizeof(ver));
+        h = fnv(h, key, klen);
+        if (vlen != kDeleted) h = fnv(h, val, vlen);
+        return h;
+    }
+
+    // Record header lies fully below the tail.
+    bool in_bounds(uint64_t off) const {
+        uint64_t tail = load(hdr()->tail);
+        if (off < kPage || off + sizeof(Record) > tail) return false;
+        const Record* r = rec(off);
+        return off + rec_size(r->klen, r->vlen) <= tail;
+    }
+
+    // Live value record that survived intact.
+    bool valid(uint64_t off) const {
+        if (!in_bounds(off)) return false;
+        const Record* r = rec(off);
+        if (r->vlen == kDeleted) return false;
+        const char* k = rec_key(off);
+        return r->sum == rec_sum(k, r->klen, k + r->klen, r->vlen, r->ver);
+    }
+
+    bool key_matches(uint64_t off, const std::string& key) const {
+        if (!in_bounds(off)) return false;
+        const Record* r = rec(off);
+        return r->klen == key.size() && memcmp(rec_key(off), key.data(), key.size()) == 0;
+    }
+
+    // Slot holding `key`, or -1. *insert_at gets the first reusable slot.
+    int64_t probe(const std::string& key, uint64_t h, int64_t* insert_at) const {
+        uint64_t n = ihdr()->buckets, mask = n - 1;
+        int64_t free_slot = -1;
+        for (uint64_t step = 0, i = h & mask; step < n; ++step, i = (i + 1) & mask) {
+            const Slot& s = slots()[i];
+            uint64_t off = load(s.off);
+            if (off == kEmpty) { if (free_slot < 0) free_slot = (int64_t)i; break; }
+            if (off == kTombstone) { if (free_slot < 0) free_slot = (int64_t)i; continue; }
+            if (s.hash == h && (key_matches(off, key) || key_matches(s.synced, key))) {
+                if (insert_at) *insert_at = free_slot;
+                return (int64_t)i;
+            }
+        }
+        if (insert_at) *insert_at = free_slot;
+        return -1;
+    }
+
+    bool grow_heap(uint64_t need) {
+        uint64_t size = heap_size_;
+        while (size < need) size *= 2;
+        if (ftruncate(heap_fd_, (off_t)size) != 0) { perror("ftruncate heap"); return false; }
+        void* p = mremap(heap_, heap_size_, size, MREMAP_MAYMOVE);
+        if (p == MAP_FAILED) { perror("mremap heap"); return false; }
+        heap_ = (char*)p;
+        heap_size_ = size;
+        return true;
+    }
+
+    bool lookup(const std::string& key, std::string& value, uint64_t* version) const {
+        int64_t i = probe(key, hash(key), NULL);
+        if (i < 0) return false;
+        const Slot& s = slots()[i];
+        uint64_t off = load(s.off);
+        if (!valid(off) || !key_matches(off, key)) off = s.synced;  // newest record lost in a crash
+        if (!valid(off)) return false;
+        const Record* r = rec(off);
+        value.assign(rec_key(off) + r->klen, r->vlen);
+        if (version) *version = r->ver;
+        return true;
+    }
+
+    // Caller holds the exclusive lock. 0 if the record could not be stored.
+    uint64_t write(const std::string& key, const std::string& value) {
+        std::string old;
+        uint64_t ver = 0;
+        lookup(key, old, &ver);
+        if (!append_and_publish(key, value.data(), (uint32_t)value.size(), ++ver)) return 0;
+        if (ordered_ready_) ordered_->insert(key);
+        return ver;
+    }
+
+    // Room in the heap and the index is made before anything is written, so
+    // a failed grow leaves the store as it was.
+    bool append_and_publish(const std::string& key, const char* val, uint32_t vlen, uint64_t ver) {
+        uint32_t klen = (uint32_t)key.size();
+        uint64_t off = load(hdr()->tail);
+        uint64_t size = rec_size(klen, vlen);
+        if (off + size > heap_size_ && !grow_heap(off + size)) return false;
+        if (vlen != kDeleted && (ihdr()->used + 1) * 10 > ihdr()->buckets * 7 &&
+            probe(key, hash(key), NULL) < 0 && !resize_index(ihdr()->buckets)) return false;
+
+        // 1. record bytes
+        Record* r = (Record*)(heap_ + off);
+        r->klen = klen;
+        r->vlen = vlen;
+        r->ver = ver;
+        memcpy(heap_ + off + sizeof(Record), key.data(), klen);
+        if (vlen != kDeleted) memcpy(heap_ + off + sizeof(Record) + klen, val, vlen);
+        r->sum = rec_sum(key.data(), klen, val, vlen, ver);
+        // 2. heap tail
+        store(hdr()->tail, off + size);
+        // 3. index slot
+        index_record(key, off, vlen == kDeleted);
+        return true;
+    }
+
+    void index_record(const std::string& key, uint64_t off, bool deleted) {
+        uint64_t h = hash(key);
+        int64_t insert_at = -1;
+        int64_t i = probe(key, h, &insert_at);
+        if (deleted) {
+            if (i >= 0) { store(slots()[i].off, kTombstone); slots()[i].synced = kEmpty; ihdr()->live--; }
+            return;
+        }
+        if (i >= 0) {
+            Slot& s = slots()[i];
+            uint64_t old = load(s.off);
+            if (old < synced_tail_ && valid(old) && key_matches(old, key)) s.synced = old;
+            store(s.off, off);
+            return;
+        }
+
+        if ((ihdr()->used + 1) * 10 > ihdr()->buckets * 7) {
+            if (!resize_index(ihdr()->buckets)) return;
+            probe(key, h, &insert_at);
+        }
+        Slot& s = slots()[insert_at];
+        if (load(s.off) == kEmpty) ihdr()->used++;
+        s.hash = h;
+        s.synced = kEmpty;
+        store(s.off, off);
+        ihdr()->live++;
+    }
+
+    void build_ordered() {
+        if (ordered_ready_) return;
+        std::unique_lock<std::shared_mutex> lock(mu_);
+        if (ordered_ready_) return;
+        ordered_.reset(new OrderedIndex());
+        for (uint64_t i = 0; i < ihdr()->buckets; ++i) {
+            const Slot& s = slots()[i];
+            if (s.off <= kTombstone) continue;
+            uint64_t off = valid(s.off) && hash(std::string(rec_key(s.off), rec(s.off)->klen)) == s.hash ? s.off : s.synced;
+            if (valid(off)) ordered_->insert(std::string(rec_key(off), rec(off)->klen));
+        }
+        ordered_ready_ = true;
+    }
+
+    bool map_index(const std::string& p) {
+        idx_fd_ = ::open(p.c_str(), O_RDWR);
+        if (idx_fd_ < 0) return false;
+        struct stat st;
+        fstat(idx_fd_, &st);
+        if ((uint64_t)st.st_size < kPage) return false;
+        idx_size_ = (uint64_t)st.st_size;
+        idx_ = (char*)mmap(NULL, idx_size_, PROT_READ | PROT_WRITE, MAP_SHARED, idx_fd_, 0);
+        if (idx_ == MAP_FAILED) { idx_ = NULL; return false; }
+        IndexHeader* ih = ihdr();
+        if (memcmp(ih->magic, kIdxMagic, 8) != 0 || kPage + ih->buckets * sizeof(Slot) != idx_size_) {
+            munmap(idx_, idx_size_);
+            idx_ = NULL;
+            ::close(idx_fd_);
+            idx_fd_ = -1;
+            return false;
+        }
+        return true;
+    }
+
+    // Build a fresh index file next to the old one and rename() it into
+    // place, so a crash mid-resize leaves the old index untouched.
+    bool create_index(uint64_t buckets, int& fd, char*& base, uint64_t& size) {
+        std::string tmp = idx_path_ + ".tmp";
+        fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) { perror("open index"); return false; }
+        size = kPage + buckets * sizeof(Slot);
+        if (ftruncate(fd, (off_t)size) != 0) { perror("ftruncate index"); ::close(fd); return false; }
+        base = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) { perror("mmap index"); ::close(fd); return false; }
+        IndexHeader* ih = (IndexHeader*)base;
+        memcpy(ih->magic, kIdxMagic, 8);
+        ih->buckets = buckets;
+        ih->used = ih->live = 0;
+        return true;
+    }
+
+    bool install_index(int fd, char* base, uint64_t size) {
+        msync(base, size, MS_SYNC);
+        if (rename((idx_path_ + ".tmp").c_str(), idx_path_.c_str()) != 0) {
+            perror("rename index");
+            munmap(base, size);
+            ::close(fd);
+            return false;
+        }
+        if (idx_) munmap(idx_, idx_size_);
+        if (idx_fd_ >= 0) ::close(idx_fd_);
+        idx_ = base;
+        idx_fd_ = fd;
+        idx_size_ = size;
+        return true;
+    }
+
+    static void raw_insert(char* base, uint64_t h, uint64_t off, uint64_t synced) {
+        IndexHeader* ih = (IndexHeader*)base;
+        Slot* s = (Slot*)(base + kPage);
+        uint64_t mask = ih->buckets - 1;
+        uint64_t i = h & mask;
+        while (s[i].off != kEmpty) i = (i + 1) & mask;
+        s[i].hash = h;
+        s[i].off = off;
+        s[i].synced = synced;
+        ih->used++;
+        ih->live++;
+    }
+
+    bool resize_index(uint64_t buckets) {
+        uint64_t live = ihdr()->live;
+        while ((live + 1) * 2 > buckets) buckets *= 2;
+
+        int fd; char* base; uint64_t size;
+        if (!create_index(buckets, fd, base, size)) return false;
+        for (uint64_t i = 0; i < ihdr()->buckets; ++i) {
+            const Slot& s = slots()[i];
+            if (s.off > kTombstone) raw_insert(base, s.hash, s.off, s.synced);
+        }
+        return install_index(fd, base, size);
+    }
+
+    // Replay the heap log: later records win, delete records drop the key.
+    bool rebuild_index(uint64_t buckets) {
+        uint64_t b = 16;
+        while (b < buckets) b *= 2;
+
+        int fd; char* base; uint64_t size;
+        if (!create_index(b, fd, base, size)) return false;
+        if (!install_index(fd, base, size)) return false;
+
+        uint64_t tail = load(hdr()->tail);
+        for (uint64_t off = kPage; off + sizeof(Record) <= tail;) {
+            const Record* r = rec(off);
+            uint64_t next = off + rec_size(r->klen, r->vlen);
+            const char* k = rec_key(off);
+            if (next > tail || r->sum != rec_sum(k, r->klen, k + r->klen, r->vlen, r->ver)) {
+                store(hdr()->tail, off);  // torn tail record, drop it
+                break;
+            }
+            index_record(std::string(k, r->klen), off, r->vlen == kDeleted);
+            off = next;
+        }
+        return true;
+    }
+
+    std::string path_, idx_path_;
+    int heap_fd_ = -1, idx_fd_ = -1;
+    char* heap_ = NULL;
+    char* idx_ = NULL;
+    uint64_t heap_size_ = 0, idx_size_ = 0;
+    std::atomic<uint64_t> synced_tail_{0};  // heap bytes below this are on disk
+    std::shared_mutex mu_;  // shared for lookups, exclusive for appends and remaps
+    std::unique_ptr<OrderedIndex> ordered_;
+    std::atomic<bool> ordered_ready_{false};
+};
+
+#endif
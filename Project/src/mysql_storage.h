@@ -0,0 +1,163 @@
+#ifndef KV_MYSQL_STORAGE_H
+#define KV_MYSQL_STORAGE_H
+
+#include "storage.h"
+#include <mysql/mysql.h>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+
+// kv_store table in MySQL. One connection is shared by every httplib worker
+// thread, so each query runs under the lock.
+class MysqlStorage : public Storage {
+public:
+    explicit MysqlStorage(MYSQL* conn) : conn_(conn) {}
+
+    bool get(const std::string& key, std::string& value, uint64_t* version = nullptr) override {
+        std::lock_guard<std::mutex> lock(mu_);
+        return select(key, value, version);
+    }
+
+    uint64_t put(const std::string& key, const std::string& value) override {
+        std::lock_guard<std::mutex> lock(mu_);
+        return upsert(key, value);
+    }
+
+    // One transaction, so one commit (redo log flush) for the whole batch;
+    // all or nothing.
+    void put_batch(const std::vector<std::pair<std::string, std::string>>& items,
+                   std::vector<uint64_t>& versions) override {
+        std::lock_guard<std::mutex> lock(mu_);
+        versions.assign(items.size(), 0);
+        if (mysql_query(conn_, "START TRANSACTION") != 0) return;
+        for (size_t i = 0; i < items.size(); ++i) {
+            versions[i] = upsert(items[i].first, items[i].second);
+            if (versions[i]) continue;
+            mysql_query(conn_, "ROLLBACK");
+            versions.assign(items.size(), 0);
+            return;
+        }
+        if (mysql_query(conn_, "COMMIT") != 0) versions.assign(items.size(), 0);
+    }
+
+    bool remove(const std::string& key) override {
+        std::lock_guard<std::mutex> lock(mu_);
+        std::string query = "DELETE FROM kv_store WHERE k='" + escape(key) + "'";
+        if (mysql_query(conn_, query.c_str()) != 0) return false;
+        return mysql_affected_rows(conn_) > 0;
+    }
+
+    // The addition happens inside an UPDATE that only matches integer values,
+    // and the new value is read back in the same transaction (the row stays
+    // locked until COMMIT). No match means the key is missing (insert delta)
+    // or holds something else, which is left alone: CAST would read it as 0
+    // and overwrite it.
+    bool incr(const std::string& key, long long delta, long long& result) override {
+        std::lock_guard<std::mutex> lock(mu_);
+        std::string k = escape(key), d = std::to_string(delta);
+        std::string update = "UPDATE kv_store SET v=CAST(v AS SIGNED)+" + d + ", ver=ver+1"
+                             " WHERE k='" + k + "' AND CAST(v AS CHAR) REGEXP '^-?[0-9]+$'";
+        std::string insert = "INSERT IGNORE INTO kv_store (k, v, ver) VALUES('" + k + "','" + d + "',1)";
+        for (int attempt = 0; attempt < 2; ++attempt) {  // another server may insert in between
+            if (mysql_query(conn_, "START TRANSACTION") != 0) return false;
+            if (mysql_query(conn_, update.c_str()) != 0) {
+                mysql_query(conn_, "ROLLBACK");
+                return false;  // also BIGINT overflow
+            }
+            if (mysql_affected_rows(conn_) == 1) {
+                std::string value;
+                if (!select(key, value, NULL) || !parse_counter(value, result) || mysql_query(conn_, "COMMIT") != 0) {
+                    mysql_query(conn_, "ROLLBACK");
+                    return false;
+                }
+                return true;
+            }
+            mysql_query(conn_, "ROLLBACK");
+            if (mysql_query(conn_, insert.c_str()) != 0) return false;
+            if (mysql_affected_rows(conn_) == 1) {
+                result = delta;
+                return true;
+            }
+        }
+        return false;  // not an integer
+    }
+
+    bool cas(const std::string& key, uint64_t expected_version, const std::string& value,
+             uint64_t& version) override {
+        std::lock_guard<std::mutex> lock(mu_);
+        std::string query;
+        if (expected_version == 0) {
+            query = "INSERT IGNORE INTO kv_store (k, v, ver) VALUES('" + escape(key) + "','" + escape(value) + "',1)";
+        } else {
+            query = "UPDATE kv_store SET v='" + escape(value) + "', ver=ver+1 WHERE k='" + escape(key) +
+                    "' AND ver=" + std::to_string(expected_version);
+        }
+        if (mysql_query(conn_, query.c_str()) == 0 && mysql_affected_rows(conn_) == 1) {
+            version = expected_version + 1;
+            return true;
+        }
+        std::string current;
+        version = 0;
+        select(key, current, &version);
+        return false;
+    }
+
+    // Keyset pagination on the primary key, never OFFSET.
+    void scan(const std::string& start, const std::string& end, size_t limit,
+              std::vector<std::pair<std::string, std::string>>& out) override {
+        std::lock_guard<std::mutex> lock(mu_);
+        std::string query = "SELECT k, v FROM kv_store WHERE k >= '" + escape(start) + "'";
+        if (!end.empty()) query += " AND k < '" + escape(end) + "'";
+        query += " ORDER BY k LIMIT " + std::to_string(limit);
+        if (mysql_query(conn_, query.c_str()) != 0) return;
+
+        MYSQL_RES* result = mysql_store_result(conn_);
+        if (!result) return;
+        while (MYSQL_ROW row = mysql_fetch_row(result)) {
+            unsigned long* lens = mysql_fetch_lengths(result);
+            out.emplace_back(std::string(row[0], lens[0]), std::string(row[1] ? row[1] : "", lens[1]));
+        }
+        mysql_free_result(result);
+    }
+
+private:
+    // LAST_INSERT_ID(expr) hands the bumped version back through
+    // mysql_insert_id(), so no second SELECT is needed. One affected row
+    // means a fresh insert (version 1), two means an update.
+    uint64_t upsert(const std::string& key, const std::string& value) {
+        std::string query = "INSERT INTO kv_store (k, v, ver) VALUES('" + escape(key) + "','" + escape(value) + "',1)"
+                            " ON DUPLICATE KEY UPDATE v=VALUES(v), ver=LAST_INSERT_ID(ver+1)";
+        if (mysql_query(conn_, query.c_str()) != 0) return 0;
+        return mysql_affected_rows(conn_) == 1 ? 1 : (uint64_t)mysql_insert_id(conn_);
+    }
+
+    bool select(const std::string& key, std::string& value, uint64_t* version) {
+        std::string query = "SELECT v, ver FROM kv_store WHERE k='" + escape(key) + "'";
+        if (mysql_query(conn_, query.c_str()) != 0) return false;
+
+        MYSQL_RES* result = mysql_store_result(conn_);
+        if (!result) return false;
+        MYSQL_ROW row = mysql_fetch_row(result);
+        bool found = false;
+        if (row && row[0]) {
+            unsigned long* lens = mysql_fetch_lengths(result);
+            value.assign(row[0], lens[0]);
+            if (version) *version = row[1] ? strtoull(row[1], NULL, 10) : 1;
+            found = true;
+        }
+        mysql_free_result(result);
+        return found;
+    }
+
+    std::string escape(const std::string& s) {
+        std::string out(s.size() * 2 + 1, '\0');
+        unsigned long n = mysql_real_escape_string(conn_, &out[0], s.data(), s.size());
+        out.resize(n);
+        return out;
+    }
+
+    MYSQL* conn_;
+    std::mutex mu_;
+};
+
+#endif
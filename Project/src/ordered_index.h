@@ -0,0 +1,119 @@
+#ifndef KV_ORDERED_INDEX_H
+#define KV_ORDERED_INDEX_H
+
+#include <cstdlib>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+// Skiplist of keys kept in byte order, for range scans over a hash-based
+// store. Lookups and scans share the lock, inserts and erases take it
+// exclusively.
+class OrderedIndex {
+public:
+    OrderedIndex() : head_(new Node(std::string(), kMaxLevel)), level_(1), size_(0), seed_(0x2545F491u) {}
+
+    ~OrderedIndex() {
+        Node* n = head_;
+        while (n) {
+            Node* next = n->next[0];
+            delete n;
+            n = next;
+        }
+    }
+
+    OrderedIndex(const OrderedIndex&) = delete;
+    OrderedIndex& operator=(const OrderedIndex&) = delete;
+
+    // Returns false if the key was already present.
+    bool insert(const std::string& key) {
+        std::unique_lock<std::shared_mutex> lock(mu_);
+        Node* update[kMaxLevel];
+        Node* x = find_ge(key, update);
+        if (x && x->key == key) return false;
+
+        int lvl = random_level();
+        if (lvl > level_) {
+            for (int i = level_; i < lvl; ++i) update[i] = head_;
+            level_ = lvl;
+        }
+        Node* n = new Node(key, lvl);
+        for (int i = 0; i < lvl; ++i) {
+            n->next[i] = update[i]->next[i];
+            update[i]->next[i] = n;
+        }
+        size_++;
+        return true;
+    }
+
+    bool erase(const std::string& key) {
+        std::unique_lock<std::shared_mutex> lock(mu_);
+        Node* update[kMaxLevel];
+        Node* x = find_ge(key, update);
+        if (!x || x->key != key) return false;
+        for (int i = 0; i < level_; ++i) {
+            if (update[i]->next[i] != x) break;
+            update[i]->next[i] = x->next[i];
+        }
+        delete x;
+        while (level_ > 1 && head_->next[level_ - 1] == nullptr) level_--;
+        size_--;
+        return true;
+    }
+
+    // Up to `limit` keys with start <= key < end (empty end = no bound).
+    void range(const std::string& start, const std::string& end, size_t limit, std::vector<std::string>& out) const {
+        std::shared_lock<std::shared_mutex> lock(mu_);
+        Node* x = find_ge(start, nullptr);
+        for (; x && out.size() < limit; x = x->next[0]) {
+            if (!end.empty() && x->key >= end) break;
+            out.push_back(x->key);
+        }
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mu_);
+        return size_;
+    }
+
+private:
+    static const int kMaxLevel = 24;
+
+    struct Node {
+        Node(const std::string& k, int lvl) : key(k), next(lvl, nullptr) {}
+        std::string key;
+        std::vector<Node*> next;
+    };
+
+    // First node with key >= `key`; fills the predecessor at every level.
+    Node* find_ge(const std::string& key, Node** update) const {
+        Node* x = head_;
+        for (int i = level_ - 1; i >= 0; --i) {
+            while (x->next[i] && x->next[i]->key < key) x = x->next[i];
+            if (update) update[i] = x;
+        }
+        return x->next[0];
+    }
+
+    // p = 1/4 per level (xorshift, only called under the exclusive lock).
+    int random_level() {
+        int lvl = 1;
+        for (;;) {
+            seed_ ^= seed_ << 13;
+            seed_ ^= seed_ >> 17;
+            seed_ ^= seed_ << 5;
+            if ((seed_ & 3) != 0 || lvl >= kMaxLevel) break;
+            lvl++;
+        }
+        return lvl;
+    }
+
+    Node* head_;
+    int level_;
+    size_t size_;
+    unsigned seed_;
+    mutable std::shared_mutex mu_;
+};
+
+#endif
@@ -0,0 +1,1183 @@
+#ifndef KV_RAFT_H
+#define KV_RAFT_H
+
+#include "storage.h"
+#include "event_loop.h"
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Raft-replicated storage (--storage raft). 3 or 5 server processes, each
+// with its own --raft-id and the same --raft-peers list, form one group;
+// they can all run on one machine with different ports and directories.
+//
+// The state machine is an in-memory ordered map of key -> value + version.
+// Every write (put, remove, incr, cas) becomes a log entry on the leader;
+// put() etc. return once the entry is committed by a majority and applied.
+// Followers refuse writes (the engine is switched to read only).
+//
+//   log        <dir>/raft.log   entries, fsync'ed before they count
+//   state      <dir>/raft.meta  current term and vote
+//   snapshot   <dir>/raft.snap  the whole map at some applied index; every
+//              snapshot_entries applied entries a new one is written and the
+//              log before it is dropped (compaction). A follower that is
+//              too far behind gets the snapshot instead of the entries, in
+//              kSnapChunk pieces (offset, done) that it puts together
+//              before installing, so no frame gets near EventLoop::kInMax.
+//
+// Writes are group committed: entries proposed while the previous fsync
+// ran share the next one, AppendEntries carry up to max_batch entries, and
+// up to `pipeline` of them are in flight per follower (next_index moves
+// ahead optimistically; a rejection moves it back).
+//
+// Reads are served by the leader from its own map while it holds a lease:
+// a majority acknowledged its AppendEntries within the last
+// 0.9 * election_ms, and followers never vote while they have heard from a
+// leader within election_ms, so no other leader can exist before the lease
+// ends. Without a lease the read waits for the next heartbeat round. There
+// is no log round trip for reads.
+//
+// Peers talk over a small binary protocol (4-byte length + body, host byte
+// order, so all nodes must have the same endianness).
+class RaftStore : public Storage {
+public:
+    struct Options {
+        int id = 1;                      // 1-based position in peers
+        std::vector<std::string> peers;  // raft host:port of every node, same order everywhere
+        std::string dir = "raft1";
+        std::string advertise;           // this node's HTTP host:port, passed on as the leader hint
+        int election_ms = 300;           // timeout is random in [election_ms, 2 * election_ms)
+        int heartbeat_ms = 50;
+        size_t max_batch = 64;           // entries per AppendEntries
+        int pipeline = 4;                // AppendEntries in flight per follower
+        uint64_t snapshot_entries = 10000;
+        int propose_timeout_ms = 2000;
+    };
+
+    using ApplyListener = std::function<void(const std::string& key)>;
+    using RoleListener = std::function<void(bool leader)>;
+
+    explicit RaftStore(const Options& opts) : opts_(opts) {
+        for (size_t i = 0; i < opts_.peers.size(); ++i) {
+            if ((int)i + 1 == opts_.id) continue;
+            std::unique_ptr<Peer> p(new Peer());
+            p->id = (int)i + 1;
+            split_address(opts_.peers[i], p->host, p->port);
+            p->wake_fd = eventfd(0, EFD_NONBLOCK);
+            peers_.push_back(std::move(p));
+        }
+        loop_.on_data([this](EventLoop::Conn& c) { on_data(c); });
+    }
+
+    ~RaftStore() override { stop(); }
+
+    // Loads meta, snapshot and log from dir and starts listening.
+    bool start() {
+        mkdir(opts_.dir.c_str(), 0755);
+        if (!load()) return false;
+        std::string host;
+        int port = 0;
+        split_address(opts_.peers[opts_.id - 1], host, port);
+        if (!loop_.listen_tcp("0.0.0.0", port)) return false;
+
+        running_ = true;
+        last_heard_ms_ = now_ms();  // no votes for others right after a restart (see lease)
+        reset_election_deadline();
+        loop_thread_ = std::thread([this] { loop_.run(); });
+        for (auto& p : peers_) p->thread = std::thread([this, &p] { run_peer(*p); });
+        ticker_ = std::thread([this] { run_ticker(); });
+        persister_ = std::thread([this] { run_persister(); });
+        applier_ = std::thread([this] { run_applier(); });
+        return true;
+    }
+
+    void stop() {
+        if (!running_.exchange(false)) return;
+        loop_.stop();
+        loop_thread_.join();
+        wake_peers();
+        for (auto& p : peers_) p->thread.join();
+        persist_cv_.notify_all();
+        apply_cv_.notify_all();
+        changed_cv_.notify_all();
+        ticker_.join();
+        persister_.join();
+        applier_.join();
+        for (auto& p : peers_) {
+            if (p->fd >= 0) ::close(p->fd);
+            if (p->snap_fd >= 0) ::close(p->snap_fd);
+            ::close(p->wake_fd);
+        }
+        if (log_fd_ >= 0) ::close(log_fd_);
+        log_fd_ = -1;
+    }
+
+    // Keys changed by entries this node did not propose itself. Register before start().
+    void on_apply(ApplyListener fn) { apply_listener_ = std::move(fn); }
+    // Called (under the raft lock, keep it short) when this node gains or loses leadership.
+    void on_role(RoleListener fn) { role_listener_ = std::move(fn); }
+
+    bool is_leader() {
+        std::lock_guard<std::mutex> lock(mu_);
+        return role_ == LEADER;
+    }
+
+    // HTTP address of the current leader, "" if unknown.
+    std::string leader_hint() {
+        std::lock_guard<std::mutex> lock(mu_);
+        return role_ == LEADER ? opts_.advertise : leader_hint_;
+    }
+
+    // False if this thread's last write was not committed (not leader, lost
+    // leadership, or propose_timeout_ms passed).
+    static bool proposal_ok() { return proposal_flag(); }
+
+    // False if this thread's last get() was not served by a leader holding
+    // its lease (a follower's or an old leader's copy may be behind).
+    static bool read_ok() { return read_flag(); }
+
+    std::string status() {
+        std::lock_guard<std::mutex> lock(mu_);
+        static const char* roles[] = {"follower", "candidate", "leader"};
+        std::string out = "id=" + std::to_string(opts_.id) + " role=" + roles[role_] + " term=" + std::to_string(term_) +
+                          " leader=" + (role_ == LEADER ? opts_.advertise : leader_hint_) +
+                          " last=" + std::to_string(last_index()) + " commit=" + std::to_string(commit_idx_) +
+                          " applied=" + std::to_string(last_applied_) + " snapshot=" + std::to_string(snap_idx_) +
+                          " lease=" + (lease_valid_locked() ? "1" : "0") + "\n";
+        for (auto& p : peers_)
+            out += "peer " + std::to_string(p->id) + " " + p->host + ":" + std::to_string(p->port) +
+                   " match=" + std::to_string(p->match) + " next=" + std::to_string(p->next) +
+                   " connected=" + (p->fd >= 0 ? "1" : "0") + "\n";
+        return out;
+    }
+
+    /* ---------- Storage ---------- */
+
+    bool get(const std::string& key, std::string& value, uint64_t* version = nullptr) override {
+        read_flag() = wait_lease();
+        std::shared_lock<std::shared_mutex> lock(state_mu_);
+        auto it = state_.find(key);
+        if (it == state_.end()) {
+            if (version) *version = 0;
+            return false;
+        }
+        value = it->second.value;
+        if (version) *version = it->second.version;
+        return true;
+    }
+
+    uint64_t put(const std::string& key, const std::string& value) override {
+        Result r;
+        return submit(encode_cmd(PUT, key, value, 0), r) ? r.version : 0;
+    }
+
+    bool remove(const std::string& key) override {
+        Result r;
+        return submit(encode_cmd(DEL, key, "", 0), r) && r.ok;
+    }
+
+    bool incr(const std::string& key, long long delta, long long& result) override {
+        Result r;
+        if (!submit(encode_cmd(INCR, key, "", (uint64_t)delta), r) || !r.ok) return false;
+        result = r.number;
+        return true;
+    }
+
+    bool cas(const std::string& key, uint64_t expected_version, const std::string& value,
+             uint64_t& version) override {
+        Result r;
+        version = 0;
+        if (!submit(encode_cmd(CAS, key, value, expected_version), r)) return false;
+        version = r.version;
+        return r.ok;
+    }
+
+    void scan(const std::string& start, const std::string& end, size_t limit,
+              std::vector<std::pair<std::string, std::string>>& out) override {
+        wait_lease();
+        std::shared_lock<std::shared_mutex> lock(state_mu_);
+        for (auto it = state_.lower_bound(start); it != state_.end() && out.size() < limit; ++it) {
+            if (!end.empty() && it->first >= end) break;
+            out.emplace_back(it->first, it->second.value);
+        }
+    }
+
+private:
+    enum Role { FOLLOWER, CANDIDATE, LEADER };
+    enum Op : uint8_t { NOOP, PUT, DEL, INCR, CAS };
+    enum Msg : uint8_t { VOTE = 1, VOTE_OK, APPEND, APPEND_OK, SNAP, SNAP_OK };
+
+    static const size_t kSnapChunk = 1 << 20;
+
+    struct Entry {
+        uint64_t term;
+        std::string cmd;
+    };
+
+    struct Item {
+        std::string value;
+        uint64_t version = 0;
+    };
+
+    struct Result {
+        bool ok = false;
+        uint64_t version = 0;
+        long long number = 0;
+    };
+
+    struct Waiter {
+        uint64_t term = 0;
+        bool done = false, ok = false;
+        Result result;
+    };
+
+    struct Peer {
+        int id = 0;
+        std::string host;
+        int port = 0;
+        int fd = -1;                  // peer thread only
+        int wake_fd = -1;
+        std::thread thread;
+        // guarded by mu_
+        uint64_t next = 1, match = 0;
+        std::vector<int64_t> sent_at;  // send time of each AppendEntries/snapshot in flight
+        int64_t acked_at = 0;          // send time of the newest one answered in this term
+        int64_t last_send = 0;
+        uint64_t vote_term = 0;        // term a vote was requested for on this connection
+        uint64_t hb_seen = 0;
+        int snap_fd = -1;              // snapshot being sent, open for the whole transfer
+        uint64_t snap_idx = 0, snap_off = 0, snap_size = 0;
+    };
+
+    /* ---------- encoding ---------- */
+
+    static void put_u64(std::string& b, uint64_t v) { b.append((const char*)&v, 8); }
+    static void put_str(std::string& b, const std::string& s) {
+        uint32_t n = (uint32_t)s.size();
+        b.append((const char*)&n, 4);
+        b += s;
+    }
+
+    struct Reader {
+        const char* p;
+        const char* end;
+        bool ok = true;
+        Reader(const char* data, size_t n) : p(data), end(data + n) {}
+        uint64_t u64() {
+            uint64_t v = 0;
+            if (end - p < 8) { ok = false; return 0; }
+            memcpy(&v, p, 8);
+            p += 8;
+            return v;
+        }
+        uint8_t u8() {
+            if (p >= end) { ok = false; return 0; }
+            return (uint8_t)*p++;
+        }
+        std::string str() {
+            uint32_t n = 0;
+            if (end - p < 4) { ok = false; return std::string(); }
+            memcpy(&n, p, 4);
+            p += 4;
+            if ((size_t)(end - p) < n) { ok = false; return std::string(); }
+            std::string s(p, n);
+            p += n;
+            return s;
+        }
+    };
+
+    static std::string encode_cmd(Op op, const std::string& key, const std::string& value, uint64_t num) {
+        std::string c(1, (char)op);
+        put_str(c, key);
+        put_str(c, value);
+        put_u64(c, num);
+        return c;
+    }
+
+    static std::string frame(const std::string& body) {
+        uint32_t n = (uint32_t)body.size();
+        return std::string((const char*)&n, 4) + body;
+    }
+
+    // Splits complete frames off the front of `buf`.
+    static bool next_frame(std::string& buf, size_t& pos, std::string& body) {
+        uint32_t n = 0;
+        if (buf.size() - pos < 4) return false;
+        memcpy(&n, buf.data() + pos, 4);
+        if (buf.size() - pos - 4 < n) return false;
+        body.assign(buf, pos + 4, n);
+        pos += 4 + n;
+        return true;
+    }
+
+    static void split_address(const std::string& a, std::string& host, int& port) {
+        size_t colon = a.rfind(':');
+        host = a.substr(0, colon);
+        port = colon == std::string::npos ? 0 : atoi(a.c_str() + colon + 1);
+    }
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool& proposal_flag() {
+        thread_local bool ok = true;
+        return ok;
+    }
+
+    static bool& read_flag() {
+        thread_local bool ok = true;
+        return ok;
+    }
+
+    /* ---------- log (mu_ held) ---------- */
+
+    uint64_t last_index() const { return snap_idx_ + log_.size(); }
+
+    uint64_t term_at(uint64_t idx) const {
+        if (idx == snap_idx_) return snap_term_;
+        if (idx < snap_idx_ || idx > last_index()) return 0;
+        return log_[idx - snap_idx_ - 1].term;
+    }
+
+    const Entry& entry(uint64_t idx) const { return log_[idx - snap_idx_ - 1]; }
+
+    size_t majority() const { return (peers_.size() + 1) / 2 + 1; }
+
+    static uint32_t checksum(const std::string& s, uint64_t idx, uint64_t term) {
+        uint32_t h = 2166136261u;
+        auto mix = [&](const void* d, size_t n) {
+            const unsigned char* p = (const unsigned char*)d;
+            for (size_t i = 0; i < n; ++i) { h ^= p[i]; h *= 16777619u; }
+        };
+        mix(&idx, 8);
+        mix(&term, 8);
+        mix(s.data(), s.size());
+        return h;
+    }
+
+    // Log file record: index, term, length, checksum, command.
+    void write_entries(uint64_t from) {
+        std::string buf;
+        for (uint64_t i = from; i <= last_index(); ++i) {
+            const Entry& e = entry(i);
+            file_offs_.push_back(file_end_ + buf.size());
+            put_u64(buf, i);
+            put_u64(buf, e.term);
+            uint32_t n = (uint32_t)e.cmd.size(), sum = checksum(e.cmd, i, e.term);
+            buf.append((const char*)&n, 4);
+            buf.append((const char*)&sum, 4);
+            buf += e.cmd;
+        }
+        if (buf.empty()) return;
+        if (pwrite(log_fd_, buf.data(), buf.size(), (off_t)file_end_) != (ssize_t)buf.size()) perror("raft log write");
+        file_end_ += buf.size();
+        written_ = last_index();
+    }
+
+    // Drops entries >= idx (follower conflict).
+    void truncate_from(uint64_t idx) {
+        size_t keep = (size_t)(idx - snap_idx_ - 1);
+        log_.resize(keep);
+        file_end_ = keep < file_offs_.size() ? file_offs_[keep] : file_end_;
+        file_offs_.resize(std::min(keep, file_offs_.size()));
+        if (ftruncate(log_fd_, (off_t)file_end_) != 0) perror("raft log truncate");
+        written_ = std::min(written_, last_index());
+        persisted_ = std::min(persisted_, last_index());
+        log_gen_++;
+    }
+
+    // Rewrites the log file with only the entries after the snapshot.
+    void rewrite_log() {
+        std::string path = opts_.dir + "/raft.log", tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) { perror("raft log rewrite"); return; }
+        ::close(log_fd_);
+        log_fd_ = fd;
+        file_offs_.clear();
+        file_end_ = 0;
+        write_entries(snap_idx_ + 1);
+        fsync(fd);
+        if (rename(tmp.c_str(), path.c_str()) != 0) perror("raft log rename");
+        written_ = persisted_ = last_index();
+        log_gen_++;
+    }
+
+    bool write_file(const std::string& path, const std::string& data) {
+        std::string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = write(fd, data.data(), data.size()) == (ssize_t)data.size() && fsync(fd) == 0;
+        ::close(fd);
+        return ok && rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    static bool read_file(const std::string& path, std::string& out) {
+        FILE* f = fopen(path.c_str(), "rb");
+        if (!f) return false;
+        char buf[65536];
+        size_t n;
+        out.clear();
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) out.append(buf, n);
+        fclose(f);
+        return true;
+    }
+
+    void save_meta() {
+        std::string m = std::to_string(term_) + " " + std::to_string(voted_) + "\n";
+        if (!write_file(opts_.dir + "/raft.meta", m)) perror("raft meta");
+    }
+
+    bool load() {
+        std::string data;
+        if (read_file(opts_.dir + "/raft.meta", data))
+            sscanf(data.c_str(), "%llu %d", (unsigned long long*)&term_, &voted_);
+        if (read_file(opts_.dir + "/raft.snap", data) && !load_snapshot(data)) {
+            fprintf(stderr, "%s/raft.snap is damaged\n", opts_.dir.c_str());
+            return false;
+        }
+
+        std::string path = opts_.dir + "/raft.log";
+        read_file(path, data);
+        log_fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (log_fd_ < 0) { perror("raft log"); return false; }
+        size_t pos = 0;
+        while (data.size() - pos >= 24) {
+            Reader r(data.data() + pos, data.size() - pos);
+            uint64_t idx = r.u64(), term = r.u64();
+            uint32_t n, sum;
+            memcpy(&n, r.p, 4);
+            memcpy(&sum, r.p + 4, 4);
+            if (data.size() - pos - 24 < n) break;
+            std::string cmd(data, pos + 24, n);
+            if (checksum(cmd, idx, term) != sum) break;  // torn tail
+            if (idx == last_index() + 1) {
+                file_offs_.push_back(pos);
+                log_.push_back(Entry{term, cmd});
+            }  // else: from before the snapshot, left by a crash before compaction
+            pos += 24 + n;
+        }
+        file_end_ = pos;
+        if (ftruncate(log_fd_, (off_t)pos) != 0) perror("raft log truncate");
+        written_ = persisted_ = last_index();
+        commit_idx_ = last_applied_ = snap_idx_;
+        return true;
+    }
+
+    /* ---------- state machine ---------- */
+
+    std::string snapshot_data(uint64_t idx, uint64_t term) {
+        std::shared_lock<std::shared_mutex> lock(state_mu_);
+        std::string out = "RAFTSNP1";
+        put_u64(out, idx);
+        put_u64(out, term);
+        put_u64(out, state_.size());
+        for (auto& kv : state_) {
+            put_str(out, kv.first);
+            put_str(out, kv.second.value);
+            put_u64(out, kv.second.version);
+        }
+        return out;
+    }
+
+    bool load_snapshot(const std::string& data, std::vector<std::string>* keys = NULL) {
+        if (data.compare(0, 8, "RAFTSNP1") != 0) return false;
+        Reader r(data.data() + 8, data.size() - 8);
+        uint64_t idx = r.u64(), term = r.u64(), n = r.u64();
+        std::map<std::string, Item> state;
+        for (uint64_t i = 0; i < n && r.ok; ++i) {
+            std::string k = r.str();
+            Item& it = state[k];
+            it.value = r.str();
+            it.version = r.u64();
+        }
+        if (!r.ok) return false;
+        std::unique_lock<std::shared_mutex> lock(state_mu_);
+        if (keys) {
+            for (auto& kv : state_) keys->push_back(kv.first);  // deleted or changed
+            for (auto& kv : state) keys->push_back(kv.first);
+        }
+        state_.swap(state);
+        snap_idx_ = idx;
+        snap_term_ = term;
+        return true;
+    }
+
+    Result apply(const std::string& cmd, std::string& key) {
+        Result res;
+        Reader r(cmd.data(), cmd.size());
+        Op op = (Op)r.u8();
+        if (op == NOOP) return res;
+        key = r.str();
+        std::string value = r.str();
+        uint64_t num = r.u64();
+
+        std::unique_lock<std::shared_mutex> lock(state_mu_);
+        auto it = state_.find(key);
+        uint64_t cur = it == state_.end() ? 0 : it->second.version;
+        switch (op) {
+        case PUT:
+            res.ok = true;
+            break;
+        case DEL:
+            res.ok = it != state_.end();
+            if (res.ok) state_.erase(it);
+            return res;
+        case INCR: {
+            long long n = 0;
+            if (it != state_.end() && !parse_counter(it->second.value, n)) return res;
+            if (__builtin_add_overflow(n, (long long)num, &res.number)) return res;
+            value = std::to_string(res.number);
+            res.ok = true;
+            break;
+        }
+        case CAS:
+            res.version = cur;
+            if (cur != num) return res;
+            res.ok = true;
+            break;
+        default:
+            return res;
+        }
+        Item& item = state_[key];
+        item.value = value;
+        item.version = cur + 1;
+        res.version = item.version;
+        return res;
+    }
+
+    /* ---------- client side ---------- */
+
+    // Appends the command on the leader and waits until it is applied.
+    bool submit(const std::string& cmd, Result& result) {
+        Waiter w;
+        uint64_t idx;
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            if (role_ != LEADER) return proposal_flag() = false;
+            w.term = term_;
+            log_.push_back(Entry{term_, cmd});
+            idx = last_index();
+            write_entries(idx);
+            waiters_[idx] = &w;
+            persist_cv_.notify_one();
+            wake_peers();
+            changed_cv_.wait_for(lock, std::chrono::milliseconds(opts_.propose_timeout_ms),
+                                 [&] { return w.done || !running_; });
+            waiters_.erase(idx);
+        }
+        result = w.result;
+        return proposal_flag() = w.done && w.ok;
+    }
+
+    bool lease_valid_locked() const {
+        if (role_ != LEADER || last_applied_ < leader_start_idx_) return false;
+        std::vector<int64_t> acks;
+        acks.push_back(now_ms());  // self
+        for (auto& p : peers_) acks.push_back(p->acked_at);
+        std::sort(acks.rbegin(), acks.rend());
+        int64_t since = acks[majority() - 1];
+        return now_ms() < since + opts_.election_ms * 9 / 10;
+    }
+
+    // Leader without a lease: wait for the next heartbeat round to renew it.
+    // True if this node is the leader and holds the lease.
+    bool wait_lease() {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (role_ != LEADER) return false;
+        if (lease_valid_locked()) return true;
+        hb_seq_++;
+        wake_peers();
+        return changed_cv_.wait_for(lock, std::chrono::milliseconds(opts_.election_ms),
+                                    [&] { return role_ != LEADER || lease_valid_locked() || !running_; }) &&
+               lease_valid_locked();
+    }
+
+    /* ---------- roles (mu_ held) ---------- */
+
+    void reset_election_deadline() {
+        static thread_local std::mt19937 rng(std::random_device{}());
+        election_deadline_ms_ = now_ms() + opts_.election_ms + (int64_t)(rng() % (uint32_t)opts_.election_ms);
+    }
+
+    void wake_peers() {
+        uint64_t one = 1;
+        for (auto& p : peers_) {
+            ssize_t n = write(p->wake_fd, &one, sizeof(one));
+            (void)n;
+        }
+    }
+
+    void become_follower(uint64_t term) {
+        if (term > term_) {
+            term_ = term;
+            voted_ = 0;
+            save_meta();
+        }
+        bool was_leader = role_ == LEADER;
+        role_ = FOLLOWER;
+        if (was_leader && role_listener_) role_listener_(false);
+        changed_cv_.notify_all();
+    }
+
+    void start_election() {
+        role_ = CANDIDATE;
+        term_++;
+        voted_ = opts_.id;
+        votes_ = 1;
+        leader_hint_.clear();
+        save_meta();
+        reset_election_deadline();
+        if ((size_t)votes_ >= majority()) become_leader();
+        else wake_peers();
+    }
+
+    void become_leader() {
+        role_ = LEADER;
+        leader_hint_.clear();
+        int64_t now = now_ms();
+        for (auto& p : peers_) {
+            p->next = last_index() + 1;
+            p->match = 0;
+            p->sent_at.clear();
+            p->acked_at = 0;
+            p->last_send = 0;
+        }
+        leader_since_ms_ = now;
+        // a no-op of the new term commits everything before it; reads wait for it
+        log_.push_back(Entry{term_, std::string(1, (char)NOOP)});
+        leader_start_idx_ = last_index();
+        write_entries(leader_start_idx_);
+        persist_cv_.notify_one();
+        if (role_listener_) role_listener_(true);
+        wake_peers();
+    }
+
+    void advance_commit() {
+        if (role_ != LEADER) return;
+        std::vector<uint64_t> m;
+        m.push_back(persisted_);
+        for (auto& p : peers_) m.push_back(p->match);
+        std::sort(m.rbegin(), m.rend());
+        uint64_t n = m[majority() - 1];
+        if (n > commit_idx_ && term_at(n) == term_) {
+            commit_idx_ = n;
+            apply_cv_.notify_one();
+        }
+    }
+
+    /* ---------- incoming RPCs (loop thread) ---------- */
+
+    void on_data(EventLoop::Conn& c) {
+        std::string out, body;
+        size_t pos = 0;
+        bool sync = false;
+        while (next_frame(c.in, pos, body)) {
+            Reader r(body.data(), body.size());
+            uint8_t type = r.u8();
+            if (type == VOTE) out += frame(handle_vote(r));
+            else if (type == APPEND) out += frame(handle_append(r, sync));
+            else if (type == SNAP) out += frame(handle_snapshot(r));
+        }
+        c.in.erase(0, pos);
+        if (sync) {
+            // one fsync for every AppendEntries in this read
+            int fd;
+            uint64_t upto, gen;
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                fd = dup(log_fd_);
+                upto = written_;
+                gen = log_gen_;
+            }
+            fdatasync(fd);
+            ::close(fd);
+            std::lock_guard<std::mutex> lock(mu_);
+            if (gen == log_gen_) persisted_ = std::max(persisted_, upto);
+        }
+        if (!out.empty()) loop_.send(c, out);
+    }
+
+    std::string handle_vote(Reader& r) {
+        uint64_t term = r.u64(), cand = r.u64(), last_idx = r.u64(), last_term = r.u64();
+        std::lock_guard<std::mutex> lock(mu_);
+        bool granted = false;
+        // a live leader's followers ignore candidates (keeps the read lease safe)
+        bool leader_alive = (role_ == FOLLOWER && now_ms() - last_heard_ms_ < opts_.election_ms) || lease_valid_locked();
+        if (term > term_ && !leader_alive) become_follower(term);
+        if (term == term_ && !leader_alive && (voted_ == 0 || voted_ == (int)cand)) {
+            uint64_t my_term = term_at(last_index());
+            if (last_term > my_term || (last_term == my_term && last_idx >= last_index())) {
+                granted = true;
+                voted_ = (int)cand;
+                save_meta();
+                reset_election_deadline();
+            }
+        }
+        std::string out(1, (char)VOTE_OK);
+        put_u64(out, term_);
+        put_u64(out, granted);
+        return out;
+    }
+
+    std::string handle_append(Reader& r, bool& sync) {
+        uint64_t term = r.u64(), leader = r.u64(), prev_idx = r.u64(), prev_term = r.u64(), commit = r.u64();
+        std::string hint = r.str();
+        uint64_t n = r.u64();
+        std::lock_guard<std::mutex> lock(mu_);
+        std::string out(1, (char)APPEND_OK);
+        auto reply = [&](bool ok, uint64_t idx) {
+            put_u64(out, term_);
+            put_u64(out, ok);
+            put_u64(out, idx);
+            return out;
+        };
+        if (term < term_) return reply(false, 0);
+        if (term > term_ || role_ != FOLLOWER) become_follower(term);
+        (void)leader;
+        leader_hint_ = hint;
+        last_heard_ms_ = now_ms();
+        reset_election_deadline();
+
+        if (prev_idx > last_index()) return reply(false, last_index() + 1);
+        if (prev_idx >= snap_idx_ && term_at(prev_idx) != prev_term) {
+            // skip back over the whole conflicting term
+            uint64_t bad = term_at(prev_idx), i = prev_idx;
+            while (i > snap_idx_ + 1 && term_at(i - 1) == bad) i--;
+            return reply(false, std::max<uint64_t>(i, 1));
+        }
+        uint64_t idx = prev_idx, first_new = 0;
+        for (uint64_t i = 0; i < n && r.ok; ++i) {
+            uint64_t t = r.u64();
+            std::string cmd = r.str();
+            if (!r.ok) break;
+            idx++;
+            if (idx <= snap_idx_) continue;
+            if (idx <= last_index()) {
+                if (term_at(idx) == t) continue;
+                truncate_from(idx);
+            }
+            log_.push_back(Entry{t, cmd});
+            if (!first_new) first_new = idx;
+        }
+        if (first_new) {
+            write_entries(first_new);
+            sync = true;
+        }
+        if (commit > commit_idx_) {
+            commit_idx_ = std::min(commit, idx);
+            apply_cv_.notify_one();
+        }
+        return reply(true, idx);
+    }
+
+    // One piece of a snapshot; the last one (done) installs it. Offset 0
+    // starts a new transfer; a piece that does not follow on drops what came
+    // so far, and the leader starts over once AppendEntries fail.
+    std::string handle_snapshot(Reader& r) {
+        uint64_t term = r.u64(), leader = r.u64();
+        std::string hint = r.str();
+        uint64_t offset = r.u64();
+        bool done = r.u8() != 0;
+        std::string chunk = r.str();
+        (void)leader;
+        std::vector<std::string> keys;
+        std::string out(1, (char)SNAP_OK);
+        {
+            std::unique_lock<std::mutex> alock;
+            if (done) alock = std::unique_lock<std::mutex>(apply_mu_);
+            std::lock_guard<std::mutex> lock(mu_);
+            std::string data;
+            if (term >= term_ && r.ok) {
+                if (term > term_ || role_ != FOLLOWER) become_follower(term);
+                leader_hint_ = hint;
+                last_heard_ms_ = now_ms();
+                reset_election_deadline();
+                if (offset == 0) snap_in_.clear();  // a new transfer
+                if (offset != snap_in_.size()) std::string().swap(snap_in_);
+                else snap_in_ += chunk;
+                if (done) data.swap(snap_in_);
+            }
+            if (!data.empty()) {
+                Reader h(data.data() + 8, data.size() < 8 ? 0 : data.size() - 8);
+                uint64_t idx = h.u64(), t = h.u64();
+                if (h.ok && idx > snap_idx_) {
+                    bool keep = idx <= last_index() && term_at(idx) == t;
+                    std::vector<Entry> rest;
+                    if (keep) rest.assign(log_.begin() + (idx - snap_idx_), log_.end());
+                    if (write_file(opts_.dir + "/raft.snap", data) && load_snapshot(data, &keys)) {
+                        log_.swap(rest);
+                        rewrite_log();
+                        commit_idx_ = std::max(commit_idx_, idx);
+                        last_applied_ = std::max(last_applied_, idx);
+                    }
+                }
+            }
+            put_u64(out, term_);
+            put_u64(out, snap_idx_);
+        }
+        if (apply_listener_) for (auto& k : keys) apply_listener_(k);
+        return out;
+    }
+
+    /* ---------- outgoing RPCs (one thread per peer) ---------- */
+
+    int dial(Peer& p) {
+        struct addrinfo hints, *res = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(p.host.c_str(), std::to_string(p.port).c_str(), &hints, &res) != 0) return -1;
+        int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (fd >= 0) {
+            // 200 ms for the connect only: a big snapshot piece may take
+            // longer to write than that
+            int flags = fcntl(fd, F_GETFL, 0);
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+            bool ok = connect(fd, res->ai_addr, res->ai_addrlen) == 0;
+            if (!ok && errno == EINPROGRESS) {
+                struct pollfd pf = {fd, POLLOUT, 0};
+                int err = 0;
+                socklen_t len = sizeof(err);
+                ok = poll(&pf, 1, 200) == 1 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+            }
+            if (ok) fcntl(fd, F_SETFL, flags);
+            else {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(res);
+        if (fd >= 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        return fd;
+    }
+
+    // Next piece of the snapshot for `p` (mu_ held); closes the file after
+    // the last one. The file stays open for the whole transfer, so a newer
+    // snapshot renamed over it meanwhile does not get mixed in.
+    bool snapshot_chunk(Peer& p, uint64_t& offset, std::string& chunk) {
+        if (p.snap_fd < 0) {
+            p.snap_fd = ::open((opts_.dir + "/raft.snap").c_str(), O_RDONLY);
+            struct stat st;
+            char head[16];
+            if (p.snap_fd < 0 || fstat(p.snap_fd, &st) != 0 || pread(p.snap_fd, head, 16, 0) != 16) {
+                end_snapshot(p);
+                return false;
+            }
+            memcpy(&p.snap_idx, head + 8, 8);
+            p.snap_size = (uint64_t)st.st_size;
+            p.snap_off = 0;
+        }
+        chunk.resize((size_t)std::min<uint64_t>(kSnapChunk, p.snap_size - p.snap_off));
+        if (pread(p.snap_fd, &chunk[0], chunk.size(), (off_t)p.snap_off) != (ssize_t)chunk.size()) {
+            end_snapshot(p);
+            return false;
+        }
+        offset = p.snap_off;
+        p.snap_off += chunk.size();
+        if (p.snap_off == p.snap_size) end_snapshot(p);
+        return true;
+    }
+
+    void end_snapshot(Peer& p) {
+        if (p.snap_fd >= 0) ::close(p.snap_fd);
+        p.snap_fd = -1;
+    }
+
+    // What to send to `p` now (mu_ held).
+    std::string outgoing(Peer& p) {
+        std::string out;
+        int64_t now = now_ms();
+        if (role_ == CANDIDATE && p.vote_term != term_) {
+            std::string m(1, (char)VOTE);
+            put_u64(m, term_);
+            put_u64(m, (uint64_t)opts_.id);
+            put_u64(m, last_index());
+            put_u64(m, term_at(last_index()));
+            out += frame(m);
+            p.vote_term = term_;
+        }
+        if (role_ != LEADER) return out;
+        while ((int)p.sent_at.size() < opts_.pipeline) {
+            bool heartbeat = now - p.last_send >= opts_.heartbeat_ms || p.hb_seen != hb_seq_;
+            if (p.next > last_index() && !heartbeat) break;
+            p.hb_seen = hb_seq_;
+            if (p.next <= snap_idx_) {
+                std::string chunk, m(1, (char)SNAP);
+                uint64_t offset;
+                if (!snapshot_chunk(p, offset, chunk)) break;  // tried again next round
+                bool done = p.snap_fd < 0;
+                put_u64(m, term_);
+                put_u64(m, (uint64_t)opts_.id);
+                put_str(m, opts_.advertise);
+                put_u64(m, offset);
+                m.push_back((char)done);
+                put_str(m, chunk);
+                out += frame(m);
+                if (done) p.next = p.snap_idx + 1;
+            } else {
+                uint64_t n = std::min<uint64_t>(opts_.max_batch, last_index() + 1 - p.next);
+                std::string m(1, (char)APPEND);
+                put_u64(m, term_);
+                put_u64(m, (uint64_t)opts_.id);
+                put_u64(m, p.next - 1);
+                put_u64(m, term_at(p.next - 1));
+                put_u64(m, commit_idx_);
+                put_str(m, opts_.advertise);
+                put_u64(m, n);
+                for (uint64_t i = p.next; i < p.next + n; ++i) {
+                    put_u64(m, entry(i).term);
+                    put_str(m, entry(i).cmd);
+                }
+                out += frame(m);
+                p.next += n;
+            }
+            p.sent_at.push_back(now);
+            p.last_send = now;
+        }
+        return out;
+    }
+
+    void handle_reply(Peer& p, const std::string& body) {
+        Reader r(body.data(), body.size());
+        uint8_t type = r.u8();
+        uint64_t term = r.u64();
+        std::lock_guard<std::mutex> lock(mu_);
+        if (term > term_) {
+            become_follower(term);
+            return;
+        }
+        if (type == VOTE_OK) {
+            bool granted = r.u64() != 0;
+            if (role_ == CANDIDATE && term == term_ && granted && (size_t)++votes_ >= majority()) become_leader();
+            return;
+        }
+        if (p.sent_at.empty()) return;
+        int64_t sent = p.sent_at.front();
+        p.sent_at.erase(p.sent_at.begin());
+        if (role_ != LEADER || term != term_) return;
+        p.acked_at = std::max(p.acked_at, sent);
+        if (type == APPEND_OK) {
+            bool ok = r.u64() != 0;
+            uint64_t idx = r.u64();
+            if (ok) {
+                p.match = std::max(p.match, idx);
+                advance_commit();
+            } else if (idx) {
+                p.next = std::min(p.next, idx);  // pipelined ones behind it fail too
+            }
+        } else if (type == SNAP_OK) {
+            p.match = std::max(p.match, r.u64());
+            if (p.next <= p.match) p.next = p.match + 1;
+            advance_commit();
+        }
+        changed_cv_.notify_all();  // lease renewed
+    }
+
+    void run_peer(Peer& p) {
+        std::string in;
+        while (running_) {
+            if (p.fd < 0) {
+                p.fd = dial(p);
+                std::lock_guard<std::mutex> lock(mu_);
+                p.sent_at.clear();
+                p.vote_term = 0;
+                end_snapshot(p);  // start over at offset 0 on the new connection
+                if (p.match + 1 < p.next) p.next = p.match + 1;
+                in.clear();
+            }
+            std::string out;
+            if (p.fd >= 0) {
+                std::lock_guard<std::mutex> lock(mu_);
+                out = outgoing(p);
+            }
+            size_t done = 0;
+            while (p.fd >= 0 && done < out.size()) {
+                ssize_t w = write(p.fd, out.data() + done, out.size() - done);
+                if (w < 0 && errno == EINTR) continue;
+                if (w <= 0) {
+                    ::close(p.fd);
+                    p.fd = -1;
+                }
+                else done += (size_t)w;
+            }
+
+            struct pollfd fds[2] = {{p.wake_fd, POLLIN, 0}, {p.fd, POLLIN, 0}};
+            poll(fds, p.fd >= 0 ? 2 : 1, p.fd >= 0 ? std::max(1, opts_.heartbeat_ms / 2) : 100);
+            if (fds[0].revents) {
+                uint64_t n;
+                while (read(p.wake_fd, &n, sizeof(n)) > 0) {}
+            }
+            if (p.fd >= 0 && fds[1].revents) {
+                char buf[65536];
+                ssize_t r = read(p.fd, buf, sizeof(buf));
+                if (r <= 0 && !(r < 0 && (errno == EINTR || errno == EAGAIN))) {
+                    ::close(p.fd);
+                    p.fd = -1;
+                    continue;
+                }
+                if (r > 0) in.append(buf, (size_t)r);
+                std::string body;
+                size_t pos = 0;
+                while (next_frame(in, pos, body)) handle_reply(p, body);
+                in.erase(0, pos);
+            }
+        }
+    }
+
+    /* ---------- background threads ---------- */
+
+    // Elections, and a leader steps down when it has not heard from a
+    // majority for two election timeouts.
+    void run_ticker() {
+        while (running_) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            std::lock_guard<std::mutex> lock(mu_);
+            int64_t now = now_ms();
+            if (role_ != LEADER && now >= election_deadline_ms_) {
+                start_election();
+            } else if (role_ == LEADER && !peers_.empty()) {
+                std::vector<int64_t> acks;
+                acks.push_back(now);
+                for (auto& p : peers_) acks.push_back(std::max(p->acked_at, leader_since_ms_));
+                std::sort(acks.rbegin(), acks.rend());
+                if (now - acks[majority() - 1] > 2 * opts_.election_ms) become_follower(term_);
+            }
+        }
+    }
+
+    // Leader group commit: one fsync for everything proposed meanwhile.
+    void run_persister() {
+        std::unique_lock<std::mutex> lock(mu_);
+        while (running_) {
+            persist_cv_.wait_for(lock, std::chrono::milliseconds(100), [&] { return !running_ || written_ > persisted_; });
+            if (written_ <= persisted_) continue;
+            int fd = dup(log_fd_);
+            uint64_t upto = written_, gen = log_gen_;
+            lock.unlock();
+            fdatasync(fd);
+            ::close(fd);
+            lock.lock();
+            if (gen == log_gen_) persisted_ = std::max(persisted_, upto);
+            advance_commit();
+        }
+    }
+
+    void run_applier() {
+        while (running_) {
+            {
+                std::unique_lock<std::mutex> lock(mu_);
+                apply_cv_.wait_for(lock, std::chrono::milliseconds(100),
+                                   [&] { return !running_ || last_applied_ < commit_idx_; });
+            }
+            std::lock_guard<std::mutex> alock(apply_mu_);
+            std::vector<Entry> batch;
+            uint64_t first;
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                first = last_applied_ + 1;
+                for (uint64_t i = first; i <= commit_idx_; ++i) batch.push_back(entry(i));
+            }
+            if (batch.empty()) continue;
+
+            std::vector<std::pair<std::string, Result>> results(batch.size());
+            for (size_t i = 0; i < batch.size(); ++i) results[i].second = apply(batch[i].cmd, results[i].first);
+
+            std::vector<std::string> changed;
+            uint64_t applied = first + batch.size() - 1;
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    auto it = waiters_.find(first + i);
+                    if (it != waiters_.end()) {
+                        it->second->done = true;
+                        it->second->ok = it->second->term == batch[i].term;
+                        it->second->result = results[i].second;
+                    } else if (!results[i].first.empty()) {
+                        changed.push_back(results[i].first);
+                    }
+                }
+                last_applied_ = applied;
+                changed_cv_.notify_all();
+            }
+            if (apply_listener_) for (auto& k : changed) apply_listener_(k);
+
+            if (applied - snap_idx_ >= opts_.snapshot_entries) take_snapshot(applied);
+        }
+    }
+
+    // Applier thread, apply_mu_ held so the map is at `idx`.
+    void take_snapshot(uint64_t idx) {
+        uint64_t term;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            term = term_at(idx);
+        }
+        std::string data = snapshot_data(idx, term);
+        if (!write_file(opts_.dir + "/raft.snap", data)) {
+            perror("raft snapshot");
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mu_);
+        log_.erase(log_.begin(), log_.begin() + (idx - snap_idx_));
+        snap_idx_ = idx;
+        snap_term_ = term;
+        rewrite_log();
+    }
+
+    Options opts_;
+    EventLoop loop_;
+    std::vector<std::unique_ptr<Peer>> peers_;
+    std::atomic<bool> running_{false};
+    std::thread loop_thread_, ticker_, persister_, applier_;
+    ApplyListener apply_listener_;
+    RoleListener role_listener_;
+
+    std::mutex mu_;                       // everything below except the map
+    std::condition_variable changed_cv_;  // applied / lease / role changes
+    std::condition_variable persist_cv_, apply_cv_;
+    Role role_ = FOLLOWER;
+    uint64_t term_ = 0;
+    int voted_ = 0;
+    int votes_ = 0;
+    std::string leader_hint_;
+    int64_t last_heard_ms_ = 0, election_deadline_ms_ = 0, leader_since_ms_ = 0;
+    std::vector<Entry> log_;              // entries snap_idx_ + 1 ...
+    uint64_t snap_idx_ = 0, snap_term_ = 0;
+    uint64_t commit_idx_ = 0, last_applied_ = 0, leader_start_idx_ = 0;
+    uint64_t written_ = 0, persisted_ = 0, log_gen_ = 0;
+    uint64_t hb_seq_ = 0;
+    int log_fd_ = -1;
+    uint64_t file_end_ = 0;
+    std::vector<uint64_t> file_offs_;     // file offset of each entry in log_
+    std::map<uint64_t, Waiter*> waiters_;
+
+    std::string snap_in_;                 // snapshot pieces received so far (loop thread)
+
+    std::mutex apply_mu_;                 // applier vs. snapshot install
+    std::shared_mutex state_mu_;
+    std::map<std::string, Item> state_;
+};
+
+#endif
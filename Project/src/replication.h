@@ -0,0 +1,367 @@
+#ifndef KV_REPLICATION_H
+#define KV_REPLICATION_H
+
+#include "event_loop.h"
+#include "kv_engine.h"
+#include "mmap_store.h"
+#include <netdb.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Primary-backup replication for the mmap store. The heap is the write log
+// (mmap_store.h): a log position is a heap offset, and the primary streams
+// heap bytes to every follower, which appends them at the same offset.
+//
+// Wire protocol, one text line per frame (binary after LOG):
+//   follower -> primary   REPL <pos>\r\n      start streaming at pos (its tail)
+//                         ACK <pos>\r\n       everything below pos is applied
+//   primary -> follower   LOG <pos> <len> <tail>\r\n<len bytes of records>
+//                         HB <tail>\r\n       nothing new (once a second)
+//                         ERR <message>\r\n   then the primary hangs up
+//
+// Acks: "local" answers a write once the primary has it; "quorum" also
+// waits until a majority of the primary plus `followers` replicas have
+// acked it (or the ack timeout passes, then the write reports failure but
+// stays applied and is still shipped). Applied means in the follower's
+// mapped heap, synced with --sync-ms like the primary's own writes.
+class ReplPrimary {
+public:
+    ReplPrimary(MmapStore& store, bool quorum, int followers, int ack_timeout_ms)
+        : store_(store), quorum_(quorum), need_((followers + 1) / 2), timeout_ms_(ack_timeout_ms) {
+        loop_.on_data([this](EventLoop::Conn& c) { on_data(c); });
+        loop_.on_close([this](EventLoop::Conn& c) { drop(c.id); });
+        loop_.every(50, [this] { ship(); });
+    }
+
+    ~ReplPrimary() { stop(); }
+
+    bool start(const std::string& host, int port) {
+        if (!loop_.listen_tcp(host, port)) return false;
+        thread_ = std::thread([this] { loop_.run(); });
+        return true;
+    }
+
+    void stop() {
+        if (!thread_.joinable()) return;
+        loop_.stop();
+        thread_.join();
+    }
+
+    // Call after a write: wakes the shipping. Cheap when a ship is queued.
+    void notify() {
+        if (!ship_posted_.exchange(true)) loop_.post([this] { ship(); });
+    }
+
+    // Commit hook: true once the write ending at `pos` is acked as configured.
+    bool wait(uint64_t pos) {
+        notify();
+        if (!quorum_) return true;
+        std::unique_lock<std::mutex> lock(mu_);
+        return acked_cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms_), [&] {
+            int n = 0;
+            for (auto& f : followers_) n += f.second.acked >= pos;
+            return n >= need_;
+        });
+    }
+
+    // "<address> acked=<pos> lag_bytes=<n>" per follower.
+    std::string status() {
+        uint64_t tail = store_.log_end();
+        std::string out = "role=primary tail=" + std::to_string(tail) + " ack=" + (quorum_ ? "quorum" : "local") + "\n";
+        std::lock_guard<std::mutex> lock(mu_);
+        for (auto& f : followers_) {
+            uint64_t acked = f.second.acked;
+            out += f.second.address + " acked=" + std::to_string(acked) +
+                   " lag_bytes=" + std::to_string(tail > acked ? tail - acked : 0) + "\n";
+        }
+        return out;
+    }
+
+private:
+    static const size_t kChunk = 1 << 20;  // bytes per LOG frame, and the send backlog cap
+
+    struct Follower {
+        std::string address;
+        bool streaming = false;
+        uint64_t sent = 0;   // next position to ship (loop thread)
+        uint64_t acked = 0;  // guarded by mu_
+        int64_t last_send_ms = 0;
+    };
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static std::string peer(int fd) {
+        struct sockaddr_in a;
+        socklen_t len = sizeof(a);
+        char ip[INET_ADDRSTRLEN] = "?";
+        if (getpeername(fd, (struct sockaddr*)&a, &len) == 0) inet_ntop(AF_INET, &a.sin_addr, ip, sizeof(ip));
+        return std::string(ip) + ":" + std::to_string(ntohs(a.sin_port));
+    }
+
+    void on_data(EventLoop::Conn& c) {
+        size_t eol;
+        while ((eol = c.in.find('\n')) != std::string::npos) {
+            std::string line = c.in.substr(0, eol);
+            c.in.erase(0, eol + 1);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            uint64_t pos = strtoull(line.c_str() + line.find(' ') + 1, NULL, 10);
+
+            if (line.compare(0, 5, "REPL ") == 0) {
+                if (pos > store_.log_end()) {
+                    loop_.send(c, "ERR follower is ahead of the primary, wrong data file?\r\n");
+                    c.close_after_write = true;
+                    return;
+                }
+                std::lock_guard<std::mutex> lock(mu_);
+                Follower& f = followers_[c.id];
+                f.address = peer(c.fd);
+                f.streaming = true;
+                f.sent = f.acked = pos;
+            } else if (line.compare(0, 4, "ACK ") == 0) {
+                std::lock_guard<std::mutex> lock(mu_);
+                auto it = followers_.find(c.id);
+                if (it != followers_.end() && pos > it->second.acked) it->second.acked = pos;
+            }
+        }
+        acked_cv_.notify_all();
+        ship();
+    }
+
+    void drop(uint64_t id) {
+        std::lock_guard<std::mutex> lock(mu_);
+        followers_.erase(id);
+    }
+
+    // Loop thread: send every follower what it is missing, a heartbeat if
+    // it has everything. A follower with a full send backlog waits.
+    void ship() {
+        ship_posted_ = false;
+        uint64_t tail = store_.log_end();
+        int64_t now = now_ms();
+        std::vector<std::pair<uint64_t, Follower*>> todo;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            for (auto& f : followers_) if (f.second.streaming) todo.emplace_back(f.first, &f.second);
+        }
+        std::string chunk;
+        for (auto& t : todo) {
+            EventLoop::Conn* c = loop_.find(t.first);
+            if (!c) continue;
+            Follower& f = *t.second;  // only drop() (this thread) erases it
+            while (f.sent < tail && c->out.size() < kChunk) {
+                if (!store_.read_log(f.sent, kChunk, chunk) || chunk.empty()) break;
+                std::string frame = "LOG " + std::to_string(f.sent) + " " + std::to_string(chunk.size()) + " " +
+                                    std::to_string(tail) + "\r\n";
+                f.sent += chunk.size();
+                f.last_send_ms = now;
+                frame += chunk;
+                loop_.send(*c, frame);
+                if (!(c = loop_.find(t.first))) break;
+            }
+            if (c && f.sent >= tail && now - f.last_send_ms >= 1000) {
+                f.last_send_ms = now;
+                loop_.send(*c, "HB " + std::to_string(tail) + "\r\n");
+            }
+        }
+    }
+
+    MmapStore& store_;
+    bool quorum_;
+    int need_;  // follower acks for a majority of the primary + followers
+    int timeout_ms_;
+    EventLoop loop_;
+    std::thread thread_;
+    std::atomic<bool> ship_posted_{false};
+    std::mutex mu_;
+    std::condition_variable acked_cv_;
+    std::map<uint64_t, Follower> followers_;  // by connection id
+};
+
+// Follower: connects to the primary (reconnecting every second), applies
+// the shipped records to its own MmapStore and tells the engine which keys
+// changed, so the cache, watches and /invalidations stay correct here too.
+class ReplFollower {
+public:
+    ReplFollower(MmapStore& store, KvEngine& engine) : store_(store), engine_(engine) {}
+    ~ReplFollower() { stop(); }
+
+    void start(const std::string& host, int port) {
+        host_ = host;
+        port_ = port;
+        running_ = true;
+        thread_ = std::thread([this] { run(); });
+    }
+
+    void stop() {
+        if (!running_.exchange(false)) return;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (fd_ >= 0) shutdown(fd_, SHUT_RDWR);
+        }
+        thread_.join();
+    }
+
+    // lag_bytes: primary log not applied yet; lag_ms: how long this
+    // follower has been behind (0 when caught up).
+    std::string status() {
+        uint64_t applied = store_.log_end(), primary = primary_tail_;
+        int64_t behind = behind_since_ms_;
+        return std::string("role=follower primary=") + host_ + ":" + std::to_string(port_) +
+               " connected=" + (connected_ ? "1" : "0") + " applied=" + std::to_string(applied) +
+               " primary_tail=" + std::to_string(primary) +
+               " lag_bytes=" + std::to_string(primary > applied ? primary - applied : 0) +
+               " lag_ms=" + std::to_string(behind ? now_ms() - behind : 0) + "\n";
+    }
+
+private:
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    int connect_primary() {
+        struct addrinfo hints, *res = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host_.c_str(), std::to_string(port_).c_str(), &hints, &res) != 0) return -1;
+        int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd >= 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        return fd;
+    }
+
+    bool send_line(int fd, const std::string& line) {
+        size_t done = 0;
+        while (done < line.size()) {
+            ssize_t w = write(fd, line.data() + done, line.size() - done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return false;
+            done += (size_t)w;
+        }
+        return true;
+    }
+
+    // Buffered reads from the primary: a line, or exactly n bytes.
+    bool read_more(int fd) {
+        char buf[65536];
+        for (;;) {
+            ssize_t r = read(fd, buf, sizeof(buf));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) return false;
+            in_.append(buf, (size_t)r);
+            return true;
+        }
+    }
+
+    bool read_line(int fd, std::string& line) {
+        size_t eol;
+        while ((eol = in_.find('\n')) == std::string::npos)
+            if (!read_more(fd)) return false;
+        line = in_.substr(0, eol);
+        in_.erase(0, eol + 1);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        return true;
+    }
+
+    bool read_bytes(int fd, size_t n, std::string& out) {
+        while (in_.size() < n)
+            if (!read_more(fd)) return false;
+        out = in_.substr(0, n);
+        in_.erase(0, n);
+        return true;
+    }
+
+    void track(uint64_t primary_tail) {
+        primary_tail_ = primary_tail;
+        if (store_.log_end() >= primary_tail) behind_since_ms_ = 0;
+        else if (behind_since_ms_ == 0) behind_since_ms_ = now_ms();
+    }
+
+    void run() {
+        while (running_) {
+            int fd = connect_primary();
+            if (fd < 0) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                fd_ = fd;
+            }
+            if (!running_) shutdown(fd, SHUT_RDWR);  // stop() came before fd_ was set
+            in_.clear();
+            connected_ = true;
+            stream(fd);
+            connected_ = false;
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                fd_ = -1;
+            }
+            ::close(fd);
+            if (running_) std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+    }
+
+    void stream(int fd) {
+        if (!send_line(fd, "REPL " + std::to_string(store_.log_end()) + "\r\n")) return;
+        std::string line, data;
+        std::vector<std::string> keys;
+        while (running_ && read_line(fd, line)) {
+            if (line.compare(0, 3, "HB ") == 0) {
+                track(strtoull(line.c_str() + 3, NULL, 10));
+                if (!send_line(fd, "ACK " + std::to_string(store_.log_end()) + "\r\n")) return;
+                continue;
+            }
+            if (line.compare(0, 4, "ERR ") == 0) {
+                fprintf(stderr, "replication: primary says %s\n", line.c_str() + 4);
+                std::this_thread::sleep_for(std::chrono::seconds(4));
+                return;
+            }
+            unsigned long long pos = 0, len = 0, tail = 0;
+            if (sscanf(line.c_str(), "LOG %llu %llu %llu", &pos, &len, &tail) != 3) return;
+            if (!read_bytes(fd, (size_t)len, data)) return;
+            keys.clear();
+            bool ok = store_.apply_log(pos, data, keys);
+            for (auto& k : keys) engine_.replicated(k);
+            if (!ok) {
+                fprintf(stderr, "replication: cannot apply log at %llu, reconnecting\n", pos);
+                return;
+            }
+            track(tail);
+            if (!send_line(fd, "ACK " + std::to_string(store_.log_end()) + "\r\n")) return;
+        }
+    }
+
+    MmapStore& store_;
+    KvEngine& engine_;
+    std::string host_;
+    int port_ = 0;
+    std::atomic<bool> running_{false}, connected_{false};
+    std::atomic<uint64_t> primary_tail_{0};
+    std::atomic<int64_t> behind_since_ms_{0};
+    std::string in_;
+    std::mutex mu_;
+    int fd_ = -1;
+    std::thread thread_;
+};
+
+#endif
@@ -0,0 +1,262 @@
+#ifndef KV_RESP_SERVER_H
+#define KV_RESP_SERVER_H
+
+#include "event_loop.h"
+#include "kv_engine.h"
+#include <cctype>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// RESP2 (Redis protocol) listener on top of KvEngine:
+//   PING ECHO GET SET [EX s|PX ms] DEL MGET MSET INCR INCRBY DECR DECRBY
+//   EXPIRE TTL EXISTS SELECT COMMAND QUIT
+// The parser is incremental: every complete command in the receive buffer
+// is executed and all replies leave in one write, so a client pipelining
+// N commands pays one round trip. Inline commands (redis-cli / telnet
+// style "GET k\r\n") are accepted too.
+//
+// Expiry has whole-second resolution (KvEngine::expire), so PX is rounded
+// up to the next second. SET with EX/PX is a set followed by an expire, not
+// one step: a reader can see the value without its TTL in between, and if
+// the expire is refused the key stays without one. Writes on a read-only
+// node (replica, raft follower) answer -READONLY.
+class RespServer {
+public:
+    explicit RespServer(KvEngine& engine) : engine_(engine) {}
+    ~RespServer() { stop(); }
+
+    // `threads` loops share the port through SO_REUSEPORT.
+    bool start(const std::string& host, int port, int threads) {
+        for (int i = 0; i < threads; ++i) {
+            std::unique_ptr<EventLoop> loop(new EventLoop());
+            loop->on_data([this](EventLoop::Conn& c) { on_data(c); });
+            if (!loop->listen_tcp(host, port, true)) return false;
+            loops_.push_back(std::move(loop));
+        }
+        for (auto& loop : loops_) {
+            EventLoop* l = loop.get();
+            threads_.emplace_back([l] { l->run(); });
+        }
+        return true;
+    }
+
+    void stop() {
+        for (auto& loop : loops_) loop->stop();
+        for (auto& t : threads_) t.join();
+        threads_.clear();
+        loops_.clear();
+    }
+
+private:
+    static const size_t kMaxInline = 64 * 1024;
+
+    void on_data(EventLoop::Conn& c) {
+        size_t pos = 0;
+        std::vector<std::string> argv;
+        while (pos < c.in.size() && !c.close_after_write) {
+            argv.clear();
+            long used = c.in[pos] == '*' ? parse_multibulk(c.in, pos, argv) : parse_inline(c.in, pos, argv);
+            if (used == 0) break;  // incomplete, wait for more bytes
+            if (used < 0) {
+                c.out += "-ERR Protocol error\r\n";
+                c.close_after_write = true;
+                break;
+            }
+            pos += (size_t)used;
+            if (!argv.empty()) execute(c, argv);
+        }
+        c.in.erase(0, pos);
+    }
+
+    /* ---------- parser ---------- */
+
+    // Reads "<prefix><int>\r\n" at pos. Returns bytes used, 0 if incomplete, -1 if malformed.
+    static long read_int_line(const std::string& in, size_t pos, char prefix, long long& n) {
+        if (pos >= in.size()) return 0;
+        if (in[pos] != prefix) return -1;
+        size_t eol = in.find("\r\n", pos);
+        if (eol == std::string::npos) return in.size() - pos > 32 ? -1 : 0;
+        char* end = NULL;
+        n = strtoll(in.c_str() + pos + 1, &end, 10);
+        if (end != in.c_str() + eol) return -1;
+        return (long)(eol + 2 - pos);
+    }
+
+    static long parse_multibulk(const std::string& in, size_t pos, std::vector<std::string>& argv) {
+        size_t start = pos;
+        long long count = 0;
+        long r = read_int_line(in, pos, '*', count);
+        if (r <= 0) return r;
+        if (count > 1024 * 1024) return -1;
+        pos += (size_t)r;
+        for (long long i = 0; i < count; ++i) {
+            long long len = 0;
+            r = read_int_line(in, pos, '$', len);
+            if (r <= 0) return r;
+            if (len < 0 || len > 512ll * 1024 * 1024) return -1;
+            pos += (size_t)r;
+            if (in.size() < pos + (size_t)len + 2) return 0;
+            argv.emplace_back(in, pos, (size_t)len);
+            pos += (size_t)len + 2;
+        }
+        return (long)(pos - start);
+    }
+
+    static long parse_inline(const std::string& in, size_t pos, std::vector<std::string>& argv) {
+        size_t eol = in.find('\n', pos);
+        if (eol == std::string::npos) return in.size() - pos > kMaxInline ? -1 : 0;
+        size_t end = eol > pos && in[eol - 1] == '\r' ? eol - 1 : eol;
+        size_t i = pos;
+        while (i < end) {
+            while (i < end && isspace((unsigned char)in[i])) i++;
+            size_t j = i;
+            while (j < end && !isspace((unsigned char)in[j])) j++;
+            if (j > i) argv.emplace_back(in, i, j - i);
+            i = j;
+        }
+        return (long)(eol + 1 - pos);
+    }
+
+    /* ---------- replies ---------- */
+
+    static void bulk(std::string& out, const std::string& s) {
+        out += '$';
+        out += std::to_string(s.size());
+        out += "\r\n";
+        out += s;
+        out += "\r\n";
+    }
+    // A value from the engine: a big one is written from its shared buffer.
+    static void bulk(EventLoop::Conn& c, const ValueRef& v) {
+        c.out += '$';
+        c.out += std::to_string(v->size());
+        c.out += "\r\n";
+        EventLoop::append(c, v);
+        c.out += "\r\n";
+    }
+    static void null_bulk(std::string& out) { out += "$-1\r\n"; }
+    static void integer(std::string& out, long long n) { out += ':' + std::to_string(n) + "\r\n"; }
+
+    static std::string upper(std::string s) {
+        for (auto& ch : s) ch = (char)toupper((unsigned char)ch);
+        return s;
+    }
+
+    // What KvEngine::set returned: a version, or 0 which in write-back mode
+    // is a coalesced set whose version comes later.
+    bool stored(uint64_t ver) const { return ver != 0 || engine_.write_back(); }
+
+    static bool to_ll(const std::string& s, long long& n) {
+        if (s.empty()) return false;
+        char* end = NULL;
+        n = strtoll(s.c_str(), &end, 10);
+        return *end == '\0';
+    }
+
+    /* ---------- commands ---------- */
+
+    void execute(EventLoop::Conn& c, const std::vector<std::string>& a) {
+        std::string& out = c.out;
+        std::string cmd = upper(a[0]);
+        size_t n = a.size();
+        auto arity_error = [&] { out += "-ERR wrong number of arguments for '" + a[0] + "' command\r\n"; };
+        bool write = cmd == "SET" || cmd == "MSET" || cmd == "DEL" || cmd == "INCR" || cmd == "DECR" ||
+                     cmd == "INCRBY" || cmd == "DECRBY" || cmd == "EXPIRE";
+        if (write && engine_.read_only()) {
+            out += "-READONLY You can't write against a read only replica.\r\n";
+            return;
+        }
+
+        if (cmd == "GET") {
+            if (n != 2) return arity_error();
+            ValueRef v;
+            if (engine_.get_ref(a[1], v)) bulk(c, v);
+            else null_bulk(out);
+        } else if (cmd == "SET") {
+            if (n < 3) return arity_error();
+            long long ttl_ms = 0;
+            for (size_t i = 3; i < n; ++i) {
+                std::string o = upper(a[i]);
+                long long t = 0;
+                if ((o == "EX" || o == "PX") && i + 1 < n && to_ll(a[i + 1], t) && t > 0) {
+                    ttl_ms = o == "EX" ? t * 1000 : t;
+                    i++;
+                } else {
+                    out += "-ERR syntax error\r\n";
+                    return;
+                }
+            }
+            if (!stored(engine_.set(a[1], a[2]))) {
+                out += "-ERR write failed\r\n";
+                return;
+            }
+            if (ttl_ms > 0) engine_.expire(a[1], (ttl_ms + 999) / 1000);  // whole seconds
+            out += "+OK\r\n";
+        } else if (cmd == "DEL") {
+            if (n < 2) return arity_error();
+            long long removed = 0;
+            for (size_t i = 1; i < n; ++i) removed += engine_.del(a[i]) ? 1 : 0;
+            integer(out, removed);
+        } else if (cmd == "EXISTS") {
+            if (n < 2) return arity_error();
+            long long found = 0;
+            std::string v;
+            for (size_t i = 1; i < n; ++i) found += engine_.get(a[i], v) ? 1 : 0;
+            integer(out, found);
+        } else if (cmd == "MGET") {
+            if (n < 2) return arity_error();
+            out += '*' + std::to_string(n - 1) + "\r\n";
+            for (size_t i = 1; i < n; ++i) {
+                ValueRef v;
+                if (engine_.get_ref(a[i], v)) bulk(c, v);
+                else null_bulk(out);
+            }
+        } else if (cmd == "MSET") {
+            if (n < 3 || n % 2 == 0) return arity_error();
+            bool ok = true;
+            for (size_t i = 1; i + 1 < n; i += 2) ok = stored(engine_.set(a[i], a[i + 1])) && ok;
+            out += ok ? "+OK\r\n" : "-ERR write failed\r\n";
+        } else if (cmd == "INCR" || cmd == "DECR" || cmd == "INCRBY" || cmd == "DECRBY") {
+            bool by = cmd == "INCRBY" || cmd == "DECRBY";
+            if (n != (by ? 3u : 2u)) return arity_error();
+            long long delta = 1;
+            if (by && !to_ll(a[2], delta)) { out += "-ERR value is not an integer or out of range\r\n"; return; }
+            if (cmd[0] == 'D') delta = -delta;
+            long long result = 0;
+            if (engine_.incr(a[1], delta, result)) integer(out, result);
+            else out += "-ERR value is not an integer or out of range\r\n";
+        } else if (cmd == "EXPIRE") {
+            long long secs = 0;
+            if (n != 3) return arity_error();
+            if (!to_ll(a[2], secs)) { out += "-ERR value is not an integer or out of range\r\n"; return; }
+            integer(out, engine_.expire(a[1], secs) ? 1 : 0);
+        } else if (cmd == "TTL") {
+            if (n != 2) return arity_error();
+            std::string v;
+            integer(out, engine_.get(a[1], v) ? engine_.ttl(a[1]) : -2);
+        } else if (cmd == "PING") {
+            if (n > 1) bulk(out, a[1]);
+            else out += "+PONG\r\n";
+        } else if (cmd == "ECHO") {
+            if (n != 2) return arity_error();
+            bulk(out, a[1]);
+        } else if (cmd == "SELECT") {
+            out += "+OK\r\n";  // single keyspace
+        } else if (cmd == "COMMAND") {
+            out += "*0\r\n";  // enough for redis-cli's handshake
+        } else if (cmd == "QUIT") {
+            out += "+OK\r\n";
+            c.close_after_write = true;
+        } else {
+            out += "-ERR unknown command '" + a[0] + "'\r\n";
+        }
+    }
+
+    KvEngine& engine_;
+    std::vector<std::unique_ptr<EventLoop>> loops_;
+    std::vector<std::thread> threads_;
+};
+
+#endif
@@ -0,0 +1,541 @@
+#include "event_loop.h"
+#include <netdb.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+// ROUTER: one HTTP address in front of several server.cpp instances
+//   ./router --port 8000 --backends 127.0.0.1:8080,127.0.0.1:8090=2
+// Every key belongs to one backend, picked by weighted rendezvous hashing
+// (highest hash(key, backend) scaled by the weight). Changing a weight or
+// adding a backend only moves the keys that now score highest somewhere
+// else; the others stay where they are.
+//   curl "localhost:8000/router"                                       backends, weights, counters
+//   curl "localhost:8001/router/weight?backend=127.0.0.1:8090&weight=0"  drain (or add) a backend
+// /router/weight is only answered on --admin-port (off unless given),
+// which listens on 127.0.0.1 only.
+// /get /set /delete /incr /cas go to the key's backend as they are. /mget
+// is split into one POST /mget per backend, sent in parallel, and the
+// answers are put back in the request's key order. /scan is not routed
+// (keys are spread over all backends), ask the backends directly.
+//
+// Each --threads thread runs one epoll loop (event_loop.h) with its own
+// listener (SO_REUSEPORT) and its own keep-alive connections to every
+// backend, so a request never leaves the thread that read it.
+
+// BACKENDS
+struct Backend {
+    string addr;  // host:port, as given
+    double weight = 1;
+    uint64_t seed = 0;  // hash of addr, mixed into every key's score
+    struct sockaddr_storage sa;
+    socklen_t sa_len = 0;
+    atomic<uint64_t> requests{0}, errors{0};
+};
+
+// Replaced as a whole when a weight changes; loops keep using the copy
+// they loaded until their request is done.
+struct Table {
+    vector<shared_ptr<Backend>> backends;
+};
+
+static mutex g_table_mu;
+static shared_ptr<const Table> g_table;
+
+static uint64_t fnv1a(const string& s) {
+    uint64_t h = 1469598103934665603ULL;
+    for (unsigned char c : s) { h ^= c; h *= 1099511628211ULL; }
+    return h;
+}
+
+static uint64_t mix(uint64_t x) {  // splitmix64 finalizer
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Weighted rendezvous: score = -weight / ln(u), u uniform in (0,1) from
+// hash(key, backend). Backend i wins a key with probability w_i / sum(w).
+static Backend* pick(const Table& t, const string& key) {
+    uint64_t h = fnv1a(key);
+    Backend* best = NULL;
+    double best_score = 0;
+    for (auto& b : t.backends) {
+        if (b->weight <= 0) continue;
+        double u = ((double)(mix(h ^ b->seed) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+        double score = -b->weight / log(u);
+        if (!best || score > best_score) { best = b.get(); best_score = score; }
+    }
+    return best;
+}
+
+static shared_ptr<Backend> make_backend(const string& addr, double weight) {
+    auto b = make_shared<Backend>();
+    b->addr = addr;
+    b->weight = weight;
+    b->seed = mix(fnv1a(addr));
+    size_t colon = addr.rfind(':');
+    if (colon == string::npos) return NULL;
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(addr.substr(0, colon).c_str(), addr.substr(colon + 1).c_str(), &hints, &res) != 0) return NULL;
+    memcpy(&b->sa, res->ai_addr, res->ai_addrlen);
+    b->sa_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return b;
+}
+
+// "host:port=weight" (weight 0 = no keys); an unknown backend is added.
+static string set_weight(const string& addr, double weight) {
+    lock_guard<mutex> lock(g_table_mu);
+    auto t = make_shared<Table>(*g_table);
+    for (auto& b : t->backends) {
+        if (b->addr != addr) continue;
+        auto copy = make_backend(addr, weight);  // counters restart
+        if (!copy) return "BAD_BACKEND";
+        b = copy;
+        atomic_store(&g_table, shared_ptr<const Table>(t));
+        return "OK";
+    }
+    auto b = make_backend(addr, weight);
+    if (!b) return "BAD_BACKEND";
+    t->backends.push_back(b);
+    atomic_store(&g_table, shared_ptr<const Table>(t));
+    return "ADDED";
+}
+
+// HTTP HELPERS
+static string url_decode(const string& s) {
+    string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '+') out += ' ';
+        else if (s[i] == '%' && i + 2 < s.size()) {
+            out += (char)strtol(s.substr(i + 1, 2).c_str(), NULL, 16);
+            i += 2;
+        } else out += s[i];
+    }
+    return out;
+}
+
+static string url_encode(const string& s) {
+    static const char* digits = "0123456789ABCDEF";
+    string out;
+    for (unsigned char c : s) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') out += (char)c;
+        else { out += '%'; out += digits[c >> 4]; out += digits[c & 15]; }
+    }
+    return out;
+}
+
+// All values of `name` in a query string or form body.
+static vector<string> params(const string& query, const string& name) {
+    vector<string> out;
+    for (size_t pos = 0; pos < query.size();) {
+        size_t amp = query.find('&', pos);
+        if (amp == string::npos) amp = query.size();
+        size_t eq = query.find('=', pos);
+        if (eq < amp && query.compare(pos, eq - pos, name) == 0 && eq - pos == name.size())
+            out.push_back(url_decode(query.substr(eq + 1, amp - eq - 1)));
+        pos = amp + 1;
+    }
+    return out;
+}
+
+static bool header_is(const string& head, size_t line, const char* name) {
+    size_t n = strlen(name);
+    return strncasecmp(head.c_str() + line, name, n) == 0 && head[line + n] == ':';
+}
+
+static string header_value(const string& head, size_t line) {
+    size_t colon = head.find(':', line), end = head.find("\r\n", line);
+    size_t v = head.find_first_not_of(' ', colon + 1);
+    return v >= end ? string() : head.substr(v, end - v);
+}
+
+static string response(const string& status, const string& body, const string& headers = "") {
+    return "HTTP/1.1 " + status + "\r\nContent-Type: text/plain\r\nContent-Length: " + to_string(body.size()) +
+           "\r\n" + headers + "\r\n" + body;
+}
+
+// ROUTER LOOP
+class RouterLoop {
+public:
+    RouterLoop(int timeout_ms, size_t max_idle, bool admin = false)
+        : timeout_us_((int64_t)timeout_ms * 1000), max_idle_(max_idle), admin_(admin) {
+        loop_.on_data([this](EventLoop::Conn& c) {
+            if (peer(c).backend) backend_data(c);
+            else front_data(c);
+        });
+        loop_.on_close([this](EventLoop::Conn& c) {
+            if (peer(c).backend) backend_closed(c);
+        });
+        loop_.every(50, [this] { expire_calls(); });
+    }
+
+    bool listen(int port) { return loop_.listen_tcp(admin_ ? "127.0.0.1" : "0.0.0.0", port, !admin_); }
+    void run() { loop_.run(); }
+
+private:
+    struct Job;
+
+    // One request to one backend.
+    struct Call {
+        shared_ptr<Job> job;
+        Backend* backend;
+        vector<size_t> slots;  // mget: positions of this backend's keys in the request
+        string request = "";
+        bool retried = false;
+    };
+
+    // One client request; done when every call answered.
+    struct Job {
+        uint64_t front;
+        bool mget = false;
+        size_t pending = 0;
+        bool failed = false;
+        vector<string> records;  // mget: one "<len> <version>\n<value>\n" per key
+        string reply;            // single key: the backend's response, passed on
+        shared_ptr<const Table> table;  // keeps the Backends alive
+    };
+
+    // Conn::state for both sides.
+    struct Peer {
+        bool backend = false;
+        bool busy = false;       // front: a request is being answered (answers go out in order)
+        bool close = false;      // front: client asked for Connection: close
+        Backend* target = NULL;  // backend side
+        shared_ptr<Call> call;
+        bool reused = false;     // taken from the idle pool: the backend may have closed it meanwhile
+        int64_t sent_us = 0;
+        const char* error = "502 Bad Gateway";
+    };
+
+    static int64_t now_us() {
+        return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static Peer& peer(EventLoop::Conn& c) {
+        if (!c.state) c.state = make_shared<Peer>();
+        return *static_cast<Peer*>(c.state.get());
+    }
+
+    /* ---------- client side ---------- */
+
+    void front_data(EventLoop::Conn& c) {
+        Peer& p = peer(c);
+        if (p.busy) return;
+        size_t end = c.in.find("\r\n\r\n");
+        if (end == string::npos) {
+            if (c.in.size() > 65536) reply(c, response("431 Request Header Fields Too Large", "TOO_LARGE"), true);
+            return;
+        }
+        size_t body_len = 0;
+        bool close = false;
+        string head = c.in.substr(0, end + 2);
+        for (size_t line = head.find("\r\n") + 2; line < head.size(); line = head.find("\r\n", line) + 2) {
+            if (header_is(head, line, "Content-Length")) body_len = strtoul(header_value(head, line).c_str(), NULL, 10);
+            else if (header_is(head, line, "Connection")) close = strcasecmp(header_value(head, line).c_str(), "close") == 0;
+        }
+        if (c.in.size() < end + 4 + body_len) return;
+        string body = c.in.substr(end + 4, body_len);
+        c.in.erase(0, end + 4 + body_len);
+
+        size_t sp1 = head.find(' '), sp2 = head.find(' ', sp1 + 1);
+        string method = head.substr(0, sp1), target = head.substr(sp1 + 1, sp2 - sp1 - 1);
+        size_t q = target.find('?');
+        string path = target.substr(0, q), query = q == string::npos ? "" : target.substr(q + 1);
+        p.busy = true;
+        p.close = close;
+        route(c, method, path, query, target, method == "POST" ? body : query);
+    }
+
+    void route(EventLoop::Conn& c, const string& method, const string& path, const string& query,
+               const string& target, const string& form) {
+        shared_ptr<const Table> table = atomic_load(&g_table);
+        if (path == "/hi") return reply(c, response("200 OK", "Hello World!"));
+        if (path == "/router") return reply(c, response("200 OK", status(*table)));
+        if (path == "/router/weight") {
+            if (!admin_) return reply(c, response("403 Forbidden", "ADMIN_PORT_ONLY"));
+            vector<string> b = params(query, "backend"), w = params(query, "weight");
+            if (b.empty() || w.empty()) return reply(c, response("400 Bad Request", "BACKEND_AND_WEIGHT_NEEDED"));
+            string r = set_weight(b[0], atof(w[0].c_str()));
+            return reply(c, response(r == "BAD_BACKEND" ? "400 Bad Request" : "200 OK", r));
+        }
+
+        auto job = make_shared<Job>();
+        job->front = c.id;
+        job->table = table;
+        if (path == "/mget") {
+            vector<string> keys = params(form, "key");
+            job->mget = true;
+            job->records.resize(keys.size());
+            map<Backend*, shared_ptr<Call>> calls;
+            for (size_t i = 0; i < keys.size(); ++i) {
+                Backend* b = pick(*table, keys[i]);
+                if (!b) return reply(c, response("503 Service Unavailable", "NO_BACKEND"));
+                auto& call = calls[b];
+                if (!call) call = make_shared<Call>(Call{job, b, {}});
+                call->slots.push_back(i);
+            }
+            if (calls.empty()) return reply(c, response("200 OK", ""));
+            job->pending = calls.size();
+            for (auto& kv : calls) {
+                string form_body;
+                for (size_t i : kv.second->slots) form_body += (form_body.empty() ? "key=" : "&key=") + url_encode(keys[i]);
+                send(kv.second, "POST /mget HTTP/1.1\r\nHost: kv\r\nContent-Type: application/x-www-form-urlencoded\r\n"
+                                "Content-Length: " + to_string(form_body.size()) + "\r\n\r\n" + form_body);
+            }
+            return;
+        }
+        if (path == "/get" || path == "/set" || path == "/delete" || path == "/incr" || path == "/cas") {
+            vector<string> key = params(query, "key");
+            Backend* b = key.empty() ? NULL : pick(*table, key[0]);
+            if (!b) return reply(c, response(key.empty() ? "400 Bad Request" : "503 Service Unavailable",
+                                             key.empty() ? "KEY_NEEDED" : "NO_BACKEND"));
+            job->pending = 1;
+            send(make_shared<Call>(Call{job, b, {}}), method + " " + target + " HTTP/1.1\r\nHost: kv\r\n\r\n");
+            return;
+        }
+        if (path == "/scan") return reply(c, response("501 Not Implemented", "SCAN_THE_BACKENDS"));
+        reply(c, response("404 Not Found", "NOT_FOUND"));
+    }
+
+    // Answers the front connection's current request and starts the next one.
+    void reply(EventLoop::Conn& c, const string& data, bool close = false) {
+        Peer& p = peer(c);
+        p.busy = false;
+        if (close || p.close) c.close_after_write = true;
+        uint64_t id = c.id;
+        loop_.send(c, data);
+        EventLoop::Conn* still = loop_.find(id);
+        if (still && !still->close_after_write && !still->in.empty()) front_data(*still);
+    }
+
+    void finish(Job& job) {
+        EventLoop::Conn* c = loop_.find(job.front);
+        if (!c) return;  // client went away
+        if (job.failed) return reply(*c, job.reply.empty() ? response("502 Bad Gateway", "BACKEND_DOWN") : job.reply);
+        if (!job.mget) return reply(*c, job.reply);
+        string body;
+        for (auto& r : job.records) body += r;
+        reply(*c, response("200 OK", body));
+    }
+
+    /* ---------- backend side ---------- */
+
+    EventLoop::Conn* connect_to(Backend* b, bool pooled) {
+        auto& idle = idle_[b->addr];
+        while (pooled && !idle.empty()) {
+            EventLoop::Conn* c = loop_.find(idle.back());
+            idle.pop_back();
+            if (!c) continue;
+            peer(*c).reused = true;
+            return c;
+        }
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) return NULL;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(fd, (struct sockaddr*)&b->sa, b->sa_len) < 0 && errno != EINPROGRESS) {
+            ::close(fd);
+            return NULL;
+        }
+        EventLoop::Conn& c = loop_.adopt(fd);
+        Peer& p = peer(c);
+        p.backend = true;
+        p.target = b;
+        p.reused = false;
+        return &c;
+    }
+
+    void send(const shared_ptr<Call>& call, const string& request) {
+        call->backend->requests++;
+        call->request = request;
+        start(call);
+    }
+
+    void start(const shared_ptr<Call>& call) {
+        EventLoop::Conn* c = connect_to(call->backend, !call->retried);
+        if (!c) return fail(*call, "502 Bad Gateway");
+        Peer& p = peer(*c);
+        p.call = call;
+        p.sent_us = now_us();
+        p.error = "502 Bad Gateway";
+        busy_.insert(c->id);
+        loop_.send(*c, call->request);  // a failed write ends up in backend_closed
+    }
+
+    void fail(Call& call, const char* status) {
+        call.backend->errors++;
+        Job& job = *call.job;
+        if (!job.failed) {
+            job.failed = true;
+            job.reply = response(status, strcmp(status, "504 Gateway Timeout") == 0 ? "BACKEND_TIMEOUT" : "BACKEND_DOWN");
+        }
+        if (--job.pending == 0) finish(job);
+    }
+
+    void backend_data(EventLoop::Conn& c) {
+        Peer& p = peer(c);
+        size_t end = c.in.find("\r\n\r\n");
+        if (end == string::npos || !p.call) return;
+        size_t body_len = 0;
+        bool keep = true;
+        string head = c.in.substr(0, end + 2), out_head;
+        size_t first = head.find("\r\n") + 2;
+        out_head = head.substr(0, first);
+        for (size_t line = first; line < head.size(); line = head.find("\r\n", line) + 2) {
+            size_t next = head.find("\r\n", line) + 2;
+            if (header_is(head, line, "Content-Length")) body_len = strtoul(header_value(head, line).c_str(), NULL, 10);
+            if (header_is(head, line, "Connection")) keep = strcasecmp(header_value(head, line).c_str(), "close") != 0;
+            else if (!header_is(head, line, "Keep-Alive")) out_head.append(head, line, next - line);
+        }
+        if (c.in.size() < end + 4 + body_len) return;
+        int status = atoi(head.c_str() + head.find(' ') + 1);
+        string body = c.in.substr(end + 4, body_len);
+        c.in.erase(0, end + 4 + body_len);
+
+        shared_ptr<Call> call = move(p.call);
+        busy_.erase(c.id);
+        if (keep && idle_[p.target->addr].size() < max_idle_) idle_[p.target->addr].push_back(c.id);
+        else c.close_after_write = true;  // closed by the loop after this handler
+
+        Job& job = *call->job;
+        if (!job.mget) job.reply = out_head + "\r\n" + body;
+        else if (status != 200) job.failed = true;
+        else if (!split_records(body, *call, job)) job.failed = true;
+        if (--job.pending == 0) finish(job);
+    }
+
+    // "<len> <version>\n<value>\n" or "-1 0\n" per key, in the call's order.
+    static bool split_records(const string& body, const Call& call, Job& job) {
+        size_t pos = 0;
+        for (size_t slot : call.slots) {
+            size_t nl = body.find('\n', pos);
+            if (nl == string::npos) return false;
+            long long len = strtoll(body.c_str() + pos, NULL, 10);
+            size_t end = len < 0 ? nl + 1 : nl + 1 + (size_t)len + 1;
+            if (end > body.size()) return false;
+            job.records[slot].assign(body, pos, end - pos);
+            pos = end;
+        }
+        return true;
+    }
+
+    void backend_closed(EventLoop::Conn& c) {
+        Peer& p = peer(c);
+        busy_.erase(c.id);
+        if (!p.call) return;  // idle connection dropped by the backend
+        shared_ptr<Call> call = move(p.call);
+        // keep-alive race: the backend closed the idle connection as we reused it
+        if (p.reused && c.in.empty() && !call->retried && strcmp(p.error, "504 Gateway Timeout") != 0) {
+            call->retried = true;
+            return start(call);
+        }
+        fail(*call, p.error);
+    }
+
+    void expire_calls() {
+        int64_t now = now_us();
+        vector<uint64_t> late;
+        for (uint64_t id : busy_) {
+            EventLoop::Conn* c = loop_.find(id);
+            if (c && now - peer(*c).sent_us > timeout_us_) late.push_back(id);
+        }
+        for (uint64_t id : late) {
+            EventLoop::Conn* c = loop_.find(id);
+            if (!c) continue;
+            peer(*c).error = "504 Gateway Timeout";
+            loop_.close_conn(*c);
+        }
+    }
+
+    static string status(const Table& t) {
+        string out;
+        for (auto& b : t.backends) {
+            char line[256];
+            snprintf(line, sizeof(line), "%s weight=%g requests=%llu errors=%llu\n", b->addr.c_str(), b->weight,
+                     (unsigned long long)b->requests.load(), (unsigned long long)b->errors.load());
+            out += line;
+        }
+        return out;
+    }
+
+    EventLoop loop_;
+    int64_t timeout_us_;
+    size_t max_idle_;
+    bool admin_;  // --admin-port loop: may change weights
+    map<string, vector<uint64_t>> idle_;  // backend addr -> idle keep-alive connections
+    unordered_set<uint64_t> busy_;         // backend connections with a call in flight
+};
+
+int main(int argc, char** argv) {
+
+    // FLAGS: --name value
+    //   --port 8000            listen port
+    //   --backends A,B=2,...   server.cpp instances as host:port[=weight] (weight 1 if left out)
+    //   --threads 1            epoll loops, each with its own backend connections
+    //   --backend-timeout-ms 2000   then the answer is 504
+    //   --pool 64              idle keep-alive connections kept per backend and thread
+    //   --admin-port 0         127.0.0.1 port that also answers /router/weight (0 = none)
+    map<string, string> opts;
+    for (int i = 1; i + 1 < argc; i += 2) opts[argv[i]] = argv[i + 1];
+    auto opt = [&](const string& name, const string& def) {
+        auto it = opts.find(name);
+        return it == opts.end() ? def : it->second;
+    };
+
+    auto table = make_shared<Table>();
+    string backends = opt("--backends", "127.0.0.1:8080");
+    for (size_t pos = 0; pos < backends.size();) {
+        size_t comma = backends.find(',', pos);
+        if (comma == string::npos) comma = backends.size();
+        string item = backends.substr(pos, comma - pos);
+        size_t eq = item.find('=');
+        auto b = make_backend(item.substr(0, eq), eq == string::npos ? 1.0 : atof(item.c_str() + eq + 1));
+        if (!b) {
+            fprintf(stderr, "bad backend %s\n", item.c_str());
+            return 1;
+        }
+        table->backends.push_back(b);
+        pos = comma + 1;
+    }
+    g_table = table;
+
+    signal(SIGPIPE, SIG_IGN);  // a backend that went away shows up as a failed write
+    int port = stoi(opt("--port", "8000"));
+    int threads = max(1, stoi(opt("--threads", "1")));
+    vector<unique_ptr<RouterLoop>> loops;
+    for (int i = 0; i < threads; ++i) {
+        loops.emplace_back(new RouterLoop(stoi(opt("--backend-timeout-ms", "2000")), stoul(opt("--pool", "64"))));
+        if (!loops.back()->listen(port)) return 1;
+    }
+    int admin_port = stoi(opt("--admin-port", "0"));
+    if (admin_port > 0) {
+        loops.emplace_back(new RouterLoop(stoi(opt("--backend-timeout-ms", "2000")), stoul(opt("--pool", "64")), true));
+        if (!loops.back()->listen(admin_port)) return 1;
+    }
+    printf("router on port %d, %zu backends, %d threads\n", port, table->backends.size(), threads);
+    fflush(stdout);
+
+    vector<thread> workers;
+    for (size_t i = 1; i < loops.size(); ++i) workers.emplace_back([&, i] { loops[i]->run(); });
+    loops[0]->run();
+}
@@ -1,54 +1,655 @@
 #include "httplib.h"
 #include <mysql/mysql.h>
+#include "mysql_storage.h"
+#include "mmap_store.h"
+#include "kv_engine.h"
+#include "watch_hub.h"
+#include "memcache_server.h"
+#include "resp_server.h"
+#include "hot_get_server.h"
+#include "shm_cache.h"
+#include "replication.h"
+#include "raft.h"
+#include "inval_bus.h"
+#include "change_feed.h"
+#include <atomic>
+#include <csignal>
+#include <map>
+#include <memory>
 #include <string>
+#include <thread>
+#include <unistd.h>
 
 using namespace httplib;
 using namespace std;
 
-int main() {
+static Server* g_svr = NULL;
+static RaftStore* g_raft = NULL;  // --storage raft
 
-    // CREATE MYSQL CONNECTION
-    MYSQL* conn = mysql_init(NULL);
+// /get values from this size up are written from the shared buffer instead
+// of being copied into Response::body (below it the copy is cheaper).
+static const size_t kZeroCopyMin = 16 * 1024;
 
-    mysql_real_connect(conn, "127.0.0.1", "root", "Hsrahay@123", "kvdb", 3306, NULL, 0);
+// SCAN HELPERS
+static string to_hex(const string& s) {
+    static const char* digits = "0123456789abcdef";
+    string out;
+    for (unsigned char c : s) { out += digits[c >> 4]; out += digits[c & 15]; }
+    return out;
+}
 
-    Server svr;
+static string from_hex(const string& s) {
+    string out;
+    for (size_t i = 0; i + 1 < s.size(); i += 2) out += (char)stoi(s.substr(i, 2), nullptr, 16);
+    return out;
+}
+
+// Smallest key greater than every key starting with `prefix` ("" = none).
+static string prefix_end(string prefix) {
+    while (!prefix.empty() && (unsigned char)prefix.back() == 0xff) prefix.pop_back();
+    if (!prefix.empty()) prefix.back() = (char)((unsigned char)prefix.back() + 1);
+    return prefix;
+}
+
+// REPLICATION HELPERS
+// Raft: only the leader answers, the others point at it (X-Leader, HTTP
+// host:port, empty while there is no leader).
+static void not_leader(Response& res) {
+    res.status = 421;
+    res.set_header("X-Leader", g_raft->leader_hint());
+    res.set_content("NOT_LEADER", "text/plain");
+}
+
+// Followers only serve reads.
+static bool refuse_write(KvEngine& engine, Response& res) {
+    if (!engine.read_only()) return false;
+    if (g_raft) {
+        not_leader(res);
+        return true;
+    }
+    res.status = 403;
+    res.set_content("READ_ONLY", "text/plain");
+    return true;
+}
+
+// Raft followers don't serve reads either, their copy may be behind.
+// Checked after the read: only a leader holding its lease answers.
+static bool refuse_read(Response& res) {
+    if (!g_raft || RaftStore::read_ok()) return false;
+    not_leader(res);
+    return true;
+}
+
+// --repl-ack quorum: the write is applied here but not enough followers
+// acked it in time.
+static void check_replicated(Response& res) {
+    if (KvEngine::committed()) return;
+    res.status = 503;
+    res.set_content("NOT_REPLICATED", "text/plain");
+}
+
+// Raft: a write that failed because it never committed (leader lost, no
+// majority), not because of the key.
+static bool proposal_lost(Response& res) {
+    if (!g_raft || RaftStore::proposal_ok()) return false;
+    res.status = 503;
+    res.set_content("NOT_REPLICATED", "text/plain");
+    return true;
+}
 
+// ROUTES: shared by the TCP and the unix socket listener
+static void register_routes(Server& svr, KvEngine& engine) {
     svr.Get("/hi", [](const Request&, Response& res) {
         res.set_content("Hello World!", "text/plain");
     });
 
-    svr.Get("/set", [&](const Request& req, Response& res) {
+    // /set?key=&value=   written to storage before the reply
+    // /set?key=&value=&mode=coalesce   kept in memory (reads see it) and only
+    //                                  the last value set within --coalesce-ms
+    //                                  is written, replies "Queued"
+    svr.Get("/set", [&engine](const Request& req, Response& res) {
+        if (refuse_write(engine, res)) return;
         string key = req.get_param_value("key");
         string value = req.get_param_value("value");
-
-        string query = "REPLACE INTO kv_store (k, v) VALUES('" + key + "','" + value + "')";
-        mysql_query(conn, query.c_str());
+        if (req.get_param_value("mode") == "coalesce") {
+            engine.set_coalesced(key, value);
+            res.set_content("Queued", "text/plain");
+            return;
+        }
+        uint64_t ver = engine.set(key, value);
+        if (!ver && !engine.write_back()) {  // storage refused it (e.g. disk full)
+            if (!proposal_lost(res)) {
+                res.status = 500;
+                res.set_content("WRITE_FAILED", "text/plain");
+            }
+            return;
+        }
+        res.set_header("X-Version", to_string(ver));
         res.set_content("Stored", "text/plain");
+        check_replicated(res);
     });
 
-    svr.Get("/get", [&](const Request& req, Response& res) {
+    // A value stored compressed goes out as it is stored to a client that
+    // accepts gzip (httplib is built without zlib and never compresses).
+    // Otherwise the value is the engine's shared buffer (the cache's own for
+    // a cached plain value); a big one is written to the socket straight
+    // from it by a content provider that holds a reference, so eviction or
+    // an overwrite during the send is harmless.
+    svr.Get("/get", [&engine](const Request& req, Response& res) {
         string key = req.get_param_value("key");
-        string query = "SELECT v FROM kv_store WHERE k='" + key + "'";
-        mysql_query(conn, query.c_str());
-
-        MYSQL_RES* result = mysql_store_result(conn);
-        MYSQL_ROW row = mysql_fetch_row(result);
+        uint64_t ver = 0;
+        if (req.get_header_value("Accept-Encoding").find("gzip") != string::npos) {
+            string value;
+            bool gzipped = false;
+            bool found = engine.get_stored(key, value, &ver, gzipped);
+            if (refuse_read(res)) return;
+            if (!found) return res.set_content("NOT_FOUND", "text/plain");
+            res.set_header("X-Version", to_string(ver));
+            if (gzipped) res.set_header("Content-Encoding", "gzip");
+            res.set_content(value, "text/plain");
+            return;
+        }
+        ValueRef value;
+        bool found = engine.get_ref(key, value, &ver);
+        if (refuse_read(res)) return;
+        if (!found) return res.set_content("NOT_FOUND", "text/plain");
+        res.set_header("X-Version", to_string(ver));
+        if (value->size() < kZeroCopyMin) return res.set_content(*value, "text/plain");
+        res.set_content_provider(value->size(), "text/plain", [value](size_t offset, size_t length, DataSink& sink) {
+            return sink.write(value->data() + offset, length);
+        });
+    });
 
-        if(row) res.set_content(row[0], "text/plain");
-        else res.set_content("NOT_FOUND", "text/plain");
+    // /incr?key=&delta=   atomic add, replies with the new value
+    // /incr?key=&delta=&mode=relaxed   combined in memory and written within
+    //                                  --counter-flush-ms, replies "Queued"
+    svr.Get("/incr", [&engine](const Request& req, Response& res) {
+        if (refuse_write(engine, res)) return;
+        string key = req.get_param_value("key");
+        long long delta = req.has_param("delta") ? strtoll(req.get_param_value("delta").c_str(), NULL, 10) : 1;
+        if (req.get_param_value("mode") == "relaxed") {
+            engine.incr_relaxed(key, delta);
+            res.set_content("Queued", "text/plain");
+            return;
+        }
+        long long result = 0;
+        if (engine.incr(key, delta, result)) {
+            res.set_content(to_string(result), "text/plain");
+            check_replicated(res);
+        } else if (!proposal_lost(res)) {
+            res.status = 409;
+            res.set_content("NOT_A_NUMBER", "text/plain");
+        }
+    });
 
-        mysql_free_result(result);
+    // /cas?key=&expected_version=&value=   write only if the version still
+    // matches (0 = key must not exist), 409 with the current version if not
+    svr.Get("/cas", [&engine](const Request& req, Response& res) {
+        if (refuse_write(engine, res)) return;
+        string key = req.get_param_value("key");
+        string value = req.get_param_value("value");
+        uint64_t expected = strtoull(req.get_param_value("expected_version").c_str(), NULL, 10);
+        uint64_t ver = 0;
+        bool ok = engine.cas(key, expected, value, ver);
+        res.set_header("X-Version", to_string(ver));
+        if (ok) {
+            res.set_content("Stored", "text/plain");
+            check_replicated(res);
+        } else if (!proposal_lost(res)) {
+            res.status = 409;
+            res.set_content("VERSION_MISMATCH", "text/plain");
+        }
     });
 
-    svr.Get("/delete", [&](const Request& req, Response& res) {
+    svr.Get("/delete", [&engine](const Request& req, Response& res) {
+        if (refuse_write(engine, res)) return;
         string key = req.get_param_value("key");
-        string query = "DELETE FROM kv_store WHERE k='" + key + "'";
-        mysql_query(conn, query.c_str());
+        bool existed = engine.del(key);
         res.set_content("Deleted", "text/plain");
+        if (existed) check_replicated(res);
+        else proposal_lost(res);
+    });
+
+    // /mget?key=a&key=b...   (or POST with the same form body for many keys)
+    // For every key in order: "<len> <version>\n<value>\n", or "-1 0\n" if missing.
+    auto mget = [&engine](const Request& req, Response& res) {
+        size_t n = req.get_param_value_count("key");
+        string body;
+        for (size_t i = 0; i < n; ++i) {
+            string value;
+            uint64_t ver = 0;
+            if (engine.get(req.get_param_value("key", i), value, &ver))
+                body += to_string(value.size()) + " " + to_string(ver) + "\n" + value + "\n";
+            else body += "-1 0\n";
+            if (refuse_read(res)) return;
+        }
+        res.set_content(body, "text/plain");
+    };
+    svr.Get("/mget", mget);
+    svr.Post("/mget", mget);
+
+    // /scan?start=&end=&prefix=&limit=&token=
+    // Streams "key=value" lines in key order. If the limit cut the range
+    // short, the last line is "#next <token>"; pass it back as token= to
+    // continue. Rows are pulled from storage a page at a time.
+    svr.Get("/scan", [&engine](const Request& req, Response& res) {
+        if (g_raft && !g_raft->is_leader()) return not_leader(res);
+        string start = req.has_param("token") ? from_hex(req.get_param_value("token"))
+                                              : req.get_param_value("start");
+        string end = req.get_param_value("end");
+        string prefix = req.get_param_value("prefix");
+        size_t limit = req.has_param("limit") ? strtoul(req.get_param_value("limit").c_str(), NULL, 10) : 100;
+
+        if (!prefix.empty()) {
+            if (start < prefix) start = prefix;
+            string pe = prefix_end(prefix);
+            if (end.empty() || (!pe.empty() && pe < end)) end = pe;
+        }
+
+        struct ScanState { string next, end; size_t left; };
+        auto st = make_shared<ScanState>(ScanState{start, end, limit});
+        KvEngine* eng = &engine;
+
+        res.set_chunked_content_provider("text/plain", [eng, st](size_t, DataSink& sink) {
+            if (st->left == 0) {
+                vector<pair<string, string>> peek;
+                eng->scan(st->next, st->end, 1, peek);
+                if (!peek.empty()) {
+                    string line = "#next " + to_hex(st->next) + "\n";
+                    sink.write(line.data(), line.size());
+                }
+                sink.done();
+                return true;
+            }
+
+            size_t page = min<size_t>(st->left, 256);
+            vector<pair<string, string>> rows;
+            eng->scan(st->next, st->end, page, rows);
+
+            string chunk;
+            for (auto& kv : rows) chunk += kv.first + "=" + kv.second + "\n";
+            if (!chunk.empty() && !sink.write(chunk.data(), chunk.size())) return false;
+
+            st->left -= rows.size();
+            if (!rows.empty()) st->next = rows.back().first + '\0';
+            if (rows.size() < page) sink.done();
+            return true;
+        });
     });
+}
+
+int main(int argc, char** argv) {
+
+    // FLAGS: --name value
+    //   --port 8080            HTTP API port
+    //   --storage mysql|mmap|raft   where keys live (default mysql)
+    //   --data-file kv.db      mmap heap file, index goes to kv.db.idx
+    //   --sync-ms 1000         mmap checkpoint (msync) interval
+    //   --counter-flush-ms 100 how often /incr?mode=relaxed deltas are written
+    //   --coalesce-ms 100      how often /set?mode=coalesce values are written; also the
+    //                          most of those sets a crash can lose
+    //   --flash-file PATH      second cache tier on local SSD for what the DRAM cache evicts,
+    //                          e.g. /mnt/nvme/kv.flash (contents are lost on restart)
+    //   --flash-mb 1024
+    //   --flash-region-mb 4    unit of writing and eviction
+    //   --flash-evict fifo     fifo | lru: which region is reused when the file is full
+    //   --compress-min-bytes 0 gzip values at least this big in the cache and in storage
+    //                          (0 = off; compressed values stay readable either way)
+    //   --compress-level 1     zlib level
+    //   --dict-min-bytes 0     values from this size up (below --compress-min-bytes) are
+    //                          deflated with a dictionary trained by /dict/train (0 = off)
+    //   --write-back PATH      every /set is coalesced and acknowledged once it is in the
+    //                          journal PATH.<n> (replayed at start), e.g. /var/lib/kv/wb.journal
+    //   --journal-sync-ms 1000 fdatasync the journal this often (0 = never; a process
+    //                          crash loses nothing either way, a machine crash up to this)
+    //   --write-back-max-dirty 100000   keys waiting for storage before /set blocks
+    //   --write-back-batch 500 keys per storage transaction
+    //   --watch-port 0         long-poll /watch and /invalidations listener (0 = off),
+    //                          e.g. 8081; KvClient near caches need it
+    //   --cache-mb 0           in-process LRU cache in front of storage (0 = off), e.g. 64
+    //   --memcached-port 0     memcached text/binary listener (0 = off), e.g. 11211
+    //   --memcached-threads 2
+    //   --resp-port 0          Redis (RESP2) listener (0 = off), e.g. 6379
+    //   --resp-threads 2
+    //   --fast-get-port 0      GET /get only, hot keys answered from prepared responses
+    //                          (0 = off), e.g. 8082
+    //   --fast-get-threads 2
+    //   --hot-mb 64            memory for the prepared responses
+    //   --hot-min-reads 2      reads before a key's response is prepared
+    //   --keep-alive-max 100   requests per HTTP connection before the server closes it
+    //   --unix-socket PATH     also serve the HTTP API on a unix socket, e.g. /tmp/kv.sock
+    //   --shm-name NAME        publish hot keys in shared memory for kv_shm.h readers, e.g. /kvcache
+    //   --shm-slots 16384
+    //   --shm-value-max 1024   bigger values are not published
+    //   --repl-port 0          primary: stream the write log to followers (mmap only), e.g. 9000
+    //   --repl-ack local       local | quorum: answer writes once a majority has them
+    //   --repl-followers 1     replicas in the set, for the quorum size
+    //   --repl-ack-timeout-ms 1000
+    //   --replica-of HOST:PORT follower: read only copy of that primary's --repl-port
+    //   --raft-id 1            raft mode: this node's position in --raft-peers
+    //   --raft-peers A,B,C     raft host:port of every node (3 or 5), same list on all of them
+    //   --raft-dir raft<id>    log, term/vote and snapshot files
+    //   --raft-batch 64        entries per AppendEntries
+    //   --raft-pipeline 4      AppendEntries in flight per follower
+    //   --raft-election-ms 300
+    //   --raft-snapshot-entries 10000   snapshot + log compaction interval
+    //   --inval-group HOST:PORT  instances sharing one MySQL: multicast cache invalidations, e.g. 239.255.0.1:7400
+    //   --inval-peers A,B      or send them to these instances' --inval-port (no multicast)
+    //   --inval-port 7400
+    //   --inval-batch-ms 1     collect writes this long into one datagram
+    //   --cdc off              refresh | invalidate: follow kv_changelog (Project/cdc.sql) so writes
+    //                          made without the server reach the cache (mysql only)
+    //   --cdc-poll-ms 50
+    map<string, string> opts;
+    for (int i = 1; i + 1 < argc; i += 2) opts[argv[i]] = argv[i + 1];
+    auto opt = [&](const string& name, const string& def) {
+        auto it = opts.find(name);
+        return it == opts.end() ? def : it->second;
+    };
+
+    string mode = opt("--storage", "mysql");
+    MYSQL* conn = NULL;
+    unique_ptr<Storage> storage;
+    MmapStore* mm = NULL;
+    RaftStore* raft = NULL;
+
+    if (mode == "raft") {
+        RaftStore::Options ro;
+        ro.id = stoi(opt("--raft-id", "1"));
+        string peers = opt("--raft-peers", "127.0.0.1:7001");
+        for (size_t pos = 0; pos <= peers.size();) {
+            size_t comma = peers.find(',', pos);
+            if (comma == string::npos) comma = peers.size();
+            if (comma > pos) ro.peers.push_back(peers.substr(pos, comma - pos));
+            pos = comma + 1;
+        }
+        if (ro.id < 1 || ro.id > (int)ro.peers.size()) {
+            fprintf(stderr, "--raft-id must be 1..%d\n", (int)ro.peers.size());
+            return 1;
+        }
+        ro.dir = opt("--raft-dir", "raft" + to_string(ro.id));
+        // other nodes send clients here: same host as our raft address, HTTP port
+        string me = ro.peers[ro.id - 1];
+        ro.advertise = me.substr(0, me.rfind(':')) + ":" + opt("--port", "8080");
+        ro.max_batch = stoul(opt("--raft-batch", "64"));
+        ro.pipeline = stoi(opt("--raft-pipeline", "4"));
+        ro.election_ms = stoi(opt("--raft-election-ms", "300"));
+        ro.heartbeat_ms = max(10, ro.election_ms / 6);
+        ro.snapshot_entries = stoull(opt("--raft-snapshot-entries", "10000"));
+        raft = new RaftStore(ro);
+        storage.reset(raft);
+        g_raft = raft;
+        // reads must not bypass the leader lease, so no cache in front
+        opts["--cache-mb"] = "0";
+    } else if (mode == "mmap") {
+        mm = new MmapStore();
+        if (!mm->open(opt("--data-file", "kv.db"))) return 1;
+        storage.reset(mm);
+        printf("mmap store: %llu keys, %llu heap bytes\n",
+               (unsigned long long)mm->live_keys(), (unsigned long long)mm->heap_used());
+    } else {
+        // CREATE MYSQL CONNECTION
+        conn = mysql_init(NULL);
+        mysql_real_connect(conn, "127.0.0.1", "root", "Hsrahay@123", "kvdb", 3306, NULL, 0);
+        storage.reset(new MysqlStorage(conn));
+    }
+
+    // PERIODIC CHECKPOINT FOR THE MMAP STORE
+    atomic<bool> running(true);
+    thread syncer;
+    if (mm) {
+        int sync_ms = stoi(opt("--sync-ms", "1000"));
+        syncer = thread([&, sync_ms] {
+            while (running) {
+                this_thread::sleep_for(chrono::milliseconds(sync_ms));
+                mm->checkpoint();
+            }
+        });
+    }
+
+    unique_ptr<WriteJournal> journal;  // outlives the engine's coalescer
+    unique_ptr<FlashCache> flash;      // and its cache
+    // ENGINE: cache + storage + relaxed counters and sets, shared by every listener
+    KvEngine engine(*storage, (size_t)stoul(opt("--cache-mb", "0")) << 20, stoi(opt("--counter-flush-ms", "100")),
+                    stoi(opt("--coalesce-ms", "100")));
+    // RAFT: only the leader takes writes; entries applied on a follower
+    // update its watches like local writes do
+    if (raft) {
+        engine.set_read_only(true);
+        engine.on_commit([] { return RaftStore::proposal_ok(); });
+        raft->on_role([&](bool leader) { engine.set_read_only(!leader); });
+        raft->on_apply([&](const string& key) { engine.replicated(key); });
+        if (!raft->start()) return 1;
+    }
+
+    engine.set_compression(stoul(opt("--compress-min-bytes", "0")), stoi(opt("--compress-level", "1")));
+    engine.set_dict_compression(stoul(opt("--dict-min-bytes", "0")));
+
+    // FLASH TIER: what the DRAM cache evicts goes to a local SSD file and
+    // comes back up on a hit
+    string flash_path = opt("--flash-file", "");
+    if (!flash_path.empty()) {
+        if (!engine.cache().enabled()) {
+            fprintf(stderr, "--flash-file needs the DRAM cache (--cache-mb > 0)\n");
+            return 1;
+        }
+        FlashCache::Options fo;
+        fo.path = flash_path;
+        fo.bytes = (size_t)stoul(opt("--flash-mb", "1024")) << 20;
+        fo.region_bytes = (size_t)stoul(opt("--flash-region-mb", "4")) << 20;
+        fo.lru = opt("--flash-evict", "fifo") == "lru";
+        flash.reset(new FlashCache(fo));
+        if (!flash->open()) return 1;
+        engine.cache().attach_flash(flash.get());
+    }
+
+    // WRITE-BACK: /set answers once the value is in the cache and the local
+    // journal; the coalescer writes it to storage within --coalesce-ms
+    string journal_path = opt("--write-back", "");
+    if (!journal_path.empty()) {
+        if (raft || !opt("--replica-of", "").empty()) {
+            fprintf(stderr, "--write-back needs a node that takes writes itself (not raft or --replica-of)\n");
+            return 1;
+        }
+        journal.reset(new WriteJournal(journal_path, stoi(opt("--journal-sync-ms", "1000"))));
+        engine.coalescer().limits(stoul(opt("--write-back-max-dirty", "100000")), stoul(opt("--write-back-batch", "500")));
+        if (!engine.coalescer().use_journal(journal.get())) return 1;
+        engine.set_write_back(true);
+    }
+
+    engine.start();
+
+    // SHARED MEMORY HOT CACHE: local readers look keys up without a syscall
+    ShmCache shm(engine);
+    string shm_name = opt("--shm-name", "");
+    if (!shm_name.empty() &&
+        !shm.open(shm_name, (uint32_t)stoul(opt("--shm-slots", "16384")), (uint32_t)stoul(opt("--shm-value-max", "1024"))))
+        return 1;
+
+    // REPLICATION: the mmap heap is the log that gets shipped
+    int repl_port = stoi(opt("--repl-port", "0"));
+    string replica_of = opt("--replica-of", "");
+    if ((repl_port > 0 || !replica_of.empty()) && !mm) {
+        fprintf(stderr, "replication needs --storage mmap\n");
+        return 1;
+    }
+    unique_ptr<ReplPrimary> primary;
+    unique_ptr<ReplFollower> follower;
+    if (repl_port > 0) {
+        primary.reset(new ReplPrimary(*mm, opt("--repl-ack", "local") == "quorum",
+                                      stoi(opt("--repl-followers", "1")), stoi(opt("--repl-ack-timeout-ms", "1000"))));
+        if (!primary->start("0.0.0.0", repl_port)) return 1;
+        engine.on_commit([&] { return primary->wait(mm->log_end()); });
+        // writes that skip the commit hook (relaxed counter flushes, expiry) are shipped too
+        engine.on_change([&](const string&) { primary->notify(); });
+    }
+    if (!replica_of.empty()) {
+        size_t colon = replica_of.rfind(':');
+        if (colon == string::npos) {
+            fprintf(stderr, "--replica-of wants HOST:PORT\n");
+            return 1;
+        }
+        engine.set_read_only(true);
+        follower.reset(new ReplFollower(*mm, engine));
+        follower->start(replica_of.substr(0, colon), stoi(replica_of.substr(colon + 1)));
+    }
+
+    // INVALIDATION BUS: other instances drop the keys we write from their caches
+    InvalidationBus::Options bo;
+    bo.group = opt("--inval-group", "");
+    string inval_peers = opt("--inval-peers", "");
+    for (size_t pos = 0; pos < inval_peers.size();) {
+        size_t comma = inval_peers.find(',', pos);
+        if (comma == string::npos) comma = inval_peers.size();
+        bo.peers.push_back(inval_peers.substr(pos, comma - pos));
+        pos = comma + 1;
+    }
+    bo.port = stoi(opt("--inval-port", "7400"));
+    bo.batch_ms = stoi(opt("--inval-batch-ms", "1"));
+    unique_ptr<InvalidationBus> bus;
+    if (!bo.group.empty() || !bo.peers.empty()) {
+        bus.reset(new InvalidationBus(engine, bo));
+        engine.on_change([&](const string& key) { bus->publish(key); });
+    }
+
+    // CHANGE FEED: writes to kv_store from outside the server
+    string cdc = opt("--cdc", "off");
+    MYSQL* cdc_conn = NULL;
+    unique_ptr<ChangeFeed> feed;
+    if (cdc != "off") {
+        if (!conn) {
+            fprintf(stderr, "--cdc needs --storage mysql\n");
+            return 1;
+        }
+        cdc_conn = mysql_init(NULL);
+        mysql_real_connect(cdc_conn, "127.0.0.1", "root", "Hsrahay@123", "kvdb", 3306, NULL, 0);
+        ChangeFeed::Options fo;
+        fo.refresh = cdc != "invalidate";
+        fo.poll_ms = stoi(opt("--cdc-poll-ms", "50"));
+        feed.reset(new ChangeFeed(engine, cdc_conn, fo));
+    }
+
+    // WATCH LISTENER: parked long-polls live on their own epoll thread
+    WatchHub watches(engine);
+    engine.on_change([&](const string& key) { watches.notify(key); });
+    engine.on_flush([&] { watches.flush(); });
+    int watch_port = stoi(opt("--watch-port", "0"));
+    if (watch_port > 0 && !watches.start("0.0.0.0", watch_port)) return 1;
+
+    // FAST GET LISTENER: hot /get responses are built once and shared
+    HotResponses hot((size_t)stoul(opt("--hot-mb", "64")) << 20, (uint32_t)stoul(opt("--hot-min-reads", "2")));
+    HotGetServer fast_get(engine, hot);
+    int fast_port = stoi(opt("--fast-get-port", "0"));
+    if (fast_port > 0) {
+        if (raft) {
+            fprintf(stderr, "--fast-get-port can't tell raft followers from the leader, use /get\n");
+            return 1;
+        }
+        engine.on_change([&](const string& key) { hot.invalidate(key); });
+        engine.on_dirty([&](const string& key) { hot.invalidate(key); });
+        engine.on_flush([&] { hot.clear(); });
+        if (!fast_get.start("0.0.0.0", fast_port, stoi(opt("--fast-get-threads", "2")))) return 1;
+    }
+
+    // changes from other instances and from the change feed go through every listener above
+    if (bus && !bus->start()) return 1;
+    if (feed && !feed->start()) return 1;
+
+    // MEMCACHED LISTENER
+    MemcacheServer memcached(engine);
+    int mc_port = stoi(opt("--memcached-port", "0"));
+    if (mc_port > 0 && !memcached.start("0.0.0.0", mc_port, stoi(opt("--memcached-threads", "2")))) return 1;
+
+    // RESP (REDIS PROTOCOL) LISTENER
+    RespServer resp(engine);
+    int resp_port = stoi(opt("--resp-port", "0"));
+    if (resp_port > 0 && !resp.start("0.0.0.0", resp_port, stoi(opt("--resp-threads", "2")))) return 1;
+
+    Server svr;
+    g_svr = &svr;
+    // headers and body go out in separate writes; without this every
+    // keep-alive request waits for the client's delayed ACK (~40 ms)
+    svr.set_tcp_nodelay(true);
+    int keep_alive_max = stoi(opt("--keep-alive-max", "100"));
+    svr.set_keep_alive_max_count(keep_alive_max);
+    register_routes(svr, engine);
+    svr.Get("/repl", [&](const Request&, Response& res) {
+        if (primary) res.set_content(primary->status(), "text/plain");
+        else if (follower) res.set_content(follower->status(), "text/plain");
+        else if (raft) res.set_content(raft->status(), "text/plain");
+        else res.set_content("role=none\n", "text/plain");
+    });
+    svr.Get("/bus", [&](const Request&, Response& res) {
+        res.set_content(bus ? bus->status() : "off\n", "text/plain");
+    });
+    svr.Get("/cdc", [&](const Request&, Response& res) {
+        res.set_content(feed ? feed->status() : "off\n", "text/plain");
+    });
+    svr.Get("/tiers", [&](const Request&, Response& res) {
+        res.set_content(engine.tier_status(), "text/plain");
+    });
+    // /dict/train?samples=2000&bytes=16384: new dictionary from a sample of
+    // the stored values; new values use it, old ones keep theirs
+    svr.Get("/dict/train", [&](const Request& req, Response& res) {
+        if (!engine.codec().dict_enabled()) {
+            res.status = 400;
+            res.set_content("start with --dict-min-bytes\n", "text/plain");
+            return;
+        }
+        size_t samples = req.has_param("samples") ? strtoul(req.get_param_value("samples").c_str(), NULL, 10) : 2000;
+        size_t bytes = req.has_param("bytes") ? strtoul(req.get_param_value("bytes").c_str(), NULL, 10) : 16384;
+        string report;
+        if (!engine.train_dict(samples, min<size_t>(bytes, 32768), report)) res.status = 500;
+        res.set_content(report, "text/plain");
+    });
+    svr.Get("/hot", [&](const Request&, Response& res) {
+        res.set_content(fast_port > 0 ? hot.status() : "off\n", "text/plain");
+    });
+    svr.Get("/coalesce", [&](const Request&, Response& res) {
+        res.set_content(engine.coalescer().status(), "text/plain");
+    });
+
+    // UNIX SOCKET LISTENER: same routes, no TCP loopback for same-host clients
+    Server unix_svr;
+    thread unix_thread;
+    string unix_path = opt("--unix-socket", "");
+    if (!unix_path.empty()) {
+        unlink(unix_path.c_str());  // left over from an unclean exit
+        unix_svr.set_address_family(AF_UNIX);
+        unix_svr.set_keep_alive_max_count(keep_alive_max);
+        register_routes(unix_svr, engine);
+        if (!unix_svr.bind_to_port(unix_path, 80)) {
+            fprintf(stderr, "cannot bind unix socket %s\n", unix_path.c_str());
+            return 1;
+        }
+        unix_thread = thread([&] { unix_svr.listen_after_bind(); });
+    }
+
+    signal(SIGINT, [](int) { if (g_svr) g_svr->stop(); });
+    signal(SIGTERM, [](int) { if (g_svr) g_svr->stop(); });
+
+    svr.listen("0.0.0.0", stoi(opt("--port", "8080")));
 
-    svr.listen("0.0.0.0",8080);
+    if (unix_thread.joinable()) {
+        unix_svr.stop();
+        unix_thread.join();
+        unlink(unix_path.c_str());
+    }
 
-    mysql_close(conn);
+    fast_get.stop();
+    resp.stop();
+    memcached.stop();
+    if (follower) follower->stop();
+    if (primary) primary->stop();
+    if (raft) raft->stop();
+    if (bus) bus->stop();
+    if (feed) feed->stop();
+    watches.stop();
+    engine.stop();
+    shm.close();
+    running = false;
+    if (syncer.joinable()) syncer.join();
+    storage.reset();
+    if (conn) mysql_close(conn);
+    if (cdc_conn) mysql_close(cdc_conn);
 }
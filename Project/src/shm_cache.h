@@ -0,0 +1,184 @@
+#ifndef KV_SHM_CACHE_H
+#define KV_SHM_CACHE_H
+
+#include "kv_shm.h"
+#include "kv_engine.h"
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+// Writer side of kv_shm.h. Keys are published when they are read through
+// the engine (every kPublishEvery-th read of unpublished keys sharing a
+// counter bucket, so the segment holds what is hot and a cold read doesn't
+// pay for a second lookup) and kept in step with writes: every change
+// re-reads the key from the engine under one mutex, so the last publish
+// for a key always sees its latest value. That includes changes storage only gets later (on_dirty:
+// coalesced and write-back sets, relaxed increments, new expiries). When the
+// engine clears its whole cache (on_flush) everything is unpublished. Keys
+// longer than key_max or values longer than value_max are not published.
+class ShmCache {
+public:
+    explicit ShmCache(KvEngine& engine) : engine_(engine) {}
+    ~ShmCache() { close(); }
+
+    bool open(const std::string& name, uint32_t slots, uint32_t value_max) {
+        uint32_t n = 1;
+        while (n < slots) n <<= 1;
+        size_t slot_size = kv_shm_slot_size(kKeyMax, value_max);
+        size_ = sizeof(kv_shm_header) + (size_t)n * slot_size;
+
+        shm_unlink(name.c_str());  // readers of an old segment see `closed`
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            perror("shm_open");
+            return false;
+        }
+        void* p = MAP_FAILED;
+        if (ftruncate(fd, (off_t)size_) == 0) p = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            perror("shm mmap");
+            shm_unlink(name.c_str());
+            return false;
+        }
+
+        base_ = (kv_shm_header*)p;
+        base_->slots = n;
+        base_->slot_size = (uint32_t)slot_size;
+        base_->key_max = kKeyMax;
+        base_->value_max = value_max;
+        base_->probes = 8;
+        base_->writer_pid = (uint64_t)getpid();
+        __atomic_store_n(&base_->closed, 0, __ATOMIC_RELEASE);
+        memcpy(base_->magic, KV_SHM_MAGIC, 8);
+        name_ = name;
+
+        auto changed = [this](const std::string& key) {
+            if (!refreshing()) refresh(key, false);  // nested: a key expiring inside refresh()
+        };
+        engine_.on_change(changed);
+        engine_.on_dirty(changed);
+        engine_.on_read([this](const std::string& key, const std::string& value, uint64_t ver) {
+            if (refreshing() || value.size() > base_->value_max) return;
+            if (published(key, ver) || !counted(key)) return;
+            refresh(key, true);
+        });
+        engine_.on_flush([this] { unpublish_all(); });
+        return true;
+    }
+
+    // Marks the segment closed for readers that still map it, then removes it.
+    // Call after the front ends and the engine have stopped.
+    void close() {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (!base_) return;
+        __atomic_store_n(&base_->closed, 1, __ATOMIC_RELEASE);
+        munmap(base_, size_);
+        shm_unlink(name_.c_str());
+        base_ = NULL;
+    }
+
+private:
+    static const uint32_t kKeyMax = 255;  // kv_store.k is VARBINARY(255)
+    static const uint32_t kPublishEvery = 16;
+    static const size_t kCounters = 4096;
+
+    // refresh() reads through the engine, which calls the hooks again.
+    static bool& refreshing() {
+        thread_local bool flag = false;
+        return flag;
+    }
+
+    // One more read of unpublished `key`; true when its bucket is due.
+    bool counted(const std::string& key) {
+        std::atomic<uint32_t>& n = reads_[kv_shm_hash(key.data(), key.size()) % kCounters];
+        return n.fetch_add(1, std::memory_order_relaxed) % kPublishEvery == kPublishEvery - 1;
+    }
+
+    // Lock-free peek, same as a reader would do.
+    bool published(const std::string& key, uint64_t ver) {
+        kv_shm_header* h = base_;
+        if (!h || key.size() > kKeyMax) return true;  // nothing to do
+        uint64_t hash = kv_shm_hash(key.data(), key.size());
+        for (uint32_t p = 0; p < h->probes; ++p) {
+            kv_shm_slot* s = kv_shm_slot_at(h, (uint32_t)(hash + p) & (h->slots - 1));
+            if (__atomic_load_n(&s->hash, __ATOMIC_RELAXED) == hash &&
+                __atomic_load_n(&s->version, __ATOMIC_RELAXED) == ver) return true;
+        }
+        return false;
+    }
+
+    // Publishes the engine's current value of `key`, or drops it if gone.
+    // insert = false only updates keys that are already published.
+    void refresh(const std::string& key, bool insert) {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (!base_ || key.size() > kKeyMax) return;
+        uint64_t hash = kv_shm_hash(key.data(), key.size());
+        kv_shm_slot* slot = find(key, hash);
+        if (!slot && !insert) return;
+
+        std::string value;
+        uint64_t ver = 0;
+        refreshing() = true;
+        bool found = engine_.get(key, value, &ver);
+        refreshing() = false;
+        if (!found || value.size() > base_->value_max) {
+            if (slot) write(slot, 0, std::string(), 0);
+            return;
+        }
+        if (!slot) slot = victim(hash);
+        write(slot, hash, key, ver, value);
+    }
+
+    // The engine lost track of what changed: nothing published can be trusted.
+    void unpublish_all() {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (!base_) return;
+        for (uint32_t i = 0; i < base_->slots; ++i) {
+            kv_shm_slot* s = kv_shm_slot_at(base_, i);
+            if (s->hash) write(s, 0, std::string(), 0);
+        }
+    }
+
+    kv_shm_slot* find(const std::string& key, uint64_t hash) {
+        for (uint32_t p = 0; p < base_->probes; ++p) {
+            kv_shm_slot* s = kv_shm_slot_at(base_, (uint32_t)(hash + p) & (base_->slots - 1));
+            if (s->hash == hash && s->klen == key.size() && memcmp(s + 1, key.data(), key.size()) == 0) return s;
+        }
+        return NULL;
+    }
+
+    // First empty slot in the probe window, else a rotating victim.
+    kv_shm_slot* victim(uint64_t hash) {
+        for (uint32_t p = 0; p < base_->probes; ++p) {
+            kv_shm_slot* s = kv_shm_slot_at(base_, (uint32_t)(hash + p) & (base_->slots - 1));
+            if (s->hash == 0) return s;
+        }
+        return kv_shm_slot_at(base_, (uint32_t)(hash + next_victim_++ % base_->probes) & (base_->slots - 1));
+    }
+
+    void write(kv_shm_slot* s, uint64_t hash, const std::string& key, uint64_t ver, const std::string& value = "") {
+        uint64_t seq = s->seq;
+        __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        char* data = (char*)(s + 1);
+        memcpy(data, key.data(), key.size());
+        memcpy(data + base_->key_max, value.data(), value.size());
+        __atomic_store_n(&s->hash, hash, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->klen, (uint32_t)key.size(), __ATOMIC_RELAXED);
+        __atomic_store_n(&s->vlen, (uint32_t)value.size(), __ATOMIC_RELAXED);
+        __atomic_store_n(&s->version, ver, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+    }
+
+    KvEngine& engine_;
+    std::mutex mu_;
+    kv_shm_header* base_ = NULL;
+    size_t size_ = 0;
+    std::string name_;
+    uint32_t next_victim_ = 0;
+    std::atomic<uint32_t> reads_[kCounters] = {};
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef KV_STORAGE_H
+#define KV_STORAGE_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Counter values are plain decimal integers ("-12"), the whole value: a
+// compressed value, JSON or a leading NUL is not a number to add to.
+inline bool parse_counter(const std::string& s, long long& n) {
+    size_t digits = s.size() > 0 && s[0] == '-' ? 1 : 0;
+    if (digits == s.size()) return false;
+    for (size_t i = digits; i < s.size(); ++i)
+        if (s[i] < '0' || s[i] > '9') return false;
+    errno = 0;
+    n = strtoll(s.c_str(), NULL, 10);
+    return errno == 0;  // ERANGE
+}
+
+// Backend behind the HTTP handlers. MySQL (mysql_storage.h) is the default,
+// MmapStore (mmap_store.h) is the embedded file-backed one.
+//
+// Every key carries a version that starts at 1 and goes up by one on each
+// write; version 0 means "does not exist".
+class Storage {
+public:
+    virtual ~Storage() {}
+
+    virtual bool get(const std::string& key, std::string& value, uint64_t* version = nullptr) = 0;
+    // Returns the new version.
+    virtual uint64_t put(const std::string& key, const std::string& value) = 0;
+
+    // Several puts; versions[i] is what put() returned for items[i] (0 =
+    // failed). Backends that can commit them together override it.
+    virtual void put_batch(const std::vector<std::pair<std::string, std::string>>& items,
+                           std::vector<uint64_t>& versions) {
+        versions.clear();
+        for (auto& kv : items) versions.push_back(put(kv.first, kv.second));
+    }
+    virtual bool remove(const std::string& key) = 0;
+
+    // Adds delta to the integer stored at key (missing key = 0) in one step.
+    // False if the current value is not an integer (parse_counter) or the sum
+    // does not fit in a long long.
+    virtual bool incr(const std::string& key, long long delta, long long& result) = 0;
+
+    // Writes value only if the key is still at expected_version (0 = must not
+    // exist). Either way `version` ends up holding the key's current version.
+    virtual bool cas(const std::string& key, uint64_t expected_version, const std::string& value,
+                     uint64_t& version) = 0;
+
+    // Up to `limit` pairs with start <= key < end in key order (empty end =
+    // no upper bound). Callers page by restarting just past the last key.
+    virtual void scan(const std::string& start, const std::string& end, size_t limit,
+                      std::vector<std::pair<std::string, std::string>>& out) = 0;
+};
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef KV_VALUE_CODEC_H
+#define KV_VALUE_CODEC_H
+
+#include <zlib.h>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// How values are kept in the cache and in storage (--compress-min-bytes).
+// A value of at least min_bytes is gzip'ed (zlib, fast level) and kept
+// only if that saves an eighth; it is then stored as
+//
+//   "\0KVZ" | gzip member
+//
+// so the bytes after the header can be sent as they are to a client that
+// accepts Content-Encoding: gzip. A value that happens to start with "\0KV"
+// is stored behind "\0KVR" (raw) so it can't be mistaken for a header.
+// Anything else is stored unchanged, so old rows still read back and
+// decode() works whether or not compression is on.
+//
+// Smaller values (dict_min_bytes up to min_bytes) hardly compress alone;
+// with a trained dictionary (dict_trainer.h, use_dict()) they are stored as
+//
+//   "\0KVD" | u32 dictionary id | raw deflate with that preset dictionary
+//
+// Every dictionary ever used stays decodable: ids only go up, and one that
+// is not in memory is fetched through the loader on first use.
+class ValueCodec {
+public:
+    using DictLoader = std::function<bool(uint32_t id, std::string& dict)>;
+
+    void configure(size_t min_bytes, int level) {
+        min_bytes_ = min_bytes;
+        level_ = level;
+    }
+
+    // Before any traffic. 0 = no dictionary compression.
+    void configure_dict(size_t dict_min_bytes, DictLoader loader) {
+        dict_min_bytes_ = dict_min_bytes;
+        loader_ = std::move(loader);
+    }
+
+    bool enabled() const { return min_bytes_ > 0 || dict_min_bytes_ > 0; }
+    bool dict_enabled() const { return dict_min_bytes_ > 0; }
+
+    // New values use this dictionary from now on.
+    void use_dict(uint32_t id, const std::string& dict) {
+        std::lock_guard<std::mutex> lock(dict_mu_);
+        dicts_[id] = std::make_shared<const std::string>(dict);
+        current_id_ = id;
+    }
+
+    uint32_t dict_id() {
+        std::lock_guard<std::mutex> lock(dict_mu_);
+        return current_id_;
+    }
+
+    std::string encode(const std::string& value) {
+        values_++;
+        raw_total_ += value.size();
+        std::string out = compress(value);
+        stored_total_ += out.size();
+        return out;
+    }
+
+    // The stored form is the value itself (decode() would copy it as is).
+    static bool is_plain(const std::string& stored) {
+        return stored.size() < 4 || stored.compare(0, 3, std::string("\0KV", 3)) != 0 ||
+               (stored[3] != 'R' && stored[3] != 'D' && stored[3] != 'Z');
+    }
+
+    static bool is_gzip(const std::string& stored) { return stored.compare(0, 4, std::string("\0KVZ", 4)) == 0; }
+
+    // The gzip member of a stored value that is_gzip().
+    static std::string gzip_body(const std::string& stored) { return stored.substr(4); }
+
+    // False only for a damaged compressed value (or a lost dictionary).
+    bool decode(const std::string& stored, std::string& value) {
+        if (stored.size() < 4 || stored.compare(0, 3, std::string("\0KV", 3)) != 0) {
+            value = stored;
+            return true;
+        }
+        if (stored[3] == 'R') {
+            value.assign(stored, 4, std::string::npos);
+            return true;
+        }
+        if (stored[3] == 'D' && stored.size() >= 8) {
+            uint32_t id;
+            memcpy(&id, stored.data() + 4, 4);
+            std::shared_ptr<const std::string> dict = dictionary(id);
+            return dict && inflate_dict(stored.data() + 8, stored.size() - 8, *dict, value);
+        }
+        if (stored[3] != 'Z') {
+            value = stored;
+            return true;
+        }
+        return gunzip(stored.data() + 4, stored.size() - 4, value);
+    }
+
+    // In place; a damaged value becomes empty.
+    void decode_in_place(std::string& value) {
+        if (value.size() < 4 || value[0] != '\0') return;
+        std::string out;
+        if (!decode(value, out)) out.clear();
+        value.swap(out);
+    }
+
+    // Every value written since start: how many, bytes given, bytes stored.
+    uint64_t values() const { return values_; }
+    uint64_t gzipped() const { return gzipped_; }
+    uint64_t dict_coded() const { return dict_coded_; }
+    uint64_t raw_bytes() const { return raw_total_; }
+    uint64_t stored_bytes() const { return stored_total_; }
+
+private:
+    std::string compress(const std::string& value) {
+        if (min_bytes_ && value.size() >= min_bytes_) {
+            std::string out("\0KVZ", 4);
+            if (gzip(value, out) && out.size() < value.size() - value.size() / 8) {
+                gzipped_++;
+                return out;
+            }
+        } else if (dict_min_bytes_ && value.size() >= dict_min_bytes_) {
+            std::shared_ptr<const std::string> dict;
+            uint32_t id;
+            {
+                std::lock_guard<std::mutex> lock(dict_mu_);
+                id = current_id_;
+                if (id) dict = dicts_[id];
+            }
+            std::string out("\0KVD", 4);
+            out.append((const char*)&id, 4);
+            if (dict && deflate_dict(value, id, *dict, out) && out.size() < value.size() - value.size() / 8) {
+                dict_coded_++;
+                return out;
+            }
+        }
+        if (value.compare(0, 3, std::string("\0KV", 3)) == 0) return std::string("\0KVR", 4) + value;
+        return value;
+    }
+
+    std::shared_ptr<const std::string> dictionary(uint32_t id) {
+        {
+            std::lock_guard<std::mutex> lock(dict_mu_);
+            auto it = dicts_.find(id);
+            if (it != dicts_.end()) return it->second;
+        }
+        std::string dict;
+        if (!loader_ || !loader_(id, dict)) return nullptr;
+        std::lock_guard<std::mutex> lock(dict_mu_);
+        auto& slot = dicts_[id];
+        if (!slot) slot = std::make_shared<const std::string>(dict);
+        return slot;
+    }
+
+    // deflateSetDictionary hashes the whole dictionary (~45 us for 16 KB),
+    // more than compressing a small value costs. So each thread keeps a
+    // stream primed with the current dictionary and compresses every value
+    // with a deflateCopy() of it. The copy (~140 KB: window, hash chains,
+    // memLevel 4 so the hash table is small) lives in a per-thread arena;
+    // fresh malloc'ed memory each time would page fault on every value.
+    struct Arena {
+        char buf[160 << 10];
+        size_t used = 0;
+        static voidpf alloc(voidpf self, uInt items, uInt size) {
+            Arena* a = (Arena*)self;
+            size_t n = ((size_t)items * size + 15) & ~(size_t)15;
+            if (a->used + n > sizeof(a->buf)) return Z_NULL;
+            a->used += n;
+            return a->buf + a->used - n;
+        }
+        static void release(voidpf, voidpf) {}
+    };
+
+    bool deflate_dict(const std::string& in, uint32_t id, const std::string& dict, std::string& out) {
+        struct Primed {
+            z_stream z;
+            uint32_t id = 0;
+            int level = 0;
+            std::unique_ptr<Arena> arena{new Arena};
+            ~Primed() { if (id) deflateEnd(&z); }
+        };
+        thread_local Primed primed;
+        if (primed.id != id || primed.level != level_) {
+            if (primed.id) deflateEnd(&primed.z);
+            primed.id = 0;
+            memset(&primed.z, 0, sizeof(primed.z));
+            if (deflateInit2(&primed.z, level_, Z_DEFLATED, -15, 4, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+            if (deflateSetDictionary(&primed.z, (const Bytef*)dict.data(), (uInt)dict.size()) != Z_OK) {
+                deflateEnd(&primed.z);
+                return false;
+            }
+            primed.id = id;
+            primed.level = level_;
+        }
+        // the copy allocates through the source's allocator: point it at the arena
+        z_stream& src = primed.z;
+        alloc_func own_alloc = src.zalloc;
+        free_func own_free = src.zfree;
+        voidpf own_opaque = src.opaque;
+        primed.arena->used = 0;
+        src.zalloc = Arena::alloc;
+        src.zfree = Arena::release;
+        src.opaque = primed.arena.get();
+        z_stream z;
+        int copied = deflateCopy(&z, &src);
+        src.zalloc = own_alloc;
+        src.zfree = own_free;
+        src.opaque = own_opaque;
+        if (copied != Z_OK) return false;
+        size_t head = out.size();
+        out.resize(head + deflateBound(&z, in.size()) + 16);
+        z.next_in = (Bytef*)in.data();
+        z.avail_in = (uInt)in.size();
+        z.next_out = (Bytef*)&out[head];
+        z.avail_out = (uInt)(out.size() - head);
+        int rc = deflate(&z, Z_FINISH);
+        out.resize(head + (z.next_out - (Bytef*)&out[head]));
+        deflateEnd(&z);
+        return rc == Z_STREAM_END;
+    }
+
+    // One inflate stream per thread, reset for every value (no 32 KB
+    // window allocation per read).
+    static bool inflate_dict(const char* data, size_t n, const std::string& dict, std::string& out) {
+        struct Stream {
+            z_stream z;
+            bool ready = false;
+            ~Stream() { if (ready) inflateEnd(&z); }
+        };
+        thread_local Stream st;
+        if (!st.ready) {
+            memset(&st.z, 0, sizeof(st.z));
+            if (inflateInit2(&st.z, -15) != Z_OK) return false;
+            st.ready = true;
+        } else if (inflateReset(&st.z) != Z_OK) {
+            return false;
+        }
+        z_stream& z = st.z;
+        // raw deflate takes the dictionary up front
+        if (inflateSetDictionary(&z, (const Bytef*)dict.data(), (uInt)dict.size()) != Z_OK) return false;
+        out.resize(n * 4 + 64);
+        z.next_in = (Bytef*)data;
+        z.avail_in = (uInt)n;
+        int rc = Z_OK;
+        while (rc == Z_OK) {
+            if (z.total_out == out.size()) out.resize(out.size() * 2);
+            z.next_out = (Bytef*)&out[z.total_out];
+            z.avail_out = (uInt)(out.size() - z.total_out);
+            rc = inflate(&z, Z_NO_FLUSH);
+        }
+        out.resize(z.total_out);
+        return rc == Z_STREAM_END;
+    }
+
+    bool gzip(const std::string& in, std::string& out) {
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        // 15 + 16: gzip wrapper, so the body is a valid Content-Encoding: gzip
+        if (deflateInit2(&z, level_, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+        size_t head = out.size();
+        out.resize(head + deflateBound(&z, in.size()) + 32);
+        z.next_in = (Bytef*)in.data();
+        z.avail_in = (uInt)in.size();
+        z.next_out = (Bytef*)&out[head];
+        z.avail_out = (uInt)(out.size() - head);
+        int rc = deflate(&z, Z_FINISH);
+        out.resize(head + z.total_out);
+        deflateEnd(&z);
+        return rc == Z_STREAM_END;
+    }
+
+    static bool gunzip(const char* data, size_t n, std::string& out) {
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        if (inflateInit2(&z, 15 + 16) != Z_OK) return false;
+        // the gzip trailer ends with the raw length (mod 2^32)
+        uint32_t raw = 0;
+        if (n >= 4) memcpy(&raw, data + n - 4, 4);
+        if (raw > n * 1032) raw = 0;  // more than deflate can do: damaged
+        out.resize(raw ? raw : n * 4);
+        z.next_in = (Bytef*)data;
+        z.avail_in = (uInt)n;
+        int rc = Z_OK;
+        while (rc == Z_OK) {
+            if (z.total_out == out.size()) out.resize(out.size() * 2 + 64);
+            z.next_out = (Bytef*)&out[z.total_out];
+            z.avail_out = (uInt)(out.size() - z.total_out);
+            rc = inflate(&z, Z_NO_FLUSH);
+        }
+        out.resize(z.total_out);
+        inflateEnd(&z);
+        return rc == Z_STREAM_END;
+    }
+
+    size_t min_bytes_ = 0, dict_min_bytes_ = 0;
+    int level_ = 1;
+    DictLoader loader_;
+    std::mutex dict_mu_;
+    std::unordered_map<uint32_t, std::shared_ptr<const std::string>> dicts_;
+    uint32_t current_id_ = 0;  // 0 = none yet
+    std::atomic<uint64_t> values_{0}, gzipped_{0}, dict_coded_{0}, raw_total_{0}, stored_total_{0};
+};
+
+#endif
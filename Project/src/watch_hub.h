@@ -0,0 +1,319 @@
+#ifndef KV_WATCH_HUB_H
+#define KV_WATCH_HUB_H
+
+#include "httplib.h"
+#include "event_loop.h"
+#include "kv_engine.h"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Long-poll listener for
+//   GET /watch?key=K[&since_version=V][&timeout=S]
+//   GET /watch?prefix=P[&timeout=S]
+// A key watch answers right away if K is no longer at version V, otherwise
+// the connection is parked until a write to K (or any key under P) or until
+// the timeout (304). Parked connections cost a map entry on the EventLoop
+// thread, never an httplib worker; values are read on a small worker pool
+// (a read may go to storage) and the answers posted back to the loop.
+//
+// Answer: X-Key (url-encoded), X-Version (0 = deleted) and the value
+// (NOT_FOUND if deleted) as the body.
+//
+//   GET /invalidations[?since=SEQ][&timeout=S]
+// Stream of changed keys for client near caches. Every write gets a
+// sequence number; the answer lists the url-encoded keys written after
+// SEQ, one per line, and X-Seq to pass as since= next time. Without since=
+// it only returns the current X-Seq. If SEQ fell out of the last kLogMax
+// writes (or the server restarted) the body is FLUSH: drop everything.
+class WatchHub {
+public:
+    explicit WatchHub(KvEngine& engine) : engine_(engine) {
+        loop_.on_data([this](EventLoop::Conn& c) { on_request(c); });
+        loop_.on_close([this](EventLoop::Conn& c) { drop(c.id); });
+        loop_.every(100, [this] { expire(); });
+    }
+
+    ~WatchHub() { stop(); }
+
+    bool start(const std::string& host, int port) {
+        if (!loop_.listen_tcp(host, port)) return false;
+        reads_.reset(new httplib::ThreadPool(kReaders));
+        thread_ = std::thread([this] { loop_.run(); });
+        return true;
+    }
+
+    void stop() {
+        if (!thread_.joinable()) return;
+        loop_.stop();
+        thread_.join();
+        reads_->shutdown();
+        reads_.reset();
+    }
+
+    // Call after a write to `key` completed. Cheap when nobody watches: a
+    // request parks itself (watching_ > 0) before it looks at the version
+    // or the log, so a write it did not see is always posted here.
+    void notify(const std::string& key) {
+        {
+            std::lock_guard<std::mutex> lock(log_mu_);
+            log_.push_back(key);
+            if (log_.size() > kLogMax) log_.pop_front();
+            log_seq_++;
+        }
+        if (watching_ == 0) return;
+        loop_.post([this, key] { fire(key); });
+    }
+
+    // Call after the engine dropped its whole cache (invalidate_all): near
+    // caches get FLUSH and parked key watches look at their key again.
+    // Prefix watches are not told.
+    void flush() {
+        {
+            std::lock_guard<std::mutex> lock(log_mu_);
+            log_.clear();  // every since= is now too old
+            log_seq_++;
+        }
+        if (watching_ == 0) return;
+        loop_.post([this] {
+            wake_invalidations();
+            for (auto& kv : by_key_) lookup(kv.first, 0);
+        });
+    }
+
+    size_t watching() const { return watching_; }
+
+private:
+    static const size_t kLogMax = 65536;
+    static const size_t kReaders = 2;
+
+    struct Waiter {
+        std::string key;   // or prefix
+        bool prefix;
+        bool invalidations;
+        bool versioned;    // since_version given: answer only once it moved
+        uint64_t since;
+        int64_t deadline;  // steady clock ms
+        bool keep_alive;
+    };
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Loop thread from here on.
+
+    void on_request(EventLoop::Conn& c) {
+        if (waiters_.count(c.id)) return;  // already parked, ignore extra bytes
+        size_t end = c.in.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            if (c.in.size() > 16384) reply(c, 431, "", 0, "header too large", false);
+            return;
+        }
+        std::string head = c.in.substr(0, end);
+        c.in.erase(0, end + 4);
+
+        bool keep_alive = head.find("HTTP/1.1") != std::string::npos &&
+                          head.find("Connection: close") == std::string::npos &&
+                          head.find("connection: close") == std::string::npos;
+
+        size_t sp1 = head.find(' '), sp2 = head.find(' ', sp1 + 1);
+        std::string target = sp1 == std::string::npos ? "" : head.substr(sp1 + 1, sp2 - sp1 - 1);
+        size_t q = target.find('?');
+        std::string path = target.substr(0, q);
+        httplib::Params params;
+        if (q != std::string::npos) httplib::detail::parse_query_text(target.substr(q + 1), params);
+
+        if (head.compare(0, 4, "GET ") != 0 || (path != "/watch" && path != "/invalidations")) {
+            reply(c, 404, "", 0, "NOT_FOUND", keep_alive);
+            return;
+        }
+
+        auto param = [&](const char* name) {
+            auto it = params.find(name);
+            return it == params.end() ? std::string() : it->second;
+        };
+
+        Waiter w;
+        w.invalidations = path == "/invalidations";
+        w.prefix = !w.invalidations && params.count("prefix") > 0;
+        w.key = w.prefix ? param("prefix") : param("key");
+        w.versioned = !w.prefix && params.count("since_version") > 0;
+        w.since = strtoull(param("since_version").c_str(), NULL, 10);
+        long timeout = params.count("timeout") ? strtol(param("timeout").c_str(), NULL, 10) : 30;
+        if (timeout < 0) timeout = 0;
+        if (timeout > 300) timeout = 300;
+        w.deadline = now_ms() + timeout * 1000;
+        w.keep_alive = keep_alive;
+
+        if (w.invalidations) {
+            if (!params.count("since")) {
+                send_invalidations(c, log_seq(), keep_alive, true);
+                return;
+            }
+            w.since = strtoull(param("since").c_str(), NULL, 10);
+            park(c.id, w);
+            if (send_invalidations(c, w.since, keep_alive, false)) drop(c.id);
+            return;
+        }
+
+        park(c.id, w);
+        if (w.versioned) lookup(w.key, c.id);
+    }
+
+    void park(uint64_t id, const Waiter& w) {
+        if (w.invalidations) inval_ids_.push_back(id);
+        else if (w.prefix) prefix_ids_.push_back(id);
+        else by_key_[w.key].push_back(id);
+        waiters_[id] = w;
+        watching_ = waiters_.size();
+    }
+
+    void fire(const std::string& key) {
+        wake_invalidations();
+        if (!waiting_on(key).empty()) lookup(key, 0);
+    }
+
+    void wake_invalidations() {
+        std::vector<uint64_t> parked;
+        parked.swap(inval_ids_);
+        for (uint64_t id : parked) {
+            EventLoop::Conn* c = loop_.find(id);
+            Waiter w = waiters_[id];
+            waiters_.erase(id);
+            if (c) send_invalidations(*c, w.since, w.keep_alive, true);
+        }
+        watching_ = waiters_.size();
+    }
+
+    // Key and prefix waiters a write to `key` concerns.
+    std::vector<uint64_t> waiting_on(const std::string& key) {
+        std::vector<uint64_t> hit;
+        auto it = by_key_.find(key);
+        if (it != by_key_.end()) hit = it->second;
+        for (uint64_t id : prefix_ids_) {
+            const std::string& p = waiters_[id].key;
+            if (key.compare(0, p.size(), p) == 0) hit.push_back(id);
+        }
+        return hit;
+    }
+
+    // Reads `key` on the worker pool, then answers on the loop: waiter
+    // `only`, or (0) everyone waiting_on(key) by then.
+    void lookup(const std::string& key, uint64_t only) {
+        reads_->enqueue([this, key, only] {
+            auto value = std::make_shared<std::string>();
+            uint64_t ver = 0;
+            if (!engine_.get(key, *value, &ver)) *value = "NOT_FOUND";
+            loop_.post([this, key, only, ver, value] { answer(key, only, ver, *value); });
+        });
+    }
+
+    void answer(const std::string& key, uint64_t only, uint64_t ver, const std::string& value) {
+        std::vector<uint64_t> hit = only ? std::vector<uint64_t>{only} : waiting_on(key);
+        for (uint64_t id : hit) {
+            auto it = waiters_.find(id);
+            if (it == waiters_.end()) continue;  // answered or gone meanwhile
+            if (it->second.versioned && it->second.since == ver) continue;  // not moved yet
+            bool keep_alive = it->second.keep_alive;
+            drop(id);
+            if (EventLoop::Conn* c = loop_.find(id)) reply(*c, 200, key, ver, value, keep_alive);
+        }
+    }
+
+    void expire() {
+        int64_t now = now_ms();
+        std::vector<uint64_t> late;
+        for (auto& kv : waiters_) if (kv.second.deadline <= now) late.push_back(kv.first);
+        for (uint64_t id : late) {
+            Waiter w = waiters_[id];
+            drop(id);
+            EventLoop::Conn* c = loop_.find(id);
+            if (c && w.invalidations) send_invalidations(*c, w.since, w.keep_alive, true);
+            else if (c) reply(*c, 304, w.prefix ? "" : w.key, w.since, "", w.keep_alive);
+        }
+    }
+
+    void drop(uint64_t id) {
+        auto it = waiters_.find(id);
+        if (it == waiters_.end()) return;
+        if (it->second.invalidations) {
+            inval_ids_.erase(std::remove(inval_ids_.begin(), inval_ids_.end(), id), inval_ids_.end());
+        } else if (it->second.prefix) {
+            prefix_ids_.erase(std::remove(prefix_ids_.begin(), prefix_ids_.end(), id), prefix_ids_.end());
+        } else {
+            auto k = by_key_.find(it->second.key);
+            if (k != by_key_.end()) {
+                k->second.erase(std::remove(k->second.begin(), k->second.end(), id), k->second.end());
+                if (k->second.empty()) by_key_.erase(k);
+            }
+        }
+        waiters_.erase(it);
+        watching_ = waiters_.size();
+    }
+
+    uint64_t log_seq() {
+        std::lock_guard<std::mutex> lock(log_mu_);
+        return log_seq_;
+    }
+
+    // Answers with the keys written after `since`. With force = false it
+    // sends nothing (and returns false) when there are none yet.
+    bool send_invalidations(EventLoop::Conn& c, uint64_t since, bool keep_alive, bool force) {
+        std::string body;
+        uint64_t seq;
+        {
+            std::lock_guard<std::mutex> lock(log_mu_);
+            seq = log_seq_;
+            if (since == seq && !force) return false;
+            if (since > seq || seq - since > log_.size()) body = "FLUSH\n";
+            else
+                for (size_t i = log_.size() - (size_t)(seq - since); i < log_.size(); ++i)
+                    body += httplib::detail::encode_query_param(log_[i]) + "\n";
+        }
+        std::string out = "HTTP/1.1 200 OK\r\nX-Seq: " + std::to_string(seq) +
+                          "\r\nContent-Type: text/plain\r\nContent-Length: " + std::to_string(body.size()) + "\r\n";
+        if (!keep_alive) out += "Connection: close\r\n";
+        out += "\r\n" + body;
+        c.close_after_write = !keep_alive;
+        loop_.send(c, out);
+        return true;
+    }
+
+    void reply(EventLoop::Conn& c, int status, const std::string& key, uint64_t ver,
+               const std::string& body, bool keep_alive) {
+        std::string out = "HTTP/1.1 " + std::to_string(status) + " " + httplib::detail::status_message(status) + "\r\n";
+        if (!key.empty()) out += "X-Key: " + httplib::detail::encode_url(key) + "\r\n";
+        if (status == 200 || status == 304) out += "X-Version: " + std::to_string(ver) + "\r\n";
+        if (status != 304) out += "Content-Type: text/plain\r\nContent-Length: " + std::to_string(body.size()) + "\r\n";
+        if (!keep_alive) out += "Connection: close\r\n";
+        out += "\r\n";
+        if (status != 304) out += body;
+        c.close_after_write = !keep_alive;
+        loop_.send(c, out);
+    }
+
+    KvEngine& engine_;
+    EventLoop loop_;
+    std::thread thread_;
+    std::unique_ptr<httplib::ThreadPool> reads_;
+    std::atomic<size_t> watching_{0};
+
+    std::unordered_map<uint64_t, Waiter> waiters_;  // by connection id
+    std::unordered_map<std::string, std::vector<uint64_t>> by_key_;
+    std::vector<uint64_t> prefix_ids_;
+    std::vector<uint64_t> inval_ids_;
+
+    // last kLogMax changed keys; log_seq_ counts every change ever
+    std::mutex log_mu_;
+    std::deque<std::string> log_;
+    uint64_t log_seq_ = 0;
+};
+
+#endif
@@ -0,0 +1,324 @@
+#ifndef KV_WRITE_COALESCER_H
+#define KV_WRITE_COALESCER_H
+
+#include "lru_cache.h"
+#include "storage.h"
+#include "write_journal.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Relaxed-durability sets (last writer wins). A set only replaces the key's
+// pending value in memory; every flush_ms a background thread writes the
+// latest value of each key, batch keys per Storage::put_batch(), so a key
+// set 50 times in a window costs one write. Without a journal pending
+// values are lost on a crash: flush_ms is the most that can be lost.
+//
+// Write-back (use_journal()): every set is appended to a WriteJournal
+// before it is acknowledged, and the sets a crash left in it are pending
+// again at the next start. A journal segment is deleted only after a flush
+// wrote everything in it; if storage fails the keys stay pending and the
+// next flush tries again.
+//
+// Readers see a pending value at once (pending()). A normal write to the
+// same key calls settle() first, which writes the pending value before it,
+// so storage ends up in the order the writes were accepted.
+//
+// Backpressure: with max_dirty set, a set that finds that many keys pending
+// or in flight waits until a flush has made room.
+class WriteCoalescer {
+public:
+    WriteCoalescer(Storage& storage, int flush_ms, size_t shards = 16)
+        : storage_(storage), flush_ms_(flush_ms), shards_(shards) {}
+
+    ~WriteCoalescer() { stop(); }
+
+    // Called with the written value and its version once a key reached
+    // storage, before it stops counting as pending.
+    void on_flushed(std::function<void(const std::string&, const std::string&, uint64_t)> fn) {
+        on_flushed_ = std::move(fn);
+    }
+
+    // Before start(). max_dirty 0 = no limit.
+    void limits(size_t max_dirty, size_t batch) {
+        max_dirty_ = max_dirty;
+        batch_ = batch ? batch : 1;
+    }
+
+    // Before start(): opens the journal and makes the sets it still holds
+    // pending again (the first flush writes them).
+    bool use_journal(WriteJournal* journal) {
+        std::unordered_map<std::string, std::string> left;
+        bool ok = journal->open([&](const std::string& key, const std::string& value, bool forget) {
+            if (forget) left.erase(key);
+            else left[key] = value;
+        });
+        if (!ok) return false;
+        for (auto& kv : left) shard(kv.first).values.emplace(kv.first, std::move(kv.second));
+        count_ += left.size();
+        journal_ = journal;
+        if (!left.empty()) fprintf(stderr, "write-back: %zu keys from the journal not written yet\n", left.size());
+        return true;
+    }
+
+    bool journaled() const { return journal_ != nullptr; }
+
+    void start() {
+        running_ = true;
+        flusher_ = std::thread([this] {
+            std::unique_lock<std::mutex> lock(wake_mu_);
+            while (running_) {
+                wake_.wait_for(lock, std::chrono::milliseconds(flush_ms_), [this] { return !running_ || urgent_; });
+                urgent_ = false;
+                lock.unlock();
+                flush();
+                lock.lock();
+            }
+        });
+    }
+
+    void stop() {
+        if (!running_.exchange(false)) return;
+        wake_.notify_all();
+        room_.notify_all();
+        if (flusher_.joinable()) flusher_.join();
+        flush();
+    }
+
+    // False only if the journal could not be written (the set did not happen).
+    bool set(const std::string& key, const std::string& value) {
+        if (max_dirty_ && count_ >= (int64_t)max_dirty_) wait_for_room();
+        std::unique_lock<std::mutex> order;
+        if (journal_) {
+            order = std::unique_lock<std::mutex>(order_mu_);
+            if (!journal_->append(key, value)) return false;
+        }
+        Shard& s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mu);
+        auto r = s.values.emplace(key, value);
+        if (r.second) count_++;
+        else {
+            r.first->second = value;
+            coalesced_++;
+        }
+        accepted_++;
+        return true;
+    }
+
+    // The value accepted but not yet in storage, if any.
+    bool pending(const std::string& key, std::string& value) {
+        if (count_ == 0) return false;
+        {
+            Shard& s = shard(key);
+            std::lock_guard<std::mutex> lock(s.mu);
+            auto it = s.values.find(key);
+            if (it != s.values.end()) {
+                value = it->second;
+                return true;
+            }
+        }
+        std::lock_guard<std::mutex> lock(inflight_mu_);
+        auto it = inflight_.find(key);
+        if (it == inflight_.end()) return false;
+        value = it->second;
+        return true;
+    }
+
+    // Writes the key's pending value now (before a normal write to it).
+    // With a journal, sets wait meanwhile: a forget record must follow the
+    // value's last record.
+    void settle(const std::string& key) {
+        std::string value;
+        if (!pending(key, value)) return;
+        std::lock_guard<std::mutex> one_flusher(flush_mu_);  // a running flush has finished its put
+        std::unique_lock<std::mutex> order;
+        if (journal_) order = std::unique_lock<std::mutex>(order_mu_);
+        Shard& s = shard(key);
+        {
+            std::lock_guard<std::mutex> in(inflight_mu_);
+            std::lock_guard<std::mutex> lock(s.mu);
+            auto it = s.values.find(key);
+            if (it == s.values.end()) return;
+            value = it->second;
+            inflight_[key].swap(it->second);
+            s.values.erase(it);
+        }
+        uint64_t version = storage_.put(key, value);
+        if (version) {
+            if (journal_) journal_->forget(key);
+            if (on_flushed_) on_flushed_(key, value, version);
+            flushed_++;
+        }
+        std::lock_guard<std::mutex> in(inflight_mu_);
+        inflight_.erase(key);
+        if (version) count_--;
+        else {
+            // storage failed: pending again unless a newer set came in
+            std::lock_guard<std::mutex> lock(s.mu);
+            if (!s.values.emplace(key, std::move(value)).second) count_--;
+        }
+    }
+
+    // Write the latest value of every key. Taken values stay in inflight_
+    // until storage has them, so pending() never loses them.
+    void flush() {
+        std::lock_guard<std::mutex> one_flusher(flush_mu_);
+        std::vector<std::pair<std::string, std::string>> taken;
+        uint64_t segment = 0;
+        {
+            std::unique_lock<std::mutex> order;
+            if (journal_) order = std::unique_lock<std::mutex>(order_mu_);
+            std::lock_guard<std::mutex> in(inflight_mu_);
+            for (Shard& s : shards_) {
+                std::unordered_map<std::string, std::string> part;
+                {
+                    std::lock_guard<std::mutex> lock(s.mu);
+                    part.swap(s.values);
+                }
+                for (auto& kv : part) {
+                    inflight_[kv.first] = kv.second;
+                    taken.emplace_back(kv.first, std::move(kv.second));
+                }
+            }
+            if (taken.empty()) return;
+            if (journal_) segment = journal_->roll();  // sets from now on go to the next segment
+        }
+        if (journal_) journal_->sync_rolled();  // sets go on meanwhile
+
+        std::vector<size_t> failed;
+        std::vector<uint64_t> versions;
+        for (size_t i = 0; i < taken.size(); i += batch_) {
+            size_t n = std::min(batch_, taken.size() - i);
+            std::vector<std::pair<std::string, std::string>> chunk(taken.begin() + i, taken.begin() + i + n);
+            storage_.put_batch(chunk, versions);
+            for (size_t j = 0; j < n; ++j) {
+                if (!versions[j]) {
+                    failed.push_back(i + j);
+                    continue;
+                }
+                if (on_flushed_) on_flushed_(chunk[j].first, chunk[j].second, versions[j]);
+                flushed_++;
+            }
+        }
+        if (!failed.empty() != failing_) {
+            failing_ = !failed.empty();
+            if (failing_) fprintf(stderr, "write-back: storage failed for %zu keys, they stay pending\n", failed.size());
+            else fprintf(stderr, "write-back: storage writes work again\n");
+        }
+        if (failing_) failures_++;
+        // the segment also holds the keys that did get written: keep them
+        // pending too until it can go, or a crash would replay them over
+        // later normal writes
+        bool keep_all = journal_ && !failed.empty();
+        if (journal_ && !keep_all) {
+            if (segment) journal_->drop_through(segment);
+            else forget_written(taken);
+        }
+
+        std::lock_guard<std::mutex> in(inflight_mu_);
+        size_t next_failed = 0;
+        for (size_t i = 0; i < taken.size(); ++i) {
+            bool keep = keep_all;
+            if (next_failed < failed.size() && failed[next_failed] == i) {
+                keep = true;
+                next_failed++;
+            }
+            inflight_.erase(taken[i].first);
+            if (!keep) {
+                count_--;
+                continue;
+            }
+            Shard& s = shard(taken[i].first);
+            std::lock_guard<std::mutex> lock(s.mu);
+            if (!s.values.emplace(std::move(taken[i].first), std::move(taken[i].second)).second) count_--;
+        }
+        std::lock_guard<std::mutex> lock(room_mu_);
+        room_.notify_all();
+    }
+
+    std::string status() {
+        std::string out = "accepted=" + std::to_string(accepted_) + " coalesced=" + std::to_string(coalesced_) +
+                          " flushed=" + std::to_string(flushed_) + " dirty=" + std::to_string(count_) +
+                          " stalls=" + std::to_string(stalls_) + " failed_flushes=" + std::to_string(failures_);
+        if (journal_)
+            out += " journal_segments=" + std::to_string(journal_->segments()) +
+                   " journal_bytes=" + std::to_string(journal_->bytes()) +
+                   " replayed=" + std::to_string(journal_->replayed());
+        return out + "\n";
+    }
+
+    uint64_t accepted() const { return accepted_; }
+    uint64_t coalesced() const { return coalesced_; }  // sets that replaced a pending value
+    uint64_t flushed() const { return flushed_; }      // storage writes
+
+private:
+    struct Shard {
+        std::mutex mu;
+        std::unordered_map<std::string, std::string> values;
+    };
+
+    Shard& shard(const std::string& key) { return shards_[LruCache::key_hash(key) % shards_.size()]; }
+
+    // The roll failed, so the segment with these keys' records stays: mark
+    // them written there, unless a newer set (recorded after them) is
+    // pending, or a crash would replay them over later normal writes.
+    void forget_written(const std::vector<std::pair<std::string, std::string>>& written) {
+        std::lock_guard<std::mutex> order(order_mu_);
+        for (auto& kv : written) {
+            Shard& s = shard(kv.first);
+            {
+                std::lock_guard<std::mutex> lock(s.mu);
+                if (s.values.count(kv.first)) continue;
+            }
+            journal_->forget(kv.first);
+        }
+    }
+
+    void wait_for_room() {
+        stalls_++;
+        {
+            std::lock_guard<std::mutex> lock(wake_mu_);
+            urgent_ = true;
+        }
+        wake_.notify_one();
+        std::unique_lock<std::mutex> lock(room_mu_);
+        room_.wait(lock, [this] { return count_ < (int64_t)max_dirty_ || !running_; });
+    }
+
+    Storage& storage_;
+    int flush_ms_;
+    std::vector<Shard> shards_;
+    std::atomic<int64_t> count_{0};  // keys pending or in flight; 0 = reads skip the lookup
+    size_t max_dirty_ = 0, batch_ = 500;
+
+    WriteJournal* journal_ = nullptr;
+    std::mutex order_mu_;  // journal: record order = shard order (sets, flush, settle)
+
+    std::mutex inflight_mu_;
+    std::unordered_map<std::string, std::string> inflight_;
+
+    std::mutex flush_mu_;
+    bool failing_ = false;  // flush_mu_
+    std::atomic<uint64_t> accepted_{0}, coalesced_{0}, flushed_{0}, stalls_{0}, failures_{0};
+
+    std::function<void(const std::string&, const std::string&, uint64_t)> on_flushed_;
+
+    std::atomic<bool> running_{false};
+    std::thread flusher_;
+    std::mutex wake_mu_;
+    std::condition_variable wake_;
+    bool urgent_ = false;  // wake_mu_: a set is waiting for room
+    std::mutex room_mu_;
+    std::condition_variable room_;
+};
+
+#endif
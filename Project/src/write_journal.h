@@ -0,0 +1,226 @@
+#ifndef KV_WRITE_JOURNAL_H
+#define KV_WRITE_JOURNAL_H
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Append-only journal of write-back sets (--write-back PATH). A set is
+// acknowledged once its record is written here, before storage has it.
+// The journal is split into segments PATH.1, PATH.2, ...: the coalescer
+// starts a new one at every flush (roll(), then sync_rolled() outside its
+// locks) and deletes the old ones once storage has everything in them
+// (drop_through()). After a crash open()
+// hands back every record of the segments left over, oldest first.
+//
+// Record: u32 key length | u32 value length | u32 checksum | key | value
+// (host byte order). A value length of kForget marks "the key's earlier
+// records are in storage already". A bad checksum or short record ends a
+// segment (torn write).
+//
+// write() alone survives a crash of the process. For a crash of the machine
+// the active segment is fdatasync'ed every sync_ms (0 = never), so up to
+// sync_ms of acknowledged sets can be lost then.
+class WriteJournal {
+public:
+    static const uint32_t kForget = 0xffffffffu;
+
+    WriteJournal(const std::string& path, int sync_ms) : path_(path), sync_ms_(sync_ms) {}
+
+    ~WriteJournal() {
+        stop();
+        sync_rolled();
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    // Calls fn(key, value, forget) for every record left by the last run,
+    // then starts a fresh segment after them.
+    bool open(std::function<void(const std::string&, const std::string&, bool)> fn) {
+        std::vector<uint64_t> found = list_segments();
+        std::string data;
+        for (uint64_t n : found) {
+            if (!read_file(segment(n), data)) {
+                perror(segment(n).c_str());
+                return false;
+            }
+            size_t pos = 0;
+            while (data.size() - pos >= 12) {
+                uint32_t klen, vlen, sum;
+                memcpy(&klen, data.data() + pos, 4);
+                memcpy(&vlen, data.data() + pos + 4, 4);
+                memcpy(&sum, data.data() + pos + 8, 4);
+                size_t vbytes = vlen == kForget ? 0 : vlen;
+                if (data.size() - pos - 12 < (size_t)klen + vbytes) break;
+                const char* k = data.data() + pos + 12;
+                if (checksum(klen, vlen, k, k + klen) != sum) break;  // torn tail
+                fn(std::string(k, klen), std::string(k + klen, vbytes), vlen == kForget);
+                replayed_++;
+                pos += 12 + klen + vbytes;
+            }
+        }
+        first_ = found.empty() ? 1 : found.front();
+        active_ = found.empty() ? 1 : found.back() + 1;
+        fd_ = ::open(segment(active_).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (fd_ < 0) {
+            perror(segment(active_).c_str());
+            return false;
+        }
+        if (sync_ms_ > 0) {
+            running_ = true;
+            syncer_ = std::thread([this] { run_syncer(); });
+        }
+        return true;
+    }
+
+    void stop() {
+        if (!running_.exchange(false)) return;
+        wake_.notify_all();
+        syncer_.join();
+    }
+
+    // Caller serializes appends and rolls.
+    bool append(const std::string& key, const std::string& value) { return write_record(key, value, (uint32_t)value.size()); }
+    bool forget(const std::string& key) { return write_record(key, std::string(), kForget); }
+
+    // Starts a new segment; returns the last one that may hold older records,
+    // or 0 if the next one could not be opened (appends stay in the current
+    // segment, which then can't be dropped). Only the flusher rolls, so
+    // active_ is stable here.
+    uint64_t roll() {
+        int fd = ::open(segment(active_ + 1).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (fd < 0) {
+            perror("write-back journal");
+            return 0;
+        }
+        std::lock_guard<std::mutex> lock(fd_mu_);
+        rolled_fd_ = fd_;
+        fd_ = fd;
+        return active_++;
+    }
+
+    // Syncs and closes the segment the last roll() closed. Flusher only.
+    void sync_rolled() {
+        if (rolled_fd_ < 0) return;
+        if (sync_ms_ > 0) fdatasync(rolled_fd_);  // stays until storage has it, maybe long
+        ::close(rolled_fd_);
+        rolled_fd_ = -1;
+    }
+
+    // Storage has every record in segments <= n.
+    void drop_through(uint64_t n) {
+        std::lock_guard<std::mutex> lock(fd_mu_);
+        for (; first_ <= n && first_ < active_; ++first_) unlink(segment(first_).c_str());
+    }
+
+    uint64_t replayed() const { return replayed_; }
+    uint64_t bytes() const { return bytes_; }
+    uint64_t segments() {
+        std::lock_guard<std::mutex> lock(fd_mu_);
+        return active_ - first_ + 1;
+    }
+
+private:
+    static uint32_t checksum(uint32_t klen, uint32_t vlen, const char* key, const char* value) {
+        uint32_t h = 2166136261u;
+        auto mix = [&](const void* d, size_t n) {
+            const unsigned char* p = (const unsigned char*)d;
+            for (size_t i = 0; i < n; ++i) { h ^= p[i]; h *= 16777619u; }
+        };
+        mix(&klen, 4);
+        mix(&vlen, 4);
+        mix(key, klen);
+        if (vlen != kForget) mix(value, vlen);
+        return h;
+    }
+
+    bool write_record(const std::string& key, const std::string& value, uint32_t vlen) {
+        uint32_t klen = (uint32_t)key.size(), sum = checksum(klen, vlen, key.data(), value.data());
+        std::string rec;
+        rec.reserve(12 + key.size() + value.size());
+        rec.append((const char*)&klen, 4);
+        rec.append((const char*)&vlen, 4);
+        rec.append((const char*)&sum, 4);
+        rec += key;
+        rec += value;
+        std::lock_guard<std::mutex> lock(fd_mu_);
+        if (write(fd_, rec.data(), rec.size()) != (ssize_t)rec.size()) return false;
+        bytes_ += rec.size();
+        return true;
+    }
+
+    std::string segment(uint64_t n) const { return path_ + "." + std::to_string(n); }
+
+    // PATH.<n> files in PATH's directory, in order.
+    std::vector<uint64_t> list_segments() const {
+        size_t slash = path_.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : path_.substr(0, slash);
+        std::string base = (slash == std::string::npos ? path_ : path_.substr(slash + 1)) + ".";
+        std::vector<uint64_t> out;
+        DIR* d = opendir(dir.c_str());
+        if (!d) return out;
+        while (struct dirent* e = readdir(d)) {
+            std::string name = e->d_name;
+            if (name.compare(0, base.size(), base) != 0 || name.size() == base.size()) continue;
+            std::string num = name.substr(base.size());
+            if (num.find_first_not_of("0123456789") != std::string::npos) continue;
+            out.push_back(strtoull(num.c_str(), NULL, 10));
+        }
+        closedir(d);
+        std::sort(out.begin(), out.end());
+        return out;
+    }
+
+    static bool read_file(const std::string& path, std::string& out) {
+        FILE* f = fopen(path.c_str(), "rb");
+        if (!f) return false;
+        char buf[65536];
+        size_t n;
+        out.clear();
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) out.append(buf, n);
+        fclose(f);
+        return true;
+    }
+
+    void run_syncer() {
+        std::unique_lock<std::mutex> lock(wake_mu_);
+        while (running_) {
+            wake_.wait_for(lock, std::chrono::milliseconds(sync_ms_));
+            int fd;
+            {
+                std::lock_guard<std::mutex> fd_lock(fd_mu_);
+                fd = dup(fd_);  // appends go on while this syncs
+            }
+            if (fd < 0) continue;
+            fdatasync(fd);
+            ::close(fd);
+        }
+    }
+
+    std::string path_;
+    int sync_ms_;
+    std::mutex fd_mu_;  // fd_, first_, active_
+    int fd_ = -1;
+    int rolled_fd_ = -1;  // flusher only
+    uint64_t first_ = 1, active_ = 1;
+    std::atomic<uint64_t> replayed_{0}, bytes_{0};
+
+    std::atomic<bool> running_{false};
+    std::thread syncer_;
+    std::mutex wake_mu_;
+    std::condition_variable wake_;
+};
+
+#endif